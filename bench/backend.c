@@ -0,0 +1,119 @@
+// Backend benchmark: generates the assembly of a synthetic program and
+// compares how long the built-in assembler and nasm take to turn it into an
+// object file.
+//   make bench-backend
+#define main ssol_main
+#include "../ssol.c"
+#undef main
+
+#include <time.h>
+
+#define BENCH_PROCS 5000
+#define BENCH_RUNS 5
+#define BENCH_NASM_RUNS 2
+
+char *bench_src_path = "ssol-bench-backend.ssol";
+
+void bench_generate_source() {
+    FILE *f = fopen(bench_src_path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "[ERROR] can't create '%s'\n", bench_src_path);
+        exit(1);
+    }
+    fprintf(f, "var counter long end\n");
+    for (size_t i = 0; i < BENCH_PROCS; i++) {
+        fprintf(f, "proc bench-proc-%lu\n", i);
+        fprintf(f, "    = var n%lu long end\n", i);
+        fprintf(f, "    var buf byte 16 end\n");
+        fprintf(f, "    0 loop dup n%lu < do\n", i);
+        fprintf(f, "        if dup 3 %% 0 == swap 5 %% 0 != | do\n");
+        fprintf(f, "            dup rot + swap counter 1 + = counter\n");
+        fprintf(f, "        else\n");
+        fprintf(f, "            dup 255 & = buf[0] $buf @byte drop\n");
+        fprintf(f, "        end\n");
+        fprintf(f, "        1 +\n");
+        fprintf(f, "    end drop \"proc %lu done\\n\" 1 1 syscall3 drop\n", i);
+        fprintf(f, "end\n");
+    }
+    fprintf(f, "proc main\n");
+    for (size_t i = 0; i < BENCH_PROCS; i++) {
+        fprintf(f, "    10 bench-proc-%lu\n", i);
+    }
+    fprintf(f, "end\n");
+    fclose(f);
+}
+
+double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+char *bench_read(char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "[ERROR] can't read '%s'\n", path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *text = malloc(*len + 1);
+    if (fread(text, 1, *len, f) != *len) {
+        fprintf(stderr, "[ERROR] can't read '%s'\n", path);
+        exit(1);
+    }
+    fclose(f);
+    return text;
+}
+
+int main() {
+    if (chdir("/tmp") == -1) {
+        fprintf(stderr, "[ERROR] can't enter /tmp\n");
+        return 1;
+    }
+    bench_generate_source();
+    program_init();
+    program.emit_asm = 1;
+    file_open(1, bench_src_path, 0);
+    generate_assembly_x86_64_linux();
+    file_close();
+
+    size_t len;
+    char *text = bench_read("file1.asm", &len);
+    char *scratch = malloc(len + 1);
+    double best = 0;
+    for (size_t run = 0; run < BENCH_RUNS; run++) {
+        // the assembler writes over its input, so each run gets a fresh copy
+        memcpy(scratch, text, len);
+        double start = bench_now();
+        asm_assemble(scratch, len, "file1.asm", "file1.o");
+        double elapsed = bench_now() - start;
+        if (run == 0 || elapsed < best) best = elapsed;
+    }
+    printf("built-in: %.1f KB of asm in %.3f ms (%.2f MB/s)\n", len / 1e3, best * 1e3, len / best / 1e6);
+
+    double nasm = 0;
+    for (size_t run = 0; run < BENCH_NASM_RUNS; run++) {
+        double start = bench_now();
+        int status = system("nasm -felf64 -g file1.asm -o file1-nasm.o");
+        double elapsed = bench_now() - start;
+        if (status != 0) {
+            printf("nasm: not available, skipped\n");
+            nasm = 0;
+            break;
+        }
+        if (run == 0 || elapsed < nasm) nasm = elapsed;
+    }
+    if (nasm > 0) {
+        printf("nasm:     %.1f KB of asm in %.3f ms (built-in is %.1fx faster)\n", len / 1e3, nasm * 1e3, nasm / best);
+    }
+
+    free(text);
+    free(scratch);
+    remove(bench_src_path);
+    remove("file1.asm");
+    remove("file1.o");
+    remove("file1-nasm.o");
+    return 0;
+}
@@ -0,0 +1,255 @@
+// Compiler throughput benchmark: generates programs from 10k to 10M tokens
+// (deep if/loop nesting, procs with locals, big string tables and several
+// imported modules), compiles them with ./ssol --time-report=json and
+// reports tokens per second for every phase and the peak RSS. The numbers
+// are checked against bench/compiler-baseline.txt, which was recorded on
+// the machine that last ran --save, so refresh it when moving to another.
+//   make bench-compiler         compare against the baseline
+//   make bench-compiler-save    record a new baseline
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#define BENCH_MODULES 8
+#define BENCH_DEPTH 6
+#define BENCH_TOLERANCE 0.25
+
+char *bench_dir = "/tmp/ssol-bench-compiler";
+char *baseline_path = "bench/compiler-baseline.txt";
+
+size_t sizes[] = {10000, 100000, 1000000, 10000000};
+size_t runs[] = {5, 3, 2, 1};
+
+enum {
+    BENCH_LEX,
+    BENCH_PARSE,
+    BENCH_CODEGEN,
+    BENCH_ASSEMBLE,
+    BENCH_TOTAL,
+    BENCH_PHASES
+};
+
+char *phase_name[BENCH_PHASES] = {"lex", "parse", "codegen", "assemble", "total"};
+char *phase_key[BENCH_PHASES] = {"\"lex_ms\":", "\"parse_ms\":", "\"codegen_ms\":", "\"assemble_ms\":", "\"total_ms\":"};
+
+typedef struct {
+    size_t tokens;
+    double ms[BENCH_PHASES];
+    long peak_kb;
+} result_t;
+
+// one proc is about 118 tokens, with an if/loop nest BENCH_DEPTH deep
+void bench_proc(FILE *f, size_t module, size_t proc) {
+    fprintf(f, "proc m%lu-p%lu\n", module, proc);
+    fprintf(f, "    = var n long end\n");
+    fprintf(f, "    var acc long end\n");
+    fprintf(f, "    var buf byte 32 end\n");
+    fprintf(f, "    0 = acc\n");
+    for (size_t d = 0; d < BENCH_DEPTH; d++) {
+        if (d % 2 == 0) {
+            fprintf(f, "%*s0 loop dup n < do\n", (int)(4 + d * 4), "");
+        } else {
+            fprintf(f, "%*sif dup %lu %% 0 == do\n", (int)(4 + d * 4), "", d + 1);
+        }
+    }
+    fprintf(f, "%*sdup acc + = acc\n", (int)(4 + BENCH_DEPTH * 4), "");
+    fprintf(f, "%*sdup 255 & = buf[0] $buf @byte drop\n", (int)(4 + BENCH_DEPTH * 4), "");
+    for (size_t d = BENCH_DEPTH; d-- > 0;) {
+        if (d % 2 == 0) {
+            fprintf(f, "%*s1 +\n", (int)(8 + d * 4), "");
+            fprintf(f, "%*send drop\n", (int)(4 + d * 4), "");
+        } else {
+            fprintf(f, "%*selse\n", (int)(4 + d * 4), "");
+            fprintf(f, "%*sacc 1 - = acc\n", (int)(8 + d * 4), "");
+            fprintf(f, "%*send\n", (int)(4 + d * 4), "");
+        }
+    }
+    fprintf(f, "    \"module %lu proc %lu has its own string\\n\" drop drop\n", module, proc);
+    fprintf(f, "    acc\n");
+    fprintf(f, "end\n");
+}
+
+// writes the modules and main.ssol for a program of about 'tokens' tokens,
+// returns the number of files written
+size_t bench_generate(size_t tokens) {
+    size_t procs = tokens / 118 / BENCH_MODULES + 1;
+    char path[PATH_MAX];
+    for (size_t m = 0; m < BENCH_MODULES; m++) {
+        sprintf(path, "%s/m%lu.ssol", bench_dir, m);
+        FILE *f = fopen(path, "w");
+        if (f == NULL) {
+            fprintf(stderr, "[ERROR] can't create '%s'\n", path);
+            exit(1);
+        }
+        if (m > 0) fprintf(f, "import \"m%lu.ssol\"\n", m - 1);
+        for (size_t p = 0; p < procs; p++) {
+            bench_proc(f, m, p);
+        }
+        fprintf(f, "proc m%lu-entry\n", m);
+        for (size_t p = 0; p < procs; p++) {
+            fprintf(f, "    3 m%lu-p%lu drop\n", m, p);
+        }
+        fprintf(f, "end\nexport\n    m%lu-entry\nend\n", m);
+        fclose(f);
+    }
+    sprintf(path, "%s/main.ssol", bench_dir);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "[ERROR] can't create '%s'\n", path);
+        exit(1);
+    }
+    for (size_t m = 0; m < BENCH_MODULES; m++) {
+        fprintf(f, "import \"m%lu.ssol\"\n", m);
+    }
+    fprintf(f, "proc main\n");
+    for (size_t m = 0; m < BENCH_MODULES; m++) {
+        fprintf(f, "    m%lu-entry\n", m);
+    }
+    fprintf(f, "end\n");
+    fclose(f);
+    return BENCH_MODULES + 1;
+}
+
+// sums every 'key' number in the json report
+double json_sum(char *json, char *key) {
+    double sum = 0;
+    for (char *at = strstr(json, key); at != NULL; at = strstr(at + 1, key)) {
+        sum += atof(at + strlen(key));
+    }
+    return sum;
+}
+
+result_t bench_compile(char *ssol) {
+    char cmd[PATH_MAX * 2];
+    int len = sprintf(cmd, "cd %s && %s --no-cache --time-report=json", bench_dir, ssol);
+    for (size_t m = 0; m < BENCH_MODULES; m++) {
+        len += sprintf(cmd + len, " m%lu.ssol", m);
+    }
+    sprintf(cmd + len, " main.ssol 2>/dev/null");
+    FILE *p = popen(cmd, "r");
+    if (p == NULL) {
+        fprintf(stderr, "[ERROR] can't run '%s'\n", ssol);
+        exit(1);
+    }
+    char *json = NULL;
+    size_t cap = 0;
+    ssize_t n = getline(&json, &cap, p);
+    if (pclose(p) != 0 || n <= 0) {
+        fprintf(stderr, "[ERROR] compiling the generated program failed\n");
+        exit(1);
+    }
+    result_t r = {0};
+    r.tokens = json_sum(json, "\"tokens\":");
+    for (int i = 0; i < BENCH_PHASES; i++) {
+        r.ms[i] = json_sum(json, phase_key[i]);
+    }
+    // the last peak in the report is the one for the whole build
+    char *peak = NULL;
+    for (char *at = strstr(json, "\"peak_rss_kb\":"); at != NULL; at = strstr(at + 1, "\"peak_rss_kb\":")) {
+        peak = at;
+    }
+    r.peak_kb = peak != NULL ? atol(peak + strlen("\"peak_rss_kb\":")) : 0;
+    free(json);
+    return r;
+}
+
+double tokens_per_sec(result_t *r, int phase) {
+    return r->ms[phase] > 0 ? r->tokens / (r->ms[phase] / 1e3) : 0;
+}
+
+int main(int argc, char **argv) {
+    int save = argc > 1 && strcmp(argv[1], "--save") == 0;
+    char ssol[PATH_MAX];
+    if (realpath("ssol", ssol) == NULL) {
+        fprintf(stderr, "[ERROR] run from the repository root after 'make ssol'\n");
+        return 1;
+    }
+    char cmd[PATH_MAX];
+    sprintf(cmd, "mkdir -p %s", bench_dir);
+    if (system(cmd) != 0) return 1;
+
+    size_t count = sizeof(sizes) / sizeof(*sizes);
+    result_t results[sizeof(sizes) / sizeof(*sizes)];
+    printf("%10s", "tokens");
+    for (int i = 0; i < BENCH_PHASES; i++) {
+        printf(" %11s", phase_name[i]);
+    }
+    printf(" %10s   (tokens/s)\n", "peak KB");
+    for (size_t s = 0; s < count; s++) {
+        bench_generate(sizes[s]);
+        result_t best = {0};
+        for (size_t run = 0; run < runs[s]; run++) {
+            result_t r = bench_compile(ssol);
+            best.tokens = r.tokens;
+            best.peak_kb = r.peak_kb;
+            for (int i = 0; i < BENCH_PHASES; i++) {
+                if (run == 0 || r.ms[i] < best.ms[i]) best.ms[i] = r.ms[i];
+            }
+        }
+        results[s] = best;
+        printf("%10lu", best.tokens);
+        for (int i = 0; i < BENCH_PHASES; i++) {
+            printf(" %11.0f", tokens_per_sec(&best, i));
+        }
+        printf(" %10ld\n", best.peak_kb);
+        fflush(stdout);
+    }
+    sprintf(cmd, "rm -rf %s", bench_dir);
+    if (system(cmd) != 0) return 1;
+
+    if (save) {
+        FILE *f = fopen(baseline_path, "w");
+        if (f == NULL) {
+            fprintf(stderr, "[ERROR] can't write '%s'\n", baseline_path);
+            return 1;
+        }
+        fprintf(f, "# tokens, tokens/s for lex parse codegen assemble total, peak KB\n");
+        for (size_t s = 0; s < count; s++) {
+            fprintf(f, "%lu", results[s].tokens);
+            for (int i = 0; i < BENCH_PHASES; i++) {
+                fprintf(f, " %.0f", tokens_per_sec(&results[s], i));
+            }
+            fprintf(f, " %ld\n", results[s].peak_kb);
+        }
+        fclose(f);
+        printf("baseline saved to %s\n", baseline_path);
+        return 0;
+    }
+
+    FILE *f = fopen(baseline_path, "r");
+    if (f == NULL) {
+        printf("no baseline at %s, run 'make bench-compiler-save'\n", baseline_path);
+        return 0;
+    }
+    int regressions = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#') continue;
+        result_t base = {0};
+        double rate[BENCH_PHASES];
+        if (sscanf(line, "%lu %lf %lf %lf %lf %lf %ld", &base.tokens, &rate[0], &rate[1], &rate[2], &rate[3], &rate[4], &base.peak_kb) != 7) continue;
+        for (size_t s = 0; s < count; s++) {
+            // sizes are approximate, match the run that's within 10% of the baseline
+            if (results[s].tokens < base.tokens * 0.9 || results[s].tokens > base.tokens * 1.1) continue;
+            for (int i = 0; i < BENCH_PHASES; i++) {
+                double now = tokens_per_sec(&results[s], i);
+                if (now < rate[i] * (1 - BENCH_TOLERANCE)) {
+                    printf("REGRESSION: %s at %lu tokens, %.0f tokens/s (baseline %.0f)\n", phase_name[i], results[s].tokens, now, rate[i]);
+                    regressions++;
+                }
+            }
+            if (results[s].peak_kb > base.peak_kb * (1 + BENCH_TOLERANCE)) {
+                printf("REGRESSION: peak memory at %lu tokens, %ld KB (baseline %ld KB)\n", results[s].tokens, results[s].peak_kb, base.peak_kb);
+                regressions++;
+            }
+        }
+    }
+    fclose(f);
+    if (regressions == 0) {
+        printf("no regressions against %s\n", baseline_path);
+    }
+    return regressions != 0;
+}
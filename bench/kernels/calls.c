@@ -0,0 +1,20 @@
+#include <stdio.h>
+
+__attribute__((noinline)) unsigned long sq(unsigned long x) {
+    return x * x;
+}
+
+__attribute__((noinline)) unsigned long step(unsigned long x) {
+    return (x * 3 + 1) % 1000003;
+}
+
+int main() {
+    unsigned long acc = 0;
+    unsigned long x = 1;
+    for (unsigned long i = 0; i < 20000000; i++) {
+        x = step(x);
+        acc += sq(x);
+    }
+    printf("%lu\n", acc);
+    return 0;
+}
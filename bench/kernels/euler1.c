@@ -0,0 +1,10 @@
+#include <stdio.h>
+
+int main() {
+    unsigned long acc = 0;
+    for (unsigned long i = 0; i < 30000000; i++) {
+        if (i % 3 == 0 || i % 5 == 0) acc += i;
+    }
+    printf("%lu\n", acc);
+    return 0;
+}
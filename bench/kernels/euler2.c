@@ -0,0 +1,16 @@
+#include <stdio.h>
+
+int main() {
+    unsigned long acc = 0;
+    for (unsigned long i = 0; i < 1000000; i++) {
+        unsigned long a = 0, b = 1;
+        while (b < 4000000 + i) {
+            unsigned long c = a + b;
+            a = b;
+            b = c;
+            if (b % 2 == 0) acc += b;
+        }
+    }
+    printf("%lu\n", acc);
+    return 0;
+}
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+typedef struct {
+    long count;
+    long alloc;
+    long type;
+    char is_prim;
+    char data[];
+} list_t;
+
+char *list_create(long type) {
+    list_t *head = malloc(sizeof(list_t) + type);
+    head->type = type;
+    head->count = 0;
+    head->alloc = 1;
+    return head->data;
+}
+
+list_t *list_head(char *list) {
+    return (list_t *)(list - offsetof(list_t, data));
+}
+
+char *list_idx(char *list, long idx) {
+    return list + idx * list_head(list)->type;
+}
+
+void list_push(char **list_adr, void *val) {
+    list_t *head = list_head(*list_adr);
+    head->count++;
+    if (head->count > head->alloc) {
+        head->alloc *= 2;
+        list_t *next = malloc(sizeof(list_t) + head->alloc * head->type);
+        memcpy(next, head, sizeof(list_t) + (head->count - 1) * head->type);
+        free(head);
+        head = next;
+    }
+    memcpy(list_idx(head->data, head->count - 1), val, head->type);
+    *list_adr = head->data;
+}
+
+int main() {
+    char *numbers = list_create(sizeof(long));
+    for (long i = 0; i < 1000000; i++) {
+        list_push(&numbers, &i);
+    }
+    long acc = 0;
+    for (long i = 0; i < list_head(numbers)->count; i++) {
+        acc += *(long *)list_idx(numbers, i);
+    }
+    printf("%ld\n", acc);
+    free(list_head(numbers));
+    return 0;
+}
@@ -0,0 +1,23 @@
+#include <unistd.h>
+
+#define WIDTH 4096
+
+int main() {
+    unsigned char board[WIDTH] = {0};
+    char write_buf[WIDTH + 1];
+    board[WIDTH - 2] = 1;
+    for (int gen = 0; gen < 4000; gen++) {
+        for (int i = 0; i < WIDTH; i++) {
+            write_buf[i] = " #"[board[i]];
+        }
+        write_buf[WIDTH] = '\n';
+        write(1, write_buf, sizeof(write_buf));
+
+        int pattern = board[0] << 1 | board[1];
+        for (int i = 1; i < WIDTH - 1; i++) {
+            pattern = (pattern << 1 & 7) | board[i + 1];
+            board[i] = 110 >> pattern & 1;
+        }
+    }
+    return 0;
+}
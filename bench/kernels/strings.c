@@ -0,0 +1,8 @@
+#include <unistd.h>
+
+int main() {
+    for (int i = 0; i < 500000; i++) {
+        write(1, "the quick brown fox jumps over the lazy dog\n", 44);
+    }
+    return 0;
+}
@@ -0,0 +1,70 @@
+// Lexer microbenchmark: generates a synthetic source file and reports how
+// many tokens per second lex_file can classify.
+//   make bench-lex
+#define main ssol_main
+#include "../ssol.c"
+#undef main
+
+#include <time.h>
+
+#define BENCH_PROCS 20000
+#define BENCH_RUNS 5
+
+char *bench_src_path = "/tmp/ssol-bench-lex.ssol";
+
+void bench_generate_source() {
+    FILE *f = fopen(bench_src_path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "[ERROR] can't create '%s'\n", bench_src_path);
+        exit(1);
+    }
+    fprintf(f, "var counter long end\n");
+    for (size_t i = 0; i < BENCH_PROCS; i++) {
+        fprintf(f, "// procedure number %lu\n", i);
+        fprintf(f, "proc bench-proc-%lu\n", i);
+        fprintf(f, "    = var n%lu long end\n", i);
+        fprintf(f, "    var buf byte 16 end\n");
+        fprintf(f, "    0 loop dup n%lu < do\n", i);
+        fprintf(f, "        if dup 3 %% 0 == swap 5 %% 0 != | do\n");
+        fprintf(f, "            dup rot + swap counter 1 + = counter\n");
+        fprintf(f, "        else\n");
+        fprintf(f, "            dup 255 & = buf[0] $buf @byte drop\n");
+        fprintf(f, "        end\n");
+        fprintf(f, "        1 +\n");
+        fprintf(f, "    end drop \"proc %lu done\\n\" 1 1 syscall3 drop\n", i);
+        fprintf(f, "end\n");
+    }
+    fclose(f);
+}
+
+double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_reset() {
+    arrfree(program.tokens);
+    arrfree(program.positions);
+    file_close();
+    program.tokens = NULL;
+    program.positions = NULL;
+}
+
+int main() {
+    bench_generate_source();
+    program_init();
+    double best = 0;
+    size_t tokens = 0;
+    for (size_t run = 0; run < BENCH_RUNS; run++) {
+        double start = bench_now();
+        file_open(1, bench_src_path, 0);
+        double elapsed = bench_now() - start;
+        tokens = arrlenu(program.tokens);
+        if (run == 0 || elapsed < best) best = elapsed;
+        bench_reset();
+    }
+    printf("lex_file: %lu tokens in %.3f ms (%.2f Mtokens/s)\n", tokens, best * 1e3, tokens / best / 1e6);
+    remove(bench_src_path);
+    return 0;
+}
@@ -0,0 +1,157 @@
+// Runtime benchmark: compiles the kernels in bench/kernels with ./ssol -O2 and
+// their C equivalents with gcc -O2, checks both print the same thing and
+// reports the best wall time of each, the ssol/C ratio, the user-space
+// instruction counts (when 'perf' is installed) and the size of the binaries.
+//   make bench-runtime
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define BENCH_RUNS 5
+
+char *bench_dir = "/tmp/ssol-bench-runtime";
+char *kernel_dir = "bench/kernels";
+
+char *kernels[] = {"euler1", "euler2", "rule110", "list", "strings", "calls"};
+
+typedef struct {
+    double ms;
+    long instructions;
+    long size;
+} result_t;
+
+double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_system(char *cmd) {
+    if (system(cmd) != 0) {
+        fprintf(stderr, "[ERROR] '%s' failed\n", cmd);
+        exit(1);
+    }
+}
+
+// runs 'bin' with its output going to 'out', returns the wall time in ms
+double bench_run(char *bin, char *out) {
+    double start = bench_now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || dup2(fd, 1) == -1) _exit(127);
+        execl(bin, bin, (char *)NULL);
+        _exit(127);
+    }
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "[ERROR] running '%s' failed\n", bin);
+        exit(1);
+    }
+    return (bench_now() - start) * 1e3;
+}
+
+// user-space instructions retired by 'bin', -1 when perf can't count them
+long bench_instructions(char *bin) {
+    char cmd[PATH_MAX * 2];
+    sprintf(cmd, "perf stat -x, -e instructions:u -o %s/perf.txt %s >/dev/null 2>&1", bench_dir, bin);
+    if (system(cmd) != 0) return -1;
+    sprintf(cmd, "%s/perf.txt", bench_dir);
+    FILE *f = fopen(cmd, "r");
+    if (f == NULL) return -1;
+    long count = -1;
+    char line[512];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strstr(line, "instructions") != NULL) {
+            char *end;
+            long n = strtol(line, &end, 10);
+            if (end != line) count = n;
+        }
+    }
+    fclose(f);
+    return count;
+}
+
+result_t bench_kernel(char *bin, char *out) {
+    result_t r = {0};
+    for (size_t run = 0; run < BENCH_RUNS; run++) {
+        double ms = bench_run(bin, out);
+        if (run == 0 || ms < r.ms) r.ms = ms;
+    }
+    r.instructions = bench_instructions(bin);
+    struct stat st;
+    r.size = stat(bin, &st) == 0 ? st.st_size : 0;
+    return r;
+}
+
+int bench_same_output(char *a, char *b) {
+    FILE *fa = fopen(a, "rb");
+    FILE *fb = fopen(b, "rb");
+    int same = fa != NULL && fb != NULL;
+    while (same) {
+        int ca = fgetc(fa);
+        int cb = fgetc(fb);
+        if (ca != cb) same = 0;
+        if (ca == EOF) break;
+    }
+    if (fa != NULL) fclose(fa);
+    if (fb != NULL) fclose(fb);
+    return same;
+}
+
+void print_instructions(long n) {
+    if (n < 0) {
+        printf(" %12s", "n/a");
+    } else {
+        printf(" %12ld", n);
+    }
+}
+
+int main() {
+    char ssol[PATH_MAX];
+    char kernels_path[PATH_MAX];
+    if (realpath("ssol", ssol) == NULL || realpath(kernel_dir, kernels_path) == NULL) {
+        fprintf(stderr, "[ERROR] run from the repository root after 'make ssol'\n");
+        return 1;
+    }
+    char cmd[PATH_MAX * 4];
+    sprintf(cmd, "mkdir -p %s", bench_dir);
+    bench_system(cmd);
+
+    printf("%-10s %10s %10s %7s %12s %12s %10s %10s\n", "kernel", "ssol ms", "C ms", "ratio", "ssol instr", "C instr", "ssol B", "C B");
+    int wrong = 0;
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(*kernels); k++) {
+        char ssol_bin[PATH_MAX], c_bin[PATH_MAX], ssol_out[PATH_MAX], c_out[PATH_MAX];
+        sprintf(ssol_bin, "%s/%s-ssol", bench_dir, kernels[k]);
+        sprintf(c_bin, "%s/%s-c", bench_dir, kernels[k]);
+        sprintf(ssol_out, "%s/%s-ssol.out", bench_dir, kernels[k]);
+        sprintf(c_out, "%s/%s-c.out", bench_dir, kernels[k]);
+        sprintf(cmd, "cd %s && %s --no-cache -O2 %s/%s.ssol >/dev/null 2>&1 && mv output %s-ssol", bench_dir, ssol, kernels_path, kernels[k], kernels[k]);
+        bench_system(cmd);
+        sprintf(cmd, "gcc -O2 %s/%s.c -o %s", kernels_path, kernels[k], c_bin);
+        bench_system(cmd);
+
+        result_t s = bench_kernel(ssol_bin, ssol_out);
+        result_t c = bench_kernel(c_bin, c_out);
+        printf("%-10s %10.1f %10.1f %6.2fx", kernels[k], s.ms, c.ms, c.ms > 0 ? s.ms / c.ms : 0);
+        print_instructions(s.instructions);
+        print_instructions(c.instructions);
+        printf(" %10ld %10ld", s.size, c.size);
+        if (!bench_same_output(ssol_out, c_out)) {
+            printf("  WRONG OUTPUT");
+            wrong++;
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+    sprintf(cmd, "rm -rf %s", bench_dir);
+    bench_system(cmd);
+    return wrong != 0;
+}
@@ -18,16 +18,38 @@ SOFTWARE.
 ---------------------------------------------------------------------------------------
 The library can be finded in here: https://github.com/nothings/stb/blob/master/stb_ds.h
 */
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <string.h>
 #include <assert.h>
 #include <libgen.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <elf.h>
 
+// stb_ds needs typeof to take rvalues (like arrpop) as hash map keys
+#define typeof __typeof__
 #define STB_DS_IMPLEMENTATION
 #include "stb_ds.h"
 
 #define RET_STACK_CAP 65536 // 64kb
+// cached objects are only good for the compiler that made them, the
+// Makefile passes a checksum of this file so every change to it starts a
+// new cache. builds that don't all share "unknown"
+#ifndef SSOL_SOURCE
+#define SSOL_SOURCE "unknown"
+#endif
+#define SSOL_VERSION "ssol " SSOL_SOURCE
+#define CACHE_DIR ".ssol-cache"
 
 typedef struct {
     char *file;
@@ -109,21 +131,32 @@ typedef struct {
     } operation;
     char *val;
     size_t jmp;
+    // what the token refers to, filled by parse_current_token so the code
+    // generator never has to look it up, it points into a symbol map so it's
+    // only good until the next insertion on that map
+    union {
+        struct var_t *var;
+        struct proc_t *proc;
+        struct vartype_t *vartype;
+        struct str_t *str;
+        size_t *export;
+    } ref;
 } token_t;
 
-typedef struct {
+typedef struct vartype_t {
     char *name;
     size_t size_bytes;
     int primitive;
     // TODO: add member vars to types
 } vartype_t;
 
-typedef struct {
+typedef struct var_t {
     char *name;
-    char *type;
+    vartype_t *type;
     int arr;
     size_t cap;
     size_t adr;
+    int local;
     int constant;
     // TODO: make the const_val be just a size_t and make constants be from 'long' type automatically
     union {
@@ -134,21 +167,66 @@ typedef struct {
     } const_val;
 } var_t;
 
-typedef struct {
+typedef struct str_t {
     char *str;
     size_t len;
     size_t adr;
 } str_t;
 
-typedef struct {
+typedef struct proc_t {
     char *name;
     size_t adr;
     size_t end;
     size_t file_num;
     struct { char *key; var_t value; } *vars;
     size_t local_var_capacity;
+    int in;  // stack effect, -1 when it isn't known
+    int out;
 } proc_t;
 
+enum {
+    PHASE_LEX,
+    PHASE_PARSE,
+    PHASE_CODEGEN,
+    PHASE_OPT,
+    PHASE_ASSEMBLE,
+    PHASE_CACHE,
+    PHASE_COUNT
+};
+
+char *phase_name[PHASE_COUNT] = {"lex", "parse", "codegen", "opt", "assemble", "cache"};
+
+// what --time-report shows for a module
+typedef struct {
+    char *file;
+    size_t tokens;
+    int cached;
+    double time[PHASE_COUNT];
+    long peak_rss_kb;
+} report_t;
+
+// an assembler running in the background
+typedef struct {
+    pid_t pid;
+    size_t file_num;
+    double start;
+} child_t;
+
+typedef struct {
+    char *word;
+    size_t len;
+    int type;
+    int operation;
+} keyword_t;
+
+// what the lexer needs to know about an interned word, worked out the first
+// time the word is seen so a repeated word skips the keyword and number checks
+typedef struct {
+    keyword_t *kw;
+    int is_int;
+    size_t len;
+} word_info_t;
+
 typedef struct {
     size_t file_num;
     char *file_name;
@@ -180,9 +258,21 @@ typedef struct {
     int has_malloc;
     size_t idx_amount;
     char *cur_var;
-    char *prv_var;
-    char *cur_vartype;
     char **cur_proc;
+    proc_t *proc;
+    struct { char *key; word_info_t value; } *interned;
+    size_t jobs;
+    size_t running;
+    int cache;
+    unsigned long *cache_keys;
+    int nasm;
+    int emit_asm;
+    int opt;
+    int time_report;
+    report_t *reports;
+    double start_time;
+    double link_time;
+    child_t *children;
 } program_t;
 
 program_t program;
@@ -196,6 +286,66 @@ char token_name[TKN_COUNT][256] = {
     "type"
 };
 
+keyword_t keywords[] = {
+    {"+",        1, TKN_INTRINSIC, OP_PLUS},
+    {"-",        1, TKN_INTRINSIC, OP_MINUS},
+    {"*",        1, TKN_INTRINSIC, OP_MUL},
+    {"/",        1, TKN_INTRINSIC, OP_DIV},
+    {"%",        1, TKN_INTRINSIC, OP_MOD},
+    {">>",       2, TKN_INTRINSIC, OP_SHR},
+    {"<<",       2, TKN_INTRINSIC, OP_SHL},
+    {"&",        1, TKN_INTRINSIC, OP_BAND},
+    {"|",        1, TKN_INTRINSIC, OP_BOR},
+    {"~",        1, TKN_INTRINSIC, OP_BNOT},
+    {"^",        1, TKN_INTRINSIC, OP_XOR},
+    {"=",        1, TKN_INTRINSIC, OP_SET_VAR},
+    {"$",        1, TKN_INTRINSIC, OP_GET_ADR},
+    {"!",        1, TKN_INTRINSIC, OP_STORE},
+    {"@",        1, TKN_INTRINSIC, OP_FETCH},
+    {"sizeof",   6, TKN_INTRINSIC, OP_SIZEOF},
+    {"==",       2, TKN_INTRINSIC, OP_EQUALS},
+    {"!=",       2, TKN_INTRINSIC, OP_NOTEQUALS},
+    {">",        1, TKN_INTRINSIC, OP_GREATER},
+    {"<",        1, TKN_INTRINSIC, OP_MINOR},
+    {">=",       2, TKN_INTRINSIC, OP_EQGREATER},
+    {"<=",       2, TKN_INTRINSIC, OP_EQMINOR},
+    {"not",      3, TKN_INTRINSIC, OP_NOT},
+    {"print",    5, TKN_INTRINSIC, OP_PRINT},
+    {"dup",      3, TKN_INTRINSIC, OP_DUP},
+    {"swap",     4, TKN_INTRINSIC, OP_SWAP},
+    {"rot",      3, TKN_INTRINSIC, OP_ROT},
+    {"over",     4, TKN_INTRINSIC, OP_OVER},
+    {"drop",     4, TKN_INTRINSIC, OP_DROP},
+    {"cap",      3, TKN_INTRINSIC, OP_CAP},
+    {"[",        1, TKN_INTRINSIC, OP_START_INDEX},
+    {"]",        1, TKN_INTRINSIC, OP_END_INDEX},
+    {"syscall0", 8, TKN_INTRINSIC, OP_SYSCALL0},
+    {"syscall1", 8, TKN_INTRINSIC, OP_SYSCALL1},
+    {"syscall2", 8, TKN_INTRINSIC, OP_SYSCALL2},
+    {"syscall3", 8, TKN_INTRINSIC, OP_SYSCALL3},
+    {"syscall4", 8, TKN_INTRINSIC, OP_SYSCALL4},
+    {"syscall5", 8, TKN_INTRINSIC, OP_SYSCALL5},
+    {"syscall6", 8, TKN_INTRINSIC, OP_SYSCALL6},
+    {"memory",   6, TKN_INTRINSIC, OP_MEMORY},
+    {"delete",   6, TKN_INTRINSIC, OP_DELETE},
+    {"do",       2, TKN_KEYWORD,   OP_DO},
+    {"if",       2, TKN_KEYWORD,   OP_IF},
+    {"else",     4, TKN_KEYWORD,   OP_ELSE},
+    {"loop",     4, TKN_KEYWORD,   OP_LOOP},
+    {"var",      3, TKN_KEYWORD,   OP_CREATE_VAR},
+    {"const",    5, TKN_KEYWORD,   OP_CREATE_CONST},
+    {"proc",     4, TKN_KEYWORD,   OP_CREATE_PROC},
+    {"import",   6, TKN_KEYWORD,   OP_IMPORT},
+    {"export",   6, TKN_KEYWORD,   OP_EXPORT},
+    {"end",      3, TKN_KEYWORD,   OP_END},
+};
+
+// the hash below is perfect for the words in 'keywords', so any word needs
+// just one probe. if you add a keyword and keyword_table_init complains,
+// change the multipliers (or the table size) until it don't collide anymore
+#define KEYWORD_TABLE_CAP 256
+keyword_t *keyword_table[KEYWORD_TABLE_CAP];
+
 void malloc_check(void *block, char *info) {
     if (block == NULL) {
         fprintf(stderr, "[ERROR] malloc returned null\n[INFO] %s\n", info);
@@ -214,13 +364,37 @@ str_t str_create(char *str_data, size_t adr) {
 proc_t proc_create(char *name) {
     proc_t proc;
     proc.name = name;
-    proc.adr = shlenu(program.procs);
+    proc.adr = hmlenu(program.procs);
     proc.vars = NULL;
     proc.local_var_capacity = 0;
     proc.file_num = program.file_num;
+    proc.in = -1;
+    proc.out = -1;
     return proc;
 }
 
+size_t keyword_hash(char *word, size_t len) {
+    return ((unsigned char)word[0] + (unsigned char)word[len - 1] * 6 + len * 10) & (KEYWORD_TABLE_CAP - 1);
+}
+
+void keyword_table_init() {
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(*keywords); i++) {
+        size_t h = keyword_hash(keywords[i].word, keywords[i].len);
+        if (keyword_table[h] != NULL) {
+            fprintf(stderr, "[ERROR] keyword '%s' collides with '%s' in the keyword table\n", keywords[i].word, keyword_table[h]->word);
+            exit(1);
+        }
+        keyword_table[h] = &keywords[i];
+    }
+}
+
+keyword_t *keyword_find(char *word, size_t len) {
+    if (len == 0) return NULL;
+    keyword_t *kw = keyword_table[keyword_hash(word, len)];
+    if (kw == NULL || kw->len != len || memcmp(kw->word, word, len) != 0) return NULL;
+    return kw;
+}
+
 pos_t pos_create(char *file, size_t line, size_t col) {
     pos_t pos;
     pos.file = file;
@@ -248,47 +422,66 @@ void print_token(token_t *token) {
     }
 }
 
+int word_is_int(char *word) {
+    for (size_t i = 0; word[i] != '\0'; i++) {
+        if (word[i] < '0' || word[i] > '9') return 0;
+    }
+    return 1;
+}
+
+// returns the index of the unique copy of 'str' in program.interned, every
+// name and token value goes through here, so two equal names are always the
+// same pointer and the symbol tables can be keyed (and hashed) by the pointer
+// alone. the copies live in one arena that is freed in program_finish
+ptrdiff_t intern_index(char *str) {
+    ptrdiff_t i = shgeti(program.interned, str);
+    if (i < 0) {
+        size_t len = strlen(str);
+        word_info_t info = {keyword_find(str, len), word_is_int(str), len};
+        shput(program.interned, str, info);
+        // stb_ds appends new keys, so there's no need to look it up again
+        i = shlen(program.interned) - 1;
+    }
+    return i;
+}
+
+char *intern(char *str) {
+    // intern_index can grow program.interned, so it has to run before the
+    // array is read
+    ptrdiff_t i = intern_index(str);
+    return program.interned[i].key;
+}
+
 vartype_t vartype_create(char *name, size_t size_bytes, int primitive) {
     vartype_t vartype;
-    vartype.name = malloc(sizeof(*vartype.name) * (strlen(name) + 1));
-    malloc_check(vartype.name, "malloc(vartype.name) in function vartype_create");
-    strcpy(vartype.name, name);
+    vartype.name = intern(name);
     vartype.size_bytes = size_bytes;
     vartype.primitive = primitive;
     return vartype;
 }
 
 var_t var_create(char *name, char *type_name, int arr, size_t cap) {
-    if (shgetp_null(program.types, type_name) == NULL) return (var_t){.name=NULL};
+    if (hmgetp_null(program.types, type_name) == NULL) return (var_t){.name=NULL};
     var_t var;
-    var.name = malloc(sizeof(*var.name) * (strlen(name) + 1));
-    malloc_check(var.name, "malloc(var.name) in function var_create");
-    strcpy(var.name, name);
-    var.type = type_name;
+    var.name = name;
+    var.type = &hmgetp_null(program.types, type_name)->value;
     var.arr = arr;
     var.cap = cap;
+    var.local = 0;
     var.constant = 0;
-    var.adr = shlenu(program.vars);
+    var.adr = hmlenu(program.vars);
     return var;
 }
 
-int word_is_int(char *word) {
-    int result = 1;
-    size_t len = strlen(word);
-    for (size_t i = 0; i < len; i++) {
-        int eq = 0;
-        for (size_t j = 0; j < 10; j++) {
-            if (word[i] == "0123456789"[j]) {
-                eq = 1;
-                break;
-            }
-        }
-        if (eq == 0) {
-            result = 0;
-            break;
-        }
+// finds the var 'name' seen from the current proc, locals shadow globals
+var_t *var_find(char *name) {
+    if (program.proc != NULL && hmgetp_null(program.proc->vars, name) != NULL) {
+        return &hmgetp_null(program.proc->vars, name)->value;
+    }
+    if (hmgetp_null(program.vars, name) != NULL) {
+        return &hmgetp_null(program.vars, name)->value;
     }
-    return result;
+    return NULL;
 }
 
 void program_error(char *msg, pos_t pos) {
@@ -296,121 +489,23 @@ void program_error(char *msg, pos_t pos) {
     program.error = 1;
 }
 
-int lex_word_as_token(char *word, int is_str, size_t adr) {
+int lex_word_as_token(char *word, word_info_t info, int is_str, size_t adr) {
     size_t idx = program.idx;
     if (idx >= arrlenu(program.tokens)) return 0;
+    keyword_t *kw = info.kw;
 
     if (is_str) {
         token_set(&program.tokens[idx], TKN_STR, OP_PUSH_STR, word);
         program.tokens[idx].jmp = adr;
-    } else if (strcmp(word, "+") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_PLUS, word);
-    } else if (strcmp(word, "-") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_MINUS, word);
-    } else if (strcmp(word, "*") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_MUL, word);
-    } else if (strcmp(word, "/") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_DIV, word);
-    } else if (strcmp(word, "%") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_MOD, word);
-    } else if (strcmp(word, ">>") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_SHR, word);
-    } else if (strcmp(word, "<<") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_SHL, word);
-    } else if (strcmp(word, "&") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_BAND, word);
-    } else if (strcmp(word, "|") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_BOR, word);
-    } else if (strcmp(word, "~") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_BNOT, word);
-    } else if (strcmp(word, "^") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_XOR, word);
-    } else if (strcmp(word, "=") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_SET_VAR, word);
-    } else if (strcmp(word, "$") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_GET_ADR, word);
-    } else if (strcmp(word, "!") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_STORE, word);
-    } else if (strcmp(word, "@") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_FETCH, word);
-    } else if (strcmp(word, "sizeof") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_SIZEOF, word);
-    } else if (strcmp(word, "==") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_EQUALS, word);
-    } else if (strcmp(word, "!=") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_NOTEQUALS, word);
-    } else if (strcmp(word, ">") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_GREATER, word);
-    } else if (strcmp(word, "<") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_MINOR, word);
-    } else if (strcmp(word, ">=") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_EQGREATER, word);
-    } else if (strcmp(word, "<=") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_EQMINOR, word);
-    } else if (strcmp(word, "not") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_NOT, word);
-    } else if (strcmp(word, "print") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_PRINT, word);
-    } else if (strcmp(word, "dup") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_DUP, word);
-    } else if (strcmp(word, "swap") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_SWAP, word);
-    } else if (strcmp(word, "rot") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_ROT, word);
-    } else if (strcmp(word, "over") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_OVER, word);
-    } else if (strcmp(word, "drop") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_DROP, word);
-    } else if (strcmp(word, "cap") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_CAP, word);
-    } else if (strcmp(word, "[") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_START_INDEX, word);
-    } else if (strcmp(word, "]") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_END_INDEX, word);
-    } else if (strcmp(word, "syscall0") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_SYSCALL0, word);
-    } else if (strcmp(word, "syscall1") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_SYSCALL1, word);
-    } else if (strcmp(word, "syscall2") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_SYSCALL2, word);
-    } else if (strcmp(word, "syscall3") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_SYSCALL3, word);
-    } else if (strcmp(word, "syscall4") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_SYSCALL4, word);
-    } else if (strcmp(word, "syscall5") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_SYSCALL5, word);
-    } else if (strcmp(word, "syscall6") == 0) {
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_SYSCALL6, word);
-    } else if (strcmp(word, "memory") == 0) {
-        if (program.has_malloc == 0) program.has_malloc = 1;
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_MEMORY, word);
-    } else if (strcmp(word, "delete") == 0) {
-        if (program.has_malloc == 0) program.has_malloc = 1;
-        token_set(&program.tokens[idx], TKN_INTRINSIC, OP_DELETE, word);
-    } else if (strcmp(word, "do") == 0) {
-        token_set(&program.tokens[idx], TKN_KEYWORD, OP_DO, word);
-    } else if (strcmp(word, "if") == 0) {
-        token_set(&program.tokens[idx], TKN_KEYWORD, OP_IF, word);
-    } else if (strcmp(word, "else") == 0) {
-        token_set(&program.tokens[idx], TKN_KEYWORD, OP_ELSE, word);
-    } else if (strcmp(word, "loop") == 0) {
-        token_set(&program.tokens[idx], TKN_KEYWORD, OP_LOOP, word);
-    } else if (strcmp(word, "var") == 0) {
-        token_set(&program.tokens[idx], TKN_KEYWORD, OP_CREATE_VAR, word);
-    } else if (strcmp(word, "const") == 0) {
-        token_set(&program.tokens[idx], TKN_KEYWORD, OP_CREATE_CONST, word);
-    } else if (strcmp(word, "proc") == 0) {
-        token_set(&program.tokens[idx], TKN_KEYWORD, OP_CREATE_PROC, word);
-    } else if (strcmp(word, "import") == 0) {
-        token_set(&program.tokens[idx], TKN_KEYWORD, OP_IMPORT, word);
-    } else if (strcmp(word, "export") == 0) {
-        token_set(&program.tokens[idx], TKN_KEYWORD, OP_EXPORT, word);
-    } else if (strcmp(word, "end") == 0) {
-        token_set(&program.tokens[idx], TKN_KEYWORD, OP_END, word);
-    } else if (shgetp_null(program.types, word) != NULL) {
-        token_set(&program.tokens[idx], TKN_TYPE, -1, word);
-    } else if (word_is_int(word)) {
+    } else if (kw != NULL) {
+        if (kw->operation == OP_MEMORY || kw->operation == OP_DELETE) {
+            if (program.has_malloc == 0) program.has_malloc = 1;
+        }
+        token_set(&program.tokens[idx], kw->type, kw->operation, word);
+    } else if (info.is_int) {
         token_set(&program.tokens[idx], TKN_INT, OP_PUSH_INT, word);
+    } else if (hmgetp_null(program.types, word) != NULL) {
+        token_set(&program.tokens[idx], TKN_TYPE, -1, word);
     } else {
         token_set(&program.tokens[idx], TKN_ID, -1, word);
     }
@@ -420,6 +515,107 @@ int lex_word_as_token(char *word, int is_str, size_t adr) {
     return 1;
 }
 
+// evaluates the tokens from..to of a var or const definition at compile time,
+// leaving the results in stack, 'what' names the definition in the error
+int const_eval(size_t from, size_t to, size_t **stack, char *what, pos_t pos) {
+    token_t *tokens = program.tokens;
+    for (size_t i = from; i < to; i++) {
+        int invalid = 0;
+        if (tokens[i].type == TKN_KEYWORD) {
+            invalid = 1;
+        } else if (tokens[i].type == TKN_INTRINSIC) {
+            switch (tokens[i].operation) {
+            case OP_PLUS:
+            case OP_MINUS:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_MOD:
+            case OP_SHR:
+            case OP_SHL:
+            case OP_BAND:
+            case OP_BOR:
+            case OP_XOR: {
+                if (arrlenu(*stack) < 2) {
+                    invalid = 1;
+                    break;
+                }
+                size_t b = arrpop(*stack);
+                size_t a = arrpop(*stack);
+                switch (tokens[i].operation) {
+                case OP_PLUS:  a += b; break;
+                case OP_MINUS: a -= b; break;
+                case OP_MUL:   a *= b; break;
+                case OP_DIV:   if (b == 0) invalid = 1; else a /= b; break;
+                case OP_MOD:   if (b == 0) invalid = 1; else a %= b; break;
+                case OP_SHR:   a >>= b; break;
+                case OP_SHL:   a <<= b; break;
+                case OP_BAND:  a &= b; break;
+                case OP_BOR:   a |= b; break;
+                case OP_XOR:   a ^= b; break;
+                default: break;
+                }
+                arrput(*stack, a);
+            } break;
+            case OP_BNOT: {
+                if (arrlenu(*stack) < 1) {
+                    invalid = 1;
+                    break;
+                }
+                size_t a = arrpop(*stack);
+                arrput(*stack, ~a);
+            } break;
+            case OP_SIZEOF: {
+                if (i + 1 < to && hmgetp_null(program.types, tokens[i + 1].val) != NULL) {
+                    arrput(*stack, hmget(program.types, tokens[i + 1].val).size_bytes);
+                    i++;
+                } else {
+                    invalid = 1;
+                }
+            } break;
+            default: {
+                invalid = 1;
+            } break;
+            }
+        } else if (tokens[i].type == TKN_INT) {
+            arrput(*stack, atol(tokens[i].val));
+        } else if (tokens[i].type == TKN_ID) {
+            var_t *var = NULL;
+            if (hmgetp_null(program.vars, tokens[i].val) != NULL) {
+                var = &hmgetp_null(program.vars, tokens[i].val)->value;
+            }
+            if (var != NULL && var->constant && var->type->primitive) {
+                switch (var->type->size_bytes) {
+                case sizeof(char):
+                    arrput(*stack, var->const_val.b8);
+                    break;
+                case sizeof(short):
+                    arrput(*stack, var->const_val.b16);
+                    break;
+                case sizeof(int):
+                    arrput(*stack, var->const_val.b32);
+                    break;
+                case sizeof(long):
+                    arrput(*stack, var->const_val.b64);
+                    break;
+                }
+            } else {
+                invalid = 1;
+            }
+        } else {
+            invalid = 1;
+        }
+        if (invalid) {
+            char *msg = malloc(sizeof(char) * (strlen(tokens[i].val) + strlen(what) + 40));
+            sprintf(msg, "'%s' is not valid in a %s definition", tokens[i].val, what);
+            program_error(msg, pos);
+            free(msg);
+            arrfree(*stack);
+            return 0;
+        }
+    }
+    return 1;
+}
+
 int parse_current_token() {
     size_t idx = program.idx;
     if (idx >= arrlenu(program.tokens)) return 0;
@@ -438,33 +634,6 @@ int parse_current_token() {
                 return 0;
             }
             if (program.condition) {
-                size_t jmp = 0;
-                size_t if_count = 0;
-                for (size_t i = idx + 1; i < arrlenu(program.tokens); i++) {
-                    if (tokens[i].type != TKN_KEYWORD) continue;
-                    if ((tokens[i].operation == OP_IF && tokens[i - 1].operation != OP_ELSE) || tokens[i].operation == OP_LOOP || tokens[i].operation == OP_CREATE_VAR ||  tokens[i].operation == OP_CREATE_CONST || tokens[i].operation == OP_CREATE_PROC) if_count++;
-                    if (tokens[i].operation == OP_END) {
-                        if (if_count > 0) {
-                            if_count--;
-                        } else {
-                            jmp = i;
-                            break;
-                        }
-                    } else if (tokens[i].operation == OP_ELSE && !program.loop) {
-                        if (if_count == 0) {
-                            jmp = i;
-                            break;
-                        }
-                    }
-                }
-                if (jmp == 0) {
-                    if (program.loop)
-                        program_error("loop without a end", positions[idx]);
-                    else
-                        program_error("if without a end", positions[idx]);
-                    return 0;
-                }
-                tokens[idx].jmp = jmp;
                 program.loop = 0;
                 program.condition = 0;
             } else {
@@ -495,44 +664,6 @@ int parse_current_token() {
                 free(msg);
                 return 0;
             }
-
-            size_t jmp = 0;
-            size_t if_count = 0;
-            for (size_t i = idx + 1; i < arrlenu(program.tokens); i++) {
-                if (tokens[i].type != TKN_KEYWORD) continue;
-                if (((tokens[i].operation == OP_IF && tokens[i - 1].operation != OP_ELSE) && i > idx + 1) || tokens[i].operation == OP_LOOP || tokens[i].operation == OP_CREATE_VAR||  tokens[i].operation == OP_CREATE_CONST || tokens[i].operation == OP_CREATE_PROC) if_count++;
-                if (tokens[i].operation == OP_END) {
-                    if (if_count > 0) {
-                        if_count--;
-                    } else {
-                        jmp = i;
-                        break;
-                    }
-                }
-            }
-            int found_if = 0;
-            for (size_t i = idx - 1; i >= 0; i--) {
-                if ((long)i < 0) break;
-                if (tokens[i].operation == OP_END) if_count++;
-                if (tokens[i].operation == OP_LOOP || tokens[i].operation == OP_CREATE_VAR||  tokens[i].operation == OP_CREATE_CONST || tokens[i].operation == OP_CREATE_PROC) if_count--;
-                if (tokens[i].operation == OP_IF && (i == 0 || tokens[i].operation != OP_ELSE)) {
-                    if (if_count > 0) {
-                        if_count--;
-                    } else {
-                        found_if = 1;
-                        break;
-                    }
-                }
-            }
-            if (!found_if) {
-                program_error("else without a if", positions[idx]);
-                return 0;
-            }
-            if (jmp == 0) {
-                program_error("else without a end", positions[idx]);
-                return 0;
-            }
-            tokens[idx].jmp = jmp;
         } break;
         case OP_LOOP: {
             if (arrlenu(program.cur_proc) == 0) {
@@ -566,7 +697,7 @@ int parse_current_token() {
                 return 0;
             }
             if (arrlenu(program.cur_proc) == 0) {
-                if (shgetp_null(program.vars, tokens[idx].val) != NULL) {
+                if (hmgetp_null(program.vars, tokens[idx].val) != NULL) {
                     char *msg = malloc(sizeof(char) * (strlen(tokens[idx].val + 30)));
                     sprintf(msg, "trying to redefine var '%s'", tokens[idx].val);
                     program_error(msg, positions[idx]);
@@ -574,8 +705,7 @@ int parse_current_token() {
                     return 0;
                 }
             } else {
-                proc_t p = shget(program.procs, program.cur_proc[arrlenu(program.cur_proc) - 1]);
-                if (shgetp_null(p.vars, tokens[idx].val) != NULL) {
+                if (hmgetp_null(program.proc->vars, tokens[idx].val) != NULL) {
                     char *msg = malloc(sizeof(char) * (strlen(tokens[idx].val + 30)));
                     sprintf(msg, "trying to redefine var '%s'", tokens[idx].val);
                     program_error(msg, positions[idx]);
@@ -583,7 +713,7 @@ int parse_current_token() {
                     return 0;
                 }
             }
-            if (shgetp_null(program.procs, tokens[idx].val) != NULL) {
+            if (hmgetp_null(program.procs, tokens[idx].val) != NULL) {
                 char *msg = malloc(sizeof(char) * (strlen(tokens[idx].val + 30)));
                 sprintf(msg, "trying to redefine proc '%s' as var", tokens[idx].val);
                 program_error(msg, positions[idx]);
@@ -607,132 +737,9 @@ int parse_current_token() {
             }
             char *type = tokens[idx].val;
             // verify if var is an array
-            size_t end = 0;
+            size_t end = tokens[idx - 2].jmp + 1;
             size_t *stack = NULL;
-            for (size_t i = idx + 1; i < arrlenu(program.tokens); i++) {
-                int invalid = 0;
-                if (tokens[i].type == TKN_KEYWORD) {
-                    if (tokens[i].operation == OP_END) {
-                        end = i + 1;
-                        break;
-                    } else {
-                        invalid = 1;
-                    }
-                } else if (tokens[i].type == TKN_INTRINSIC) {
-                    switch (tokens[i].operation) {
-                    case OP_PLUS: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a + b);
-                    } break;
-                    case OP_MINUS: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a - b);
-                    } break;
-                    case OP_MUL: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a * b);
-                    } break;
-                    case OP_DIV: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a / b);
-                    } break;
-                    case OP_MOD: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a % b);
-                    } break;
-                    case OP_SHR: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a >> b);
-                    } break;
-                    case OP_SHL: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a << b);
-                    } break;
-                    case OP_BAND: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a & b);
-                    } break;
-                    case OP_BOR: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a | b);
-                    } break;
-                    case OP_BNOT: {
-                        size_t a = arrpop(stack);
-                        arrput(stack, ~a);
-                    } break;
-                    case OP_XOR: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a ^ b);
-                    } break;
-                    case OP_SIZEOF: {
-                        vartype_t vt;
-                        int find_vt = 0;
-                        if (shgetp_null(program.types, tokens[i + 1].val) != NULL) {
-                            find_vt = 1;
-                            vt = shget(program.types, tokens[i + 1].val);
-                        }
-                        if (find_vt) {
-                            arrput(stack, vt.size_bytes);
-                        } else {
-                            invalid = 1;
-                        }
-                    } break;
-                    default: {
-                        invalid = 1;
-                    } break;
-                    }
-                } else if (tokens[i].type == TKN_INT) {
-                    arrput(stack, atol(tokens[i].val)); 
-                } else if (tokens[i].type == TKN_ID) {
-                    var_t var;
-                    int find_v = 0;
-                    if (shgetp_null(program.vars, tokens[i].val) != NULL) {
-                        find_v = 1;
-                        var = shget(program.vars, tokens[i].val);
-                    }
-                    if (find_v && var.constant && shget(program.types, var.type).primitive) {
-                        switch (shget(program.types, var.type).size_bytes) {
-                        case sizeof(char):
-                            arrput(stack, var.const_val.b8);
-                            break;
-                        case sizeof(short):
-                            arrput(stack, var.const_val.b16);
-                            break;
-                        case sizeof(int):
-                            arrput(stack, var.const_val.b32);
-                            break;
-                        case sizeof(long):
-                            arrput(stack, var.const_val.b64);
-                            break;
-                        }
-                    } else {
-                        invalid = 1;
-                    }
-                } else {
-                    invalid = 1;
-                }
-                if (invalid) {
-                    char *msg = malloc(sizeof(char) * (strlen(tokens[i].val) + 40));
-                    sprintf(msg, "'%s' is not valid in a array definition", tokens[i].val);
-                    program_error(msg, positions[idx]);
-                    free(msg);
-                    return 0;
-                }
-            }
-            if (end  == 0) {
-                program_error("creating var without a end", positions[idx]);
-                return 0;
-            }
+            if (!const_eval(idx + 1, end - 1, &stack, "array", positions[idx])) return 0;
             var_t var;
             if (arrlenu(stack) == 0) {
                 var = var_create(name, type, 0, 1);
@@ -752,24 +759,25 @@ int parse_current_token() {
                 return 0;
             }
             if (arrlenu(program.cur_proc) == 0) {
-                shput(program.vars, var.name, var);
+                hmput(program.vars, var.name, var);
+                tokens[end - 1].ref.var = &(hmgetp_null(program.vars, var.name)->value);
                 if (program.setting) {
                     program.cur_var = var.name;
                 }
                 program.global_def = 1;
                 program.local_def = 0;
             } else {
-                proc_t *proc = &(shgetp_null(program.procs, program.cur_proc[arrlenu(program.cur_proc) - 1])->value); 
-                shput(proc->vars, var.name, var);
-                var_t *v = &(shgetp_null(proc->vars, var.name)->value);
-                size_t add_offset = shget(program.types, v->type).size_bytes;
+                proc_t *proc = program.proc;
+                var.local = 1;
+                hmput(proc->vars, var.name, var);
+                var_t *v = &(hmgetp_null(proc->vars, var.name)->value);
+                tokens[end - 1].ref.var = v;
+                size_t add_offset = v->type->size_bytes;
                 if (v->arr) {
                     add_offset *= v->cap;
                 }
-                v->adr = 0;
-                for (size_t i = 0; i < shlenu(proc->vars); i++) {
-                    proc->vars[i].value.adr += add_offset;
-                }
+                // locals sit at a fixed offset from the frame base, see IR_ENTER
+                v->adr = proc->local_var_capacity;
                 proc->local_var_capacity += add_offset;
                 program.cur_var = var.name;
                 program.local_def = 1;
@@ -796,14 +804,14 @@ int parse_current_token() {
                 free(msg);
                 return 0;
             }
-            if (shgetp_null(program.vars, tokens[idx].val) != NULL) {
+            if (hmgetp_null(program.vars, tokens[idx].val) != NULL) {
                 char *msg = malloc(sizeof(char) * (strlen(tokens[idx].val + 30)));
                 sprintf(msg, "trying to redefine const '%s'", tokens[idx].val);
                 program_error(msg, positions[idx]);
                 free(msg);
                 return 0;
             }
-            if (shgetp_null(program.procs, tokens[idx].val) != NULL) {
+            if (hmgetp_null(program.procs, tokens[idx].val) != NULL) {
                 char *msg = malloc(sizeof(char) * (strlen(tokens[idx].val + 30)));
                 sprintf(msg, "trying to redefine proc '%s' as const", tokens[idx].val);
                 program_error(msg, positions[idx]);
@@ -828,137 +836,13 @@ int parse_current_token() {
             char *type = tokens[idx].val;
             // TODO: for now constants can't be arrays and just support primitive types
             // get const value
-            size_t end = 0;
+            size_t end = tokens[idx - 2].jmp + 1;
             size_t *stack = NULL;
-            for (size_t i = idx + 1; i < arrlenu(program.tokens); i++) {
-                int invalid = 0;
-                if (tokens[i].type == TKN_KEYWORD) {
-                    if (tokens[i].operation == OP_END) {
-                        end = i + 1;
-                        break;
-                    } else {
-                        invalid = 1;
-                    }
-                } else if (tokens[i].type == TKN_INTRINSIC) {
-                    switch (tokens[i].operation) {
-                    case OP_PLUS: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a + b);
-                    } break;
-                    case OP_MINUS: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a - b);
-                    } break;
-                    case OP_MUL: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a * b);
-                    } break;
-                    case OP_DIV: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a / b);
-                    } break;
-                    case OP_MOD: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a % b);
-                    } break;
-                    case OP_SHR: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a >> b);
-                    } break;
-                    case OP_SHL: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a << b);
-                    } break;
-                    case OP_BAND: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a & b);
-                    } break;
-                    case OP_BOR: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a | b);
-                    } break;
-                    case OP_BNOT: {
-                        size_t a = arrpop(stack);
-                        arrput(stack, ~a);
-                    } break;
-                    case OP_XOR: {
-                        size_t b = arrpop(stack);
-                        size_t a = arrpop(stack);
-                        arrput(stack, a ^ b);
-                    } break;
-                    case OP_SIZEOF: {
-                        vartype_t vt;
-                        int find_vt = 0;
-                        if (shgetp_null(program.types, tokens[i + 1].val) != NULL) {
-                            find_vt = 1;
-                            vt = shget(program.types, tokens[i + 1].val);
-                        }
-                        if (find_vt) {
-                            arrput(stack, vt.size_bytes);
-                            i++;
-                        } else {
-                            invalid = 1;
-                        }
-                    } break;
-                    default: {
-                        invalid = 1;
-                    } break;
-                    }
-                } else if (tokens[i].type == TKN_INT) {
-                    arrput(stack, atol(tokens[i].val)); 
-                } else if (tokens[i].type == TKN_ID) {
-                    var_t var;
-                    int find_v = 0;
-                    if (shgetp_null(program.vars, tokens[i].val) != NULL) {
-                        find_v = 1;
-                        var = shget(program.vars, tokens[i].val);
-                    }
-                    if (find_v && var.constant && shget(program.types, var.type).primitive) {
-                        switch (shget(program.types, var.type).size_bytes) {
-                        case sizeof(char):
-                            arrput(stack, var.const_val.b8);
-                            break;
-                        case sizeof(short):
-                            arrput(stack, var.const_val.b16);
-                            break;
-                        case sizeof(int):
-                            arrput(stack, var.const_val.b32);
-                            break;
-                        case sizeof(long):
-                            arrput(stack, var.const_val.b64);
-                            break;
-                        }
-                    } else {
-                        invalid = 1;
-                    }
-                } else {
-                    invalid = 1;
-                }
-                if (invalid) {
-                    char *msg = malloc(sizeof(char) * (strlen(tokens[i].val) + 40));
-                    sprintf(msg, "'%s' is not valid in a const definition", tokens[i].val);
-                    program_error(msg, positions[idx]);
-                    free(msg);
-                    return 0;
-                }
-            }
-            if (end  == 0) {
-                program_error("creating const without a end", positions[idx]);
-                return 0;
-            }
+            if (!const_eval(idx + 1, end - 1, &stack, "const", positions[idx])) return 0;
             var_t var;
             if (arrlenu(stack) == 1) {
                 var = var_create(name, type, 0, 1);
-                vartype_t vt = shget(program.types, var.type);
+                vartype_t vt = *var.type;
                 var.constant = 1;
                 if (vt.primitive) {
                     switch (vt.size_bytes) {
@@ -992,7 +876,7 @@ int parse_current_token() {
                 free(msg);
                 return 0;
             }
-            shput(program.vars, var.name, var);
+            hmput(program.vars, var.name, var);
             program.idx = end - 1;
             program.cur_var = var.name;
         } break;
@@ -1015,13 +899,13 @@ int parse_current_token() {
                 free(msg);
                 return 0;
             }
-            if (shgetp_null(program.vars, tokens[idx].val) != NULL) {
+            if (hmgetp_null(program.vars, tokens[idx].val) != NULL) {
                 char *msg = malloc(sizeof(char) * (strlen(tokens[idx].val + 30)));
                 sprintf(msg, "trying to redefine var '%s' as proc", tokens[idx].val);
                 program_error(msg, positions[idx]);
                 free(msg);
             }
-            if (shgetp_null(program.procs, tokens[idx].val) != NULL) {
+            if (hmgetp_null(program.procs, tokens[idx].val) != NULL) {
                 char *msg = malloc(sizeof(char) * (strlen(tokens[idx].val + 30)));
                 sprintf(msg, "trying to redefine proc '%s'", tokens[idx].val);
                 program_error(msg, positions[idx]);
@@ -1034,33 +918,16 @@ int parse_current_token() {
             }
             if (has_main_in_files > 1) program_error("multiple definition of main", positions[idx]);
             proc_t proc = proc_create(name);
-            shput(program.procs, proc.name, proc);
+            hmput(program.procs, proc.name, proc);
             arrput(program.cur_proc, proc.name);
+            program.proc = &(hmgetp_null(program.procs, proc.name)->value);
+            tokens[program.idx].ref.proc = program.proc;
             program.proc_def = 1;
-            size_t end = 0;
-            size_t end_count = 0;
-            for (size_t i = idx + 1; i < arrlenu(program.tokens); i++) {
-                if (tokens[i].type != TKN_KEYWORD) continue;
-                if ((tokens[i].operation == OP_IF && tokens[i - 1].operation != OP_ELSE) || tokens[i].operation == OP_LOOP || tokens[i].operation == OP_CREATE_VAR ||  tokens[i].operation == OP_CREATE_CONST || tokens[i].operation == OP_CREATE_PROC) end_count++;
-                if (tokens[i].operation == OP_END) {
-                    if (end_count > 0) {
-                        end_count--;
-                    } else {
-                        end = i;
-                        break;
-                    }
-                }
-            }
-            if (end == 0) {
-                program_error("proc without a end", positions[idx]);
-                return 0;
-            }
-            //program.procs[program.proc_size - 1].end = end;
         } break;
         case OP_EXPORT: {
-            int end = 0;
+            size_t end = tokens[idx].jmp;
             // TODO: for now exports only accepts procedures
-            if (shgetp_null(program.exports, program.file_name) != NULL) {
+            if (hmgetp_null(program.exports, program.file_name) != NULL) {
                 program_error("'export' already exists for this file", positions[idx]);
                 return 0;
             }
@@ -1074,24 +941,17 @@ int parse_current_token() {
             }
             size_t *export = NULL;
             arrput(export, program.file_num);
-            for (size_t i = idx + 1; i < arrlenu(program.tokens); i++) {
-                if (tokens[i].operation == OP_END) {
-                    end = i;
-                    break;
-                } else if ((shgetp_null(program.procs, tokens[i].val) == NULL || shget(program.procs, tokens[i].val).file_num != program.file_num)) {
+            for (size_t i = idx + 1; i < end; i++) {
+                if ((hmgetp_null(program.procs, tokens[i].val) == NULL || hmget(program.procs, tokens[i].val).file_num != program.file_num)) {
                     char *msg = malloc(sizeof(char) * (strlen(tokens[i].val) + 40));
                     sprintf(msg, "'%s' is not valid in export", tokens[i].val);
                     program_error(msg, positions[idx]);
                     free(msg);
                     return 0;
                 }
-                arrput(export, shget(program.procs, tokens[i].val).adr);
-            }
-            if (end == 0) {
-                program_error("'export' without a end", positions[idx]);
-                return 0;
+                arrput(export, hmget(program.procs, tokens[i].val).adr);
             }
-            shput(program.exports, program.file_name, export);
+            hmput(program.exports, program.file_name, export);
             program.idx = end;
         } break;
         case OP_IMPORT: {
@@ -1099,39 +959,24 @@ int parse_current_token() {
                 program_error("'import' without a file path", positions[idx + 1]);
                 return 0;
             }
-            if (shgetp_null(program.exports, tokens[idx + 1].val) == NULL) {
+            if (hmgetp_null(program.exports, tokens[idx + 1].val) == NULL) {
                 char *msg = malloc(sizeof(char) * (28 + strlen(tokens[idx + 1].val)));
                 sprintf(msg, "'%s' is not a valid file", tokens[idx + 1].val);
                 program_error(msg, positions[idx + 1]);
                 free(msg);
                 return 0;
             }
-            arrput(program.imports, shget(program.exports, tokens[idx + 1].val)[0]);
+            tokens[idx].ref.export = hmget(program.exports, tokens[idx + 1].val);
+            arrput(program.imports, tokens[idx].ref.export[0]);
         } break;
         case OP_END: {
-            size_t end_count = 0;
-            int found_open = 0;
-            for (long i = idx - 1; i >= 0; i--) {
-                if (tokens[i].type != TKN_KEYWORD) continue;
-                if (idx == 0 || (long)i < 0) break;
-                if (tokens[i].operation == OP_END) end_count++;
-                if ((tokens[i].operation == OP_IF  && tokens[i - 1].operation != OP_ELSE) || tokens[i].operation == OP_LOOP || tokens[i].operation == OP_CREATE_VAR || tokens[i].operation == OP_CREATE_PROC || tokens[i].operation == OP_EXPORT) {
-                    if (end_count > 0) {
-                        end_count--;
-                    } else {
-                        found_open = 1;
-                        program.condition = tokens[i].operation != OP_CREATE_VAR && tokens[i].operation != OP_CREATE_PROC && tokens[i].operation != OP_EXPORT;
-                        if (tokens[i].operation == OP_LOOP) {
-                            program.loop = 1;
-                            tokens[idx].jmp = i;
-                        }
-                        break;
-                    }
-                }
-            }
-            if (!found_open) {
-                program_error("end without a opening", positions[idx]);
-                return 0;
+            int open = tokens[tokens[idx].jmp].operation;
+            program.condition = open != OP_CREATE_VAR && open != OP_CREATE_PROC && open != OP_EXPORT;
+            if (open == OP_LOOP) {
+                program.loop = 1;
+            } else if (open == OP_CREATE_PROC) {
+                tokens[idx].ref.proc = program.proc;
+                program.proc = NULL;
             }
         } break;
         default: {
@@ -1154,11 +999,8 @@ int parse_current_token() {
         switch(tokens[idx].operation) {
         case OP_SIZEOF: {
             int find = 0;
-             if (tokens[idx + 1].type == TKN_ID) {
-                 proc_t p = shget(program.procs, program.cur_proc[arrlenu(program.cur_proc) - 1]);
-                 if (shgetp_null(program.vars, tokens[idx + 1].val) != NULL || shgetp_null(p.vars, tokens[idx + 1].val) != NULL) {
-                     find = 1;
-                 }
+            if (tokens[idx + 1].type == TKN_ID && var_find(tokens[idx + 1].val) != NULL) {
+                find = 1;
             }
             if (find) {
                 program.size_of = 1;
@@ -1170,9 +1012,9 @@ int parse_current_token() {
         case OP_STORE: {
             int find = 0;
 
-            if (shgetp_null(program.types, tokens[idx + 1].val) != NULL) {
+            if (hmgetp_null(program.types, tokens[idx + 1].val) != NULL) {
                 find = 1;
-                program.cur_vartype = tokens[idx + 1].val;
+                tokens[idx].ref.vartype = &(hmgetp_null(program.types, tokens[idx + 1].val)->value);
             }
             if (!find) {
                 char *msg = malloc(strlen(tokens[idx + 1].val) + 16);
@@ -1186,18 +1028,9 @@ int parse_current_token() {
             int find = 0;
             var_t var = {0};
             if (tokens[idx + 1].type == TKN_ID) {
-                int local = 0;
-                proc_t p = shget(program.procs, program.cur_proc[arrlenu(program.cur_proc) - 1]);
-                if (shgetp_null(p.vars, tokens[idx + 1].val) != NULL) {
-                    local = 1;
+                if (var_find(tokens[idx + 1].val) != NULL) {
                     find = 1;
-                    var = shget(p.vars, tokens[idx + 1].val);
-                }
-                if (!local) {
-                     if (shgetp_null(program.vars, tokens[idx + 1].val) != NULL) {
-                         find = 1;
-                         var = shget(program.vars, tokens[idx + 1].val);
-                     }
+                    var = *var_find(tokens[idx + 1].val);
                 }
             } else if (tokens[idx + 1].operation == OP_CREATE_VAR) {
                 find = 1;
@@ -1222,14 +1055,9 @@ int parse_current_token() {
             var_t var = {0};
 
             if (tokens[idx + 1].type == TKN_ID) {
-                if (shgetp_null(program.vars, tokens[idx + 1].val) != NULL) {
-                    find = 1;
-                    var = shget(program.vars, tokens[idx + 1].val);
-                }
-                proc_t p = shget(program.procs, program.cur_proc[arrlenu(program.cur_proc) - 1]);
-                if (shgetp_null(p.vars, tokens[idx + 1].val) != NULL) {
+                if (var_find(tokens[idx + 1].val) != NULL) {
                     find = 1;
-                    var = shget(p.vars, tokens[idx + 1].val);
+                    var = *var_find(tokens[idx + 1].val);
                 }
             } else if (tokens[idx + 1].operation == OP_CREATE_VAR) {
                 find = 1;
@@ -1260,17 +1088,11 @@ int parse_current_token() {
             int find = 0;
             if (!program.size_of) {
                 var_t var;
-                if (tokens[idx - 1].type == TKN_ID) {
-                    if (shgetp_null(program.vars, tokens[idx - 1].val) != NULL) {
-                        program.cur_var = tokens[idx - 1].val;
-                        find = 1;
-                        var = shget(program.vars, tokens[idx - 1].val);
-                    }
-                    proc_t p = shget(program.procs, program.cur_proc[arrlenu(program.cur_proc) - 1]);
-                    if (shgetp_null(p.vars, tokens[idx - 1].val) != NULL) {
-                        program.cur_var = tokens[idx - 1].val;
-                        find = 1;
-                        var = shget(p.vars, tokens[idx -1].val);
+                if (tokens[idx - 1].type == TKN_ID && var_find(tokens[idx - 1].val) != NULL) {
+                    program.cur_var = tokens[idx - 1].val;
+                    find = 1;
+                    var = *var_find(tokens[idx - 1].val);
+                    if (var.local) {
                         program.local_def = 1;
                     }
                 }
@@ -1320,24 +1142,15 @@ int parse_current_token() {
             }
             if (program.index) 
                 program.idx_amount--;
+            tokens[idx].ref.var = var_find(program.cur_var);
         } break;
         case OP_CAP: {
             int find = 0;
             var_t var;
-            if (tokens[idx - 1].type == TKN_ID) {
-                if (shgetp_null(program.vars, tokens[idx - 1].val) != NULL) {
-                    program.prv_var = program.cur_var;
-                    program.cur_var = tokens[idx - 1].val;
-                    find = 1;
-                    var = shget(program.vars, tokens[idx - 1].val);
-                }
-                proc_t p = shget(program.procs, program.cur_proc[arrlenu(program.cur_proc) - 1]);
-                if (shgetp_null(p.vars, tokens[idx - 1].val) != NULL) {
-                    program.prv_var = program.cur_var;
-                    program.cur_var = tokens[idx - 1].val;
-                    find = 1;
-                    var = shget(p.vars, tokens[idx -1].val);
-                }
+            if (tokens[idx - 1].type == TKN_ID && var_find(tokens[idx - 1].val) != NULL) {
+                find = 1;
+                var = *var_find(tokens[idx - 1].val);
+                tokens[idx].ref.var = var_find(tokens[idx - 1].val);
             }
             if (!find) {
                 char *msg = malloc(strlen(tokens[idx - 1].val) + 16);
@@ -1400,28 +1213,25 @@ int parse_current_token() {
             return 0;
         }
         // find var
-        if (shgetp_null(program.vars, tokens[idx].val) != NULL) {
-            tokens[idx].operation = OP_CALL_VAR;
-            find = 1;
-        }
-        proc_t p = shget(program.procs, program.cur_proc[arrlenu(program.cur_proc) - 1]);
-        if (shgetp_null(p.vars, tokens[idx].val) != NULL) {
+        if (var_find(tokens[idx].val) != NULL) {
             tokens[idx].operation = OP_CALL_VAR;
+            tokens[idx].ref.var = var_find(tokens[idx].val);
             find = 1;
         }
         // find proc
-        if (shgetp_null(program.procs, tokens[idx].val) != NULL) {
-            if (shget(program.procs, tokens[idx].val).file_num == program.file_num) {
+        if (hmgetp_null(program.procs, tokens[idx].val) != NULL) {
+            proc_t *proc = &(hmgetp_null(program.procs, tokens[idx].val)->value);
+            if (proc->file_num == program.file_num) {
                 tokens[idx].operation = OP_CALL_PROC;
-                arrput(program.cur_proc, tokens[idx].val);
+                tokens[idx].ref.proc = proc;
                 find = 1;
                 break;
             }
             if (!find) {
                 for (size_t i = 0; i < arrlenu(program.imports); i++) {
-                    if (shget(program.procs, tokens[idx].val).file_num == program.imports[i]) {
+                    if (proc->file_num == program.imports[i]) {
                         tokens[idx].operation = OP_CALL_PROC;
-                        arrput(program.cur_proc, tokens[idx].val);
+                        tokens[idx].ref.proc = proc;
                         find = 1;
                         break;
                     }
@@ -1450,6 +1260,9 @@ int parse_current_token() {
             free(msg);
             return 0;
         }
+        if (tokens[idx].type == TKN_STR) {
+            tokens[idx].ref.str = &(hmgetp_null(program.strs, tokens[idx].val)->value);
+        }
     } break;
     default:
         break;
@@ -1458,248 +1271,396 @@ int parse_current_token() {
     return 1;
 }
 
+// characters that end a word, '!' and '/' are handled apart because they
+// depend on the next character
+char lex_delim[256] = {
+    [' '] = 1, ['\t'] = 1, ['\r'] = 1, ['\n'] = 1, ['"'] = 1, ['\''] = 1,
+    ['['] = 1, [']'] = 1, ['$'] = 1, ['@'] = 1,
+};
+
+#define LEX_RECENT 1024
+
+void lex_emit(ptrdiff_t word, int is_str, size_t adr, char *file_name, size_t line, size_t col) {
+    arrput(program.tokens, token_create());
+    arrput(program.positions, pos_create(file_name, line, col));
+    lex_word_as_token(program.interned[word].key, program.interned[word].value, is_str, adr);
+    if (program.error) {
+        exit(1);
+    }
+}
+
 void lex_file(char *file_name) {
-    FILE *f = fopen(file_name, "r");
-    if (f == NULL) {
+    int fd = open(file_name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
         fprintf(stderr, "[ERROR] FIle '%s' don't exist's or is not writable\n", file_name);
         exit(1);
     }
+    size_t len = st.st_size;
+    if (len == 0) {
+        close(fd);
+        return;
+    }
+    char *src = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (src == MAP_FAILED) {
+        fprintf(stderr, "[ERROR] Failed to map file '%s'\n", file_name);
+        exit(1);
+    }
 
-    char *word = malloc(sizeof(char));
+    // scratch space for the current token before it is interned, a token is
+    // never bigger than the file, except a character that becomes a number
+    char *word = malloc(len + 8);
     malloc_check(word, "malloc(word) in function lex_file");
-    size_t word_size = 0;
-    size_t word_alloc = 1;
-    
+
+    // the words seen last, indexed by a hash taken while scanning, most words
+    // repeat so this saves copying and hashing them again to intern them
+    ptrdiff_t recent[LEX_RECENT];
+    memset(recent, -1, sizeof(recent));
+
+    char *p = src;
+    char *end = src + len;
+    char *line_start = src;
     size_t line = 1;
-    size_t col = 1;
-    size_t col_word = 1;
-    size_t str_line = 1;
-    size_t str_col = 1;
-
-    //char prv_char = 0;
-    char cur_char = 0;
-    char nxt_char = fgetc(f);
-
-    int is_str = 0;
-    int is_char = 0;
-    int is_cmt = 0;
-
-    while (cur_char != EOF) {
-        //prv_char = cur_char;
-        cur_char = nxt_char;
-        nxt_char = fgetc(f);
-        col++;
-        if (!is_cmt) {
-            if (!is_str) {
-                if (cur_char == '"' || cur_char == '\'') {
-                    is_str = 1;
-                    str_line = line;
-                    str_col = col_word;
-                    if (cur_char == '\'') is_char = 1;
-                    continue;
+
+    while (p < end) {
+        char c = *p;
+        if (c == '\n') {
+            p++;
+            line++;
+            line_start = p;
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\r') {
+            p++;
+            continue;
+        }
+        if (c == '/' && p + 1 < end && p[1] == '/') {
+            p = memchr(p, '\n', end - p);
+            if (p == NULL) p = end;
+            continue;
+        }
+        size_t col = p - line_start + 1;
+        if (c == '[' || c == ']' || c == '$' || c == '@' || (c == '!' && (p + 1 == end || p[1] != '='))) {
+            word[0] = c;
+            word[1] = '\0';
+            lex_emit(intern_index(word), 0, 0, file_name, line, col);
+            p++;
+            continue;
+        }
+        if (c == '"' || c == '\'') {
+            size_t str_line = line;
+            size_t word_size = 0;
+            p++;
+            while (p < end && *p != c) {
+                if (*p == '\n') {
+                    line++;
+                    line_start = p + 1;
                 }
-                if (cur_char == ' ' || cur_char == '"' || cur_char == '\'' || cur_char == '\t' || cur_char == '\n' || cur_char == EOF || cur_char == '[' || cur_char == ']' || cur_char == '$' || cur_char == '@' || (cur_char == '!' && nxt_char != '=') || (cur_char == '/' && nxt_char == '/')) {
-                    if (word_size > 0) {
-                        word[word_size] = '\0';
-                        arrput(program.tokens, token_create());
-                        arrput(program.positions, pos_create(file_name, line, col_word));
-                        lex_word_as_token(word, 0, 0);
-                        if (program.error) {
-                            exit(1);
-                        }
-                        word = malloc(sizeof(char));
-                        malloc_check(word, "malloc(word) in function lex_file");
-                        word_size = 0;
-                        word_alloc = 1;
-                    }
-                    if (cur_char == '\n') {
-                       line++;
-                       col = col_word = 1;
-                    } else if (cur_char == '/' && nxt_char == '/') {
-                       line++;
-                       col = col_word = 1;
-                       is_cmt = 1;
-                    } else {
-                       col_word = col;
-                    }
-                    if (cur_char == '[' || cur_char == ']' || cur_char == '$' || cur_char == '@' || (cur_char == '!' && nxt_char != '=')) {
-                        word = realloc(word, sizeof(char) * 2);
-                        word[0] = cur_char;
-                        word[1] = '\0';
-                        arrput(program.tokens, token_create());
-                        arrput(program.positions, pos_create(file_name, line, col_word));
-                        lex_word_as_token(word, 0, 0); 
-                        if (program.error) {
-                            exit(1);
-                        }
-                        word = malloc(sizeof(char));
-                        malloc_check(word, "malloc(word) in function lex_file");
-                        word_size = 0;
-                        word_alloc = 1;
-                    }
+                if (*p != '\\') {
+                    word[word_size++] = *p++;
                     continue;
                 }
-                word_size++;
-                if (word_size >= word_alloc) {
-                    word_alloc *= 2;
-                    word = realloc(word, sizeof(char) *word_alloc);
-                    malloc_check(word, "realloc(word) in function lex_file");
+                if (p + 1 == end) break;
+                switch (p[1]) {
+                case 'a':
+                    word[word_size++] = '\a';
+                    break;
+                case 'b':
+                    word[word_size++] = '\b';
+                    break;
+                case 'e':
+                    word[word_size++] = '\e';
+                    break;
+                case 'f':
+                    word[word_size++] = '\f';
+                    break;
+                case 'n':
+                    word[word_size++] = '\n';
+                    break;
+                case 'r':
+                    word[word_size++] = '\r';
+                    break;
+                case 't':
+                    word[word_size++] = '\t';
+                    break;
+                case 'v':
+                    word[word_size++] = '\v';
+                    break;
+                case '\\':
+                    word[word_size++] = '\\';
+                    break;
+                case '\'':
+                    word[word_size++] = '\'';
+                    break;
+                case '"':
+                    word[word_size++] = '\"';
+                    break;
+                case '?':
+                    word[word_size++] = '\?';
+                    break;
+                // TODO: add \nnn \xhh... \uhhhh \Uhhhhhhhh
+                default:
+                    fprintf(stderr, "%s:%lu:%lu ERROR: unknown escape sequence: '\\%c'\n", file_name, line, (size_t)(p - line_start + 1), p[1]);
+                    exit(1);
+                    break;
+                }
+                p += 2;
+            }
+            if (p == end) {
+                fprintf(stderr, "%s:%lu:%lu ERROR: unterminated %s\n", file_name, str_line, col, c == '"' ? "string" : "character");
+                exit(1);
+            }
+            p++;
+            word[word_size] = '\0';
+            if (c == '\'') {
+                if (word_size != 1) {
+                    fprintf(stderr, "%s:%lu:%lu ERROR: invalid character: '%s'\n", file_name, str_line, col, word);
+                    exit(1);
                 }
-                word[word_size - 1] = cur_char;
+                int ch = word[0];
+                sprintf(word, "%d", ch);
+                lex_emit(intern_index(word), 0, 0, file_name, str_line, col);
             } else {
-                if ((cur_char == '"' && !is_char) || (cur_char == '\'' && is_char)) {
-                    is_str = 0;
-                    if (is_char) {
-                        is_char = 0;
-                        if (word_size != 1) {
-                            fprintf(stderr, "%s:%lu:%lu ERROR: invalid character: '%s'\n", file_name, line, col, word);
-                            exit(1);
-                        }
-                        int c = word[0];
-                        free(word);
-                        word = malloc(sizeof(char) * 5);
-                        sprintf(word, "%d", c);
-
-                        arrput(program.tokens, token_create());
-                        arrput(program.positions, pos_create(file_name, str_line, str_col));
-                        lex_word_as_token(word, 0, 0);
-                    } else {
-                        word[word_size] = '\0';
-                        size_t adr = 0;
-                        if (shgetp_null(program.strs, word) != NULL) {
-                            adr = shget(program.strs, word).adr;
-                        }
-                        arrput(program.tokens, token_create());
-                        arrput(program.positions, pos_create(file_name, str_line, str_col));
-                        if (adr == 0) {
-                            shput(program.strs, word, str_create(word, program.idx));
-                            adr = shget(program.strs, word).adr;
-                        }
-                        lex_word_as_token(word, 1, adr);
-                    }
-                    if (program.error) {
-                        exit(1);
-                    }
-                    word = malloc(sizeof(char));
-                    malloc_check(word, "malloc(word) in function lex_file");
-                    word_size = 0;
-                    word_alloc = 1;
-                    line = str_line;
-                    col = col_word;
-                    continue;
-                } else if (cur_char == '\n') {
-                    line++;
-                    col = col_word = 1;
+                ptrdiff_t i = intern_index(word);
+                char *str = program.interned[i].key;
+                size_t adr = 0;
+                if (hmgetp_null(program.strs, str) != NULL) {
+                    adr = hmget(program.strs, str).adr;
                 } else {
-                    col_word = col;
-                    word_size++;
-                    if (word_size >= word_alloc) {
-                        word_alloc *= 2;
-                        word = realloc(word, sizeof(char) *word_alloc);
-                        malloc_check(word, "realloc(word) in function lex_file");
-                    }
-                    if (cur_char != '\\') {
-                        word[word_size - 1] = cur_char;
-                    } else {
-                        switch (nxt_char) {
-                        case 'a':
-                            word[word_size - 1] = '\a';
-                            break;
-                        case 'b':
-                            word[word_size - 1] = '\b';
-                            break;
-                        case 'e':
-                            word[word_size - 1] = '\e';
-                            break;
-                        case 'f':
-                            word[word_size - 1] = '\f';
-                            break;
-                        case 'n':
-                            word[word_size - 1] = '\n';
-                            break;
-                        case 'r':
-                            word[word_size - 1] = '\r';
-                            break;
-                        case 't':
-                            word[word_size - 1] = '\t';
-                            break;
-                        case 'v':
-                            word[word_size - 1] = '\v';
-                            break;
-                        case '\\':
-                            word[word_size - 1] = '\\';
-                            break;
-                        case '\'':
-                            word[word_size - 1] = '\'';
-                            break;
-                        case '"':
-                            word[word_size - 1] = '\"';
-                            break;
-                        case '?':
-                            word[word_size - 1] = '\?';
-                            break;
-                        // TODO: add \nnn \xhh... \uhhhh \Uhhhhhhhh
-                        default:
-                            fprintf(stderr, "%s:%lu:%lu ERROR: unknown escape sequence: '\\%c'\n", file_name, line, col, nxt_char);
-                            exit(1);
-                            break;
-                        }
-                        nxt_char = fgetc(f);
-                    }
+                    hmput(program.strs, str, str_create(str, program.idx));
+                    adr = hmget(program.strs, str).adr;
                 }
+                lex_emit(i, 1, adr, file_name, str_line, col);
             }
-        } else if (cur_char == '\n') {
-            is_cmt = 0;
+            continue;
+        }
+        char *start = p;
+        size_t h = 0;
+        while (p < end && !lex_delim[(unsigned char)*p]) {
+            if (*p == '!' && (p + 1 == end || p[1] != '=')) break;
+            if (*p == '/' && p + 1 < end && p[1] == '/') break;
+            h = h * 31 + (unsigned char)*p;
+            p++;
         }
+        size_t word_len = p - start;
+        ptrdiff_t *cached = &recent[(h ^ word_len) & (LEX_RECENT - 1)];
+        if (*cached >= 0 && program.interned[*cached].value.len == word_len && memcmp(program.interned[*cached].key, start, word_len) == 0) {
+            lex_emit(*cached, 0, 0, file_name, line, col);
+            continue;
+        }
+        memcpy(word, start, word_len);
+        word[word_len] = '\0';
+        *cached = intern_index(word);
+        lex_emit(*cached, 0, 0, file_name, line, col);
     }
     free(word);
-    fclose(f);
+    munmap(src, len);
 }
 
-void file_open(int file_num, char *file_path, int start) {
-    program.file_num = file_num;
-    arrput(program.file_path, malloc(strlen(file_path) + 1));
-    strcpy(program.file_path[arrlenu(program.file_path) - 1], file_path);
-    program.file_name = basename(program.file_path[arrlenu(program.file_path) - 1]);
-    program.idx = start;
-
-
-    program.types = NULL;
-    program.vars = NULL;
-    program.strs = NULL;
-    program.imports = NULL;
-
-    program.condition = 0;
-    program.setting = 0;
-    program.address = 0;
-    program.exporting = 0;
-    program.loop = 0;
-    program.error = 0;
-    program.proc_def = 0;
-    program.has_malloc = 0;
-    program.size_of = 0;
-    program.local_def = 0;
-    program.global_def = 0;
-
+// pairs every block keyword with its partner in one pass, so the parser and
+// the code generator never have to search the tokens for them:
+//   if, loop, var, const, proc, export -> jmp is the index of its 'end'
+//   do   -> jmp is the 'else' or 'end' it skips to
+//   else -> jmp is the 'end' of the if
+//   end  -> jmp is the index of its opening keyword
+void match_blocks(size_t start) {
+    token_t *tokens = program.tokens;
+    pos_t *positions = program.positions;
+    size_t *stack = NULL;
+    for (size_t i = start; i < arrlenu(program.tokens); i++) {
+        if (tokens[i].type != TKN_KEYWORD) continue;
+        switch (tokens[i].operation) {
+        case OP_IF:
+            // 'else if' shares the 'end' of the first if
+            if (i > start && tokens[i - 1].type == TKN_KEYWORD && tokens[i - 1].operation == OP_ELSE) break;
+        case OP_LOOP:
+        case OP_CREATE_VAR:
+        case OP_CREATE_CONST:
+        case OP_CREATE_PROC:
+        case OP_EXPORT:
+        case OP_DO:
+            arrput(stack, i);
+            break;
+        case OP_ELSE: {
+            int found_do = 0;
+            while (arrlenu(stack) > 0 && tokens[arrlast(stack)].operation == OP_DO) {
+                tokens[arrpop(stack)].jmp = i;
+                found_do = 1;
+            }
+            if (!found_do || arrlenu(stack) == 0 || (tokens[arrlast(stack)].operation != OP_IF && tokens[arrlast(stack)].operation != OP_ELSE)) {
+                program_error("else without a if", positions[i]);
+                continue;
+            }
+            arrput(stack, i);
+        } break;
+        case OP_END: {
+            while (arrlenu(stack) > 0 && (tokens[arrlast(stack)].operation == OP_DO || tokens[arrlast(stack)].operation == OP_ELSE)) {
+                tokens[arrpop(stack)].jmp = i;
+            }
+            if (arrlenu(stack) == 0) {
+                program_error("end without a opening", positions[i]);
+                continue;
+            }
+            size_t open = arrpop(stack);
+            tokens[open].jmp = i;
+            tokens[i].jmp = open;
+        } break;
+        default:
+            break;
+        }
+    }
+    for (size_t i = 0; i < arrlenu(stack); i++) {
+        switch (tokens[stack[i]].operation) {
+        case OP_IF:
+            program_error("if without a end", positions[stack[i]]);
+            break;
+        case OP_LOOP:
+            program_error("loop without a end", positions[stack[i]]);
+            break;
+        case OP_CREATE_VAR:
+            program_error("creating var without a end", positions[stack[i]]);
+            break;
+        case OP_CREATE_CONST:
+            program_error("creating const without a end", positions[stack[i]]);
+            break;
+        case OP_CREATE_PROC:
+            program_error("proc without a end", positions[stack[i]]);
+            break;
+        case OP_EXPORT:
+            program_error("'export' without a end", positions[stack[i]]);
+            break;
+        case OP_ELSE:
+            program_error("else without a end", positions[stack[i]]);
+            break;
+        default:
+            break;
+        }
+    }
+    arrfree(stack);
+    if (program.error) {
+        exit(1);
+    }
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// peak resident memory of the compiler so far
+long peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// adds the time since 'start' to 'phase' of the current module
+void report_phase(int phase, double start) {
+    if (program.time_report) {
+        program.reports[program.file_num].time[phase] += now() - start;
+    }
+}
+
+void json_string(char *str) {
+    putchar('"');
+    for (char *c = str; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            printf("\\%c", *c);
+        } else if ((unsigned char)*c < 0x20) {
+            printf("\\u%04x", *c);
+        } else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
+// --time-report prints a table on stderr, --time-report=json prints the same
+// numbers as json on stdout
+void report_print() {
+    if (!program.time_report) return;
+    double total = now() - program.start_time;
+    if (program.time_report == 2) {
+        printf("{\"modules\":[");
+        for (size_t i = 0; i < arrlenu(program.reports); i++) {
+            report_t *r = &program.reports[i];
+            printf(i == 0 ? "{\"file\":" : ",{\"file\":");
+            json_string(r->file);
+            printf(",\"tokens\":%lu,\"cached\":%s", r->tokens, r->cached ? "true" : "false");
+            for (int p = 0; p < PHASE_COUNT; p++) {
+                printf(",\"%s_ms\":%.3f", phase_name[p], r->time[p] * 1e3);
+            }
+            printf(",\"peak_rss_kb\":%ld}", r->peak_rss_kb);
+        }
+        printf("],\"link_ms\":%.3f,\"total_ms\":%.3f,\"peak_rss_kb\":%ld}\n", program.link_time * 1e3, total * 1e3, peak_rss_kb());
+        return;
+    }
+    fprintf(stderr, "%-24s %10s", "module", "tokens");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        fprintf(stderr, " %9s ms", phase_name[p]);
+    }
+    fprintf(stderr, " %10s\n", "peak KB");
+    for (size_t i = 0; i < arrlenu(program.reports); i++) {
+        report_t *r = &program.reports[i];
+        char *name = strrchr(r->file, '/') ? strrchr(r->file, '/') + 1 : r->file;
+        fprintf(stderr, "%-24s %10lu", name, r->tokens);
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            fprintf(stderr, " %12.2f", r->time[p] * 1e3);
+        }
+        fprintf(stderr, " %10ld%s\n", r->peak_rss_kb, r->cached ? " (cached)" : "");
+    }
+    fprintf(stderr, "link %.2f ms, total %.2f ms, peak %ld KB\n", program.link_time * 1e3, total * 1e3, peak_rss_kb());
+}
+
+void file_open(int file_num, char *file_path, int start) {
+    program.file_num = file_num;
+    arrput(program.file_path, malloc(strlen(file_path) + 1));
+    strcpy(program.file_path[arrlenu(program.file_path) - 1], file_path);
+    program.file_name = intern(basename(program.file_path[arrlenu(program.file_path) - 1]));
+    program.idx = start;
+
+
+    program.types = NULL;
+    program.vars = NULL;
+    program.strs = NULL;
+    program.imports = NULL;
+
+    program.condition = 0;
+    program.setting = 0;
+    program.address = 0;
+    program.exporting = 0;
+    program.loop = 0;
+    program.error = 0;
+    program.proc_def = 0;
+    program.has_malloc = 0;
+    program.size_of = 0;
+    program.local_def = 0;
+    program.global_def = 0;
+
     program.cur_proc = NULL;
 
     vartype_t vt;
     vt = vartype_create("byte", sizeof(char), 1);
-    shput(program.types, vt.name, vt);
+    hmput(program.types, vt.name, vt);
 
     vt = vartype_create("short", sizeof(short), 1);
-    shput(program.types, vt.name, vt);
+    hmput(program.types, vt.name, vt);
 
     vt = vartype_create("int", sizeof(int), 1);
-    shput(program.types, vt.name, vt);
+    hmput(program.types, vt.name, vt);
     
     vt = vartype_create("long", sizeof(long), 1);
-    shput(program.types, vt.name, vt);
+    hmput(program.types, vt.name, vt);
 
     vt = vartype_create("ptr", sizeof(void *), 1);
-    shput(program.types, vt.name, vt);
+    hmput(program.types, vt.name, vt);
 
+    double lex_start = now();
     lex_file(program.file_path[arrlenu(program.file_path) - 1]);
+    match_blocks(start);
+    report_phase(PHASE_LEX, lex_start);
 
 //    for (size_t i = 0; i < arrlenu(program.tokens); i++) {
 //        printf("token: %s, val: %s\n", token_name[program.tokens[i].type], program.tokens[i].val);
@@ -1708,801 +1669,3733 @@ void file_open(int file_num, char *file_path, int start) {
     program.idx = start;
 }
 
-void generate_assembly_x86_64_linux() {
-    char *asmfile = malloc(sizeof(char) * 37);
-    sprintf(asmfile, "file%lu.asm", program.file_num);
-    FILE *output = fopen(asmfile, "w");
-    free(asmfile);
-    if (output == NULL) {
-        fprintf(stderr, "[ERROR] Failed to create output.asm\n");
+// waits for one running assembler, exits if it failed
+void assemble_wait() {
+    int status;
+    pid_t pid = wait(&status);
+    if (pid == -1) {
+        program.running = 0;
+        return;
+    }
+    program.running--;
+    for (size_t i = 0; i < arrlenu(program.children); i++) {
+        if (program.children[i].pid != pid) continue;
+        if (program.time_report) {
+            program.reports[program.children[i].file_num].time[PHASE_ASSEMBLE] += now() - program.children[i].start;
+        }
+        arrdelswap(program.children, i);
+        break;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "[ERROR] %s failed\n", program.nasm ? "nasm" : "assembling");
         exit(1);
     }
-    fprintf(output, "BITS 64\n");
-    fprintf(output, "segment .text\n");
-    if (program.has_malloc) {
-        fprintf(output, "extern malloc, free\n");
-    }
-    fprintf(output, "_print:\n");
-    fprintf(output, "    mov rsi,rsp\n");
-    fprintf(output, "    sub rsp,32\n");
-    fprintf(output, "    mov r9,1\n");
-    fprintf(output, "    add rsi,31\n");
-    fprintf(output, "    mov byte [rsi],0xa\n");
-    fprintf(output, "    mov r10,10\n");
-    fprintf(output, "    cmp rax,0\n");
-    fprintf(output, "    je _IF0printJMP\n");
-    fprintf(output, "_LOOPprintJMP:\n");
-    fprintf(output, "    xor rdx,rdx\n");
-    fprintf(output, "    div r10\n");
-    fprintf(output, "    dec rsi\n");
-    fprintf(output, "    inc r9\n");
-    fprintf(output, "    add rdx,'0'\n");
-    fprintf(output, "    mov [rsi],dl\n");
-    fprintf(output, "    cmp rax,0\n");
-    fprintf(output, "    jne _LOOPprintJMP ; loop\n");
-    fprintf(output, "    jmp _printENDjmp\n");
-    fprintf(output, "_IF0printJMP:\n");
-    fprintf(output, "    dec rsi\n");
-    fprintf(output, "    inc r9\n");
-    fprintf(output, "    mov rdx,'0'\n");
-    fprintf(output, "    mov [rsi],dl\n");
-    fprintf(output, "_printENDjmp:\n");
-    fprintf(output, "    mov rax,1\n");
-    fprintf(output, "    mov rdi,1\n");
-    fprintf(output, "    mov rdx,r9\n");
-    fprintf(output, "    syscall\n");
-    fprintf(output, "    add rsp,32\n");
-    fprintf(output, "    ret\n");
+}
 
-    if (program.file_num > 1) {
-        fprintf(output, "extern $RET, $RETP\n");
-    }
-    while (parse_current_token(program)) {
-        size_t idx = program.idx;
-        switch (program.tokens[idx].operation) {
-        case OP_PUSH_INT: {
-            fprintf(output, ";   push int\n");
-            fprintf(output, "    mov rax,%s\n", program.tokens[idx].val);
-            fprintf(output, "    push rax\n");
-        } break;
-        case OP_PUSH_STR: {
-            fprintf(output, ";   push str\n");
-            str_t str;
-            str = shget(program.strs, program.tokens[idx].val);
-            fprintf(output, "    push %lu\n", str.len);
-            fprintf(output, "    push $STR%lu\n", program.tokens[idx].jmp);
-        } break;
-        case OP_PLUS: {
-            fprintf(output, ";   add int\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    add rbx,rax\n");
-            fprintf(output, "    push rbx\n");
-        } break;
-        case OP_MINUS: {
-            fprintf(output, ";   sub int\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    sub rbx,rax\n");
-            fprintf(output, "    push rbx\n");
-        } break;
-        case OP_MUL: {
-            fprintf(output, ";   mul int\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    mul rbx\n");
-            fprintf(output, "    push rax\n");
-        } break;
-        case OP_DIV: {
-            fprintf(output, ";   div int\n");
-            fprintf(output, "    xor rdx,rdx\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    div rbx\n");
-            fprintf(output, "    push rax\n");
-        } break;
-        case OP_MOD: {
-            fprintf(output, ";   div int\n");
-            fprintf(output, "    xor rdx,rdx\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    div rbx\n");
-            fprintf(output, "    push rdx\n");
-        } break;
-        case OP_SHR: {
-            fprintf(output, ";   shift right int\n");
-            fprintf(output, "    pop rcx\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    sar rbx,cl\n");
-            fprintf(output, "    push rbx\n");
-        } break;
-        case OP_SHL: {
-            fprintf(output, ";   div int\n");
-            fprintf(output, "    pop rcx\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    sal rbx,cl\n");
-            fprintf(output, "    push rbx\n");
-        } break;
-        case OP_BAND: {
-            fprintf(output, ";   div int\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    and rbx,rax\n");
-            fprintf(output, "    push rbx\n");
-        } break;
-        case OP_BOR: {
-            fprintf(output, ";   div int\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    or rbx,rax\n");
-            fprintf(output, "    push rbx\n");
-        } break;
-        case OP_BNOT: {
-            fprintf(output, ";   div int\n");
-            fprintf(output, "    mov rax,0xffffffffffffffff\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    xor rbx,rax\n");
-            fprintf(output, "    push rbx\n");
-        } break;
-        case OP_XOR: {
-            fprintf(output, ";   div int\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    xor rbx,rax\n");
-            fprintf(output, "    push rbx\n");
-        } break;
-        case OP_STORE: {
-            fprintf(output, ";   store\n");
-            vartype_t vt = shget(program.types, program.cur_vartype);
-            if (vt.primitive) {
-                fprintf(output, "    pop rax\n");
-                fprintf(output, "    pop rbx\n");
-                switch (vt.size_bytes) {
-                case sizeof(char):
-                    fprintf(output, "    mov byte [rbx],al\n");
-                    break;
-                case sizeof(short):
-                    fprintf(output, "    mov word [rbx],ax\n");
-                    break;
-                case sizeof(int):
-                    fprintf(output, "    mov dword [rbx],eax\n");
-                    break;
-                case sizeof(long):
-                    fprintf(output, "    mov qword [rbx],rax\n");
-                    break;
-                }
-            }
-            program.idx++;
-        } break;
-        case OP_FETCH: {
-            fprintf(output, ";   fetch\n");
-            vartype_t vt = shget(program.types, program.cur_vartype);
-            if (vt.primitive) {
-                fprintf(output, "    pop rbx\n");
-                fprintf(output, "    xor rax,rax\n");
-                switch (vt.size_bytes) {
-                case sizeof(char):
-                    fprintf(output, "    mov al,byte [rbx]\n");
-                    break;
-                case sizeof(short):
-                    fprintf(output, "    mov ax,word [rbx]\n");
-                    break;
-                case sizeof(int):
-                    fprintf(output, "    mov eax,dword [rbx]\n");
-                    break;
-                case sizeof(long):
-                    fprintf(output, "    mov rax,qword [rbx]\n");
-                    break;
-                }
-                fprintf(output, "    push rax\n");
+// with --nasm, assembles fileN.asm in the background so the next file can be
+// generated meanwhile, at most program.jobs assemblers run at once
+void assemble(size_t file_num) {
+    while (program.running >= program.jobs) {
+        assemble_wait();
+    }
+    char asmfile[32], objfile[32];
+    sprintf(asmfile, "file%lu.asm", file_num);
+    sprintf(objfile, "file%lu.o", file_num);
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "[ERROR] Failed to run nasm\n");
+        exit(1);
+    }
+    if (pid == 0) {
+        execlp("nasm", "nasm", "-felf64", "-g", asmfile, "-o", objfile, (char *)NULL);
+        fprintf(stderr, "[ERROR] Failed to run nasm\n");
+        _exit(127);
+    }
+    program.running++;
+    arrput(program.children, ((child_t){pid, file_num, now()}));
+}
+
+unsigned long fnv1a(unsigned long h, void *data, size_t len) {
+    unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 1099511628211UL;
+    }
+    return h;
+}
+
+// hashes everything a module's object depends on besides its imports: the
+// compiler, where the module sits in the build and its source. 0 means the
+// source couldn't be read
+unsigned long cache_key(size_t file_num, char *path) {
+    unsigned long h = 14695981039346656037UL;
+    size_t proc_base = hmlenu(program.procs);
+    h = fnv1a(h, SSOL_VERSION, strlen(SSOL_VERSION));
+    h = fnv1a(h, &program.nasm, sizeof(program.nasm));
+    h = fnv1a(h, &program.opt, sizeof(program.opt));
+    h = fnv1a(h, &file_num, sizeof(file_num));
+    h = fnv1a(h, &proc_base, sizeof(proc_base));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return 0;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return 0;
+    }
+    if (st.st_size > 0) {
+        char *src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (src == MAP_FAILED) {
+            close(fd);
+            return 0;
+        }
+        h = fnv1a(h, src, st.st_size);
+        munmap(src, st.st_size);
+    }
+    close(fd);
+    return h ? h : 1;
+}
+
+int file_copy(char *from, char *to) {
+    int in = open(from, O_RDONLY);
+    if (in == -1) return 0;
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1) {
+        close(in);
+        return 0;
+    }
+    char buf[65536];
+    ssize_t n;
+    int ok = 1;
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, n) != n) {
+            ok = 0;
+            break;
+        }
+    }
+    if (n < 0) ok = 0;
+    close(in);
+    close(out);
+    return ok;
+}
+
+// name of the proc with address 'adr', procs are stored in the order they're
+// created so the address is also the index
+char *proc_name(size_t adr) {
+    if (adr >= hmlenu(program.procs) || program.procs[adr].value.adr != adr) return NULL;
+    return program.procs[adr].key;
+}
+
+// writes the part of the module that other modules see, plus the exports it
+// was compiled against, the entry only becomes visible after its object is
+// stored by cache_store
+void cache_write_interface(unsigned long key) {
+    char path[64];
+    sprintf(path, CACHE_DIR "/%016lx.if.tmp", key);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) return;
+    for (size_t i = 0; i < arrlenu(program.imports); i++) {
+        for (size_t j = 0; j < hmlenu(program.exports); j++) {
+            size_t *export = program.exports[j].value;
+            if (export[0] != program.imports[i]) continue;
+            fprintf(f, "import %lu %lu %s\n", arrlenu(export) - 1, export[0], program.exports[j].key);
+            for (size_t k = 1; k < arrlenu(export); k++) {
+                fprintf(f, "%lu %s\n", export[k], proc_name(export[k]));
             }
-            program.idx++;
-        } break;
-        case OP_SIZEOF: {
-            fprintf(output, ";   sizeof\n");
-            vartype_t vt = shget(program.types, program.cur_vartype);
-            fprintf(output, "    push %lu\n", vt.size_bytes);
-            program.idx++;
-        } break;
-        case OP_PRINT: {
-            fprintf(output, ";   print int\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    call _print\n");
-        } break;
-        case OP_DUP: {
-            fprintf(output, ";   dup\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    push rax\n");
-            fprintf(output, "    push rax\n");
-        } break;
-        case OP_SWAP: {
-            fprintf(output, ";   swap\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    push rax\n");
-            fprintf(output, "    push rbx\n");
-        } break;
-         case OP_ROT: {
-            fprintf(output, ";   swap\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    pop rcx\n");
-            fprintf(output, "    push rax\n");
-            fprintf(output, "    push rbx\n");
-            fprintf(output, "    push rcx\n");
-        } break;
-         case OP_OVER: {
-            fprintf(output, ";   over\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    pop rcx\n");
-            fprintf(output, "    push rcx\n");
-            fprintf(output, "    push rbx\n");
-            fprintf(output, "    push rax\n");
-            fprintf(output, "    push rcx\n");
-        } break;
-        case OP_DROP: {
-            fprintf(output, ";   drop\n");
-            fprintf(output, "    pop rax\n");
-        } break;
-        case OP_CAP: {
-            int local = 0;
-            var_t var;
+        }
+    }
+    for (size_t i = 0; i < hmlenu(program.procs); i++) {
+        if (program.procs[i].value.file_num != program.file_num) continue;
+        fprintf(f, "proc %s\n", program.procs[i].key);
+    }
+    if (hmgetp_null(program.exports, program.file_name) != NULL) {
+        size_t *export = hmget(program.exports, program.file_name);
+        fprintf(f, "export %lu", arrlenu(export) - 1);
+        for (size_t k = 1; k < arrlenu(export); k++) {
+            fprintf(f, " %lu", export[k]);
+        }
+        fprintf(f, "\n");
+    }
+    fclose(f);
+}
+
+// a cache made by another compiler can't be hit, so it's emptied
+void cache_open() {
+    mkdir(CACHE_DIR, 0755);
+    char version[256] = "";
+    FILE *f = fopen(CACHE_DIR "/version", "r");
+    if (f != NULL) {
+        if (fgets(version, sizeof(version), f) == NULL) version[0] = '\0';
+        fclose(f);
+    }
+    if (strcmp(version, SSOL_VERSION "\n") == 0) return;
+    DIR *dir = opendir(CACHE_DIR);
+    if (dir == NULL) return;
+    char path[PATH_MAX];
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), CACHE_DIR "/%s", entry->d_name);
+        remove(path);
+    }
+    closedir(dir);
+    f = fopen(CACHE_DIR "/version", "w");
+    if (f == NULL) return;
+    fprintf(f, "%s\n", SSOL_VERSION);
+    fclose(f);
+}
+
+// each module keeps only its newest entry: the slot of a module (its path, where it sits in the build and the flags)
+// names the key stored for it last, and the entry it replaces is removed
+void cache_replace(size_t file_num, char *path, unsigned long key) {
+    unsigned long slot = 14695981039346656037UL;
+    slot = fnv1a(slot, path, strlen(path));
+    slot = fnv1a(slot, &program.nasm, sizeof(program.nasm));
+    slot = fnv1a(slot, &program.opt, sizeof(program.opt));
+    slot = fnv1a(slot, &file_num, sizeof(file_num));
+    char name[64];
+    unsigned long old = 0;
+    sprintf(name, CACHE_DIR "/%016lx.slot", slot);
+    FILE *f = fopen(name, "r");
+    if (f != NULL) {
+        if (fscanf(f, "%lx", &old) != 1) old = 0;
+        fclose(f);
+    }
+    if (old == key) return;
+    if (old != 0) {
+        char entry[64];
+        sprintf(entry, CACHE_DIR "/%016lx.o", old);
+        remove(entry);
+        sprintf(entry, CACHE_DIR "/%016lx.if", old);
+        remove(entry);
+    }
+    f = fopen(name, "w");
+    if (f == NULL) return;
+    fprintf(f, "%016lx\n", key);
+    fclose(f);
+}
+
+// stores fileN.o once its assembler is done
+void cache_store(size_t file_num, unsigned long key) {
+    char obj[32], path[64], tmp[64];
+    sprintf(obj, "file%lu.o", file_num);
+    sprintf(path, CACHE_DIR "/%016lx.o", key);
+    sprintf(tmp, CACHE_DIR "/%016lx.if.tmp", key);
+    if (!file_copy(obj, path)) {
+        remove(tmp);
+        return;
+    }
+    sprintf(path, CACHE_DIR "/%016lx.if", key);
+    rename(tmp, path);
+}
 
-            proc_t p = shget(program.procs, program.cur_proc[arrlenu(program.cur_proc) - 1]);
-            if (shgetp_null(p.vars, program.tokens[idx].val) != NULL) {
-                local = 1;
-                var = shget(p.vars, program.tokens[idx].val);
+// reuses a cached fileN.o if the module and the exports it imports didn't
+// change, registering its procs and exports as if it had been compiled
+int cache_load(size_t file_num, char *file_path, unsigned long key) {
+    char path[64], word[256], name[4096];
+    sprintf(path, CACHE_DIR "/%016lx.if", key);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return 0;
+    char **procs = NULL;
+    size_t *export = NULL;
+    int valid = 1;
+    while (valid && fscanf(f, "%255s", word) == 1) {
+        if (strcmp(word, "import") == 0) {
+            size_t count, num;
+            valid = fscanf(f, "%lu %lu %4095[^\n]", &count, &num, name) == 3;
+            size_t *current = valid && hmgetp_null(program.exports, intern(name)) != NULL ? hmget(program.exports, intern(name)) : NULL;
+            valid = valid && current != NULL && current[0] == num && arrlenu(current) == count + 1;
+            for (size_t i = 1; valid && i <= count; i++) {
+                size_t adr;
+                valid = fscanf(f, "%lu %255s", &adr, word) == 2 && current[i] == adr && proc_name(adr) != NULL && strcmp(proc_name(adr), word) == 0;
             }
-            if (!local) {
-                if (shgetp_null(program.vars, program.tokens[idx].val) != NULL) {
-                    var = shget(program.vars, program.tokens[idx].val);
-                }
+        } else if (strcmp(word, "proc") == 0) {
+            valid = fscanf(f, "%255s", word) == 1;
+            if (valid) arrput(procs, intern(word));
+        } else if (strcmp(word, "export") == 0) {
+            size_t count, adr;
+            valid = fscanf(f, "%lu", &count) == 1;
+            arrput(export, file_num);
+            for (size_t i = 0; valid && i < count; i++) {
+                valid = fscanf(f, "%lu", &adr) == 1;
+                arrput(export, adr);
+            }
+        } else {
+            valid = 0;
+        }
+    }
+    fclose(f);
+    char obj[32];
+    sprintf(path, CACHE_DIR "/%016lx.o", key);
+    sprintf(obj, "file%lu.o", file_num);
+    if (!valid || !file_copy(path, obj)) {
+        arrfree(procs);
+        arrfree(export);
+        return 0;
+    }
+
+    program.file_num = file_num;
+    arrput(program.file_path, malloc(strlen(file_path) + 1));
+    strcpy(program.file_path[arrlenu(program.file_path) - 1], file_path);
+    program.file_name = intern(basename(program.file_path[arrlenu(program.file_path) - 1]));
+    for (size_t i = 0; i < arrlenu(procs); i++) {
+        if (strcmp(procs[i], "main") == 0) has_main_in_files++;
+        proc_t proc = proc_create(procs[i]);
+        hmput(program.procs, proc.name, proc);
+    }
+    if (export != NULL) {
+        hmput(program.exports, program.file_name, export);
+    }
+    arrfree(procs);
+    return 1;
+}
+
+// make-compatible dependencies of the output binary
+void write_deps(int argc, char **argv, char *std) {
+    FILE *f = fopen("output.d", "w");
+    if (f == NULL) return;
+    fprintf(f, "output:");
+    for (int i = 0; i < argc; i++) {
+        fprintf(f, " ");
+        for (char *c = i == 0 ? std : argv[i]; *c != '\0'; c++) {
+            if (*c == ' ' || *c == '#') fputc('\\', f);
+            if (*c == '$') fputc('$', f);
+            fputc(*c, f);
+        }
+    }
+    fprintf(f, "\n");
+    fclose(f);
+}
+
+// built-in assembler, it understands the subset of nasm that
+// generate_assembly_x86_64_linux writes and turns it straight into an ELF64
+// relocatable object, so a build doesn't need to go through nasm
+
+enum {
+    ASM_TEXT,
+    ASM_DATA,
+    ASM_BSS,
+    ASM_ABS,
+    ASM_UNDEF
+};
+
+enum {
+    FIX_REL32,  // rel32 of a jmp/jcc/call
+    FIX_PLT32,  // rel32 of a call through the plt
+    FIX_ABS32S, // sign extended 32 bit address
+    FIX_ABS64   // 64 bit address
+};
+
+enum {
+    OPND_REG,
+    OPND_MEM,
+    OPND_IMM
+};
+
+typedef struct {
+    char *name;
+    int section;
+    unsigned long value;
+    int global;
+    int used;
+    size_t elf_idx;
+} asm_sym_t;
+
+typedef struct {
+    size_t offset;
+    int kind;
+    size_t sym;
+    long addend;
+    size_t line;
+} asm_fixup_t;
+
+typedef struct {
+    int kind;
+    int size;    // in bytes, 0 when not known
+    int reg;     // register or base register, -1 for none
+    int index;   // -1 for none
+    int scale;
+    long disp;
+    long sym;    // -1 for none
+    int plt;
+    int rex8;    // spl, bpl, sil and dil need a rex prefix
+    int high8;   // ah, ch, dh and bh can't have one
+} asm_opnd_t;
+
+typedef struct {
+    unsigned char *text;
+    unsigned char *data;
+    unsigned long bss_size;
+    int section;
+    asm_sym_t *syms;
+    struct { char *key; size_t value; } *sym_idx;
+    asm_fixup_t *fixups;
+    char **args;
+    size_t line;
+    char *file;
+} asm_t;
+
+typedef struct {
+    char *name;
+    int num;
+    int size;
+} asm_reg_t;
+
+asm_reg_t asm_regs[] = {
+    {"rax", 0, 8}, {"rcx", 1, 8}, {"rdx", 2, 8}, {"rbx", 3, 8},
+    {"rsp", 4, 8}, {"rbp", 5, 8}, {"rsi", 6, 8}, {"rdi", 7, 8},
+    {"r8", 8, 8}, {"r9", 9, 8}, {"r10", 10, 8}, {"r11", 11, 8},
+    {"r12", 12, 8}, {"r13", 13, 8}, {"r14", 14, 8}, {"r15", 15, 8},
+    {"eax", 0, 4}, {"ecx", 1, 4}, {"edx", 2, 4}, {"ebx", 3, 4},
+    {"esp", 4, 4}, {"ebp", 5, 4}, {"esi", 6, 4}, {"edi", 7, 4},
+    {"r8d", 8, 4}, {"r9d", 9, 4}, {"r10d", 10, 4}, {"r11d", 11, 4},
+    {"r12d", 12, 4}, {"r13d", 13, 4}, {"r14d", 14, 4}, {"r15d", 15, 4},
+    {"ax", 0, 2}, {"cx", 1, 2}, {"dx", 2, 2}, {"bx", 3, 2},
+    {"sp", 4, 2}, {"bp", 5, 2}, {"si", 6, 2}, {"di", 7, 2},
+    {"r8w", 8, 2}, {"r9w", 9, 2}, {"r10w", 10, 2}, {"r11w", 11, 2},
+    {"r12w", 12, 2}, {"r13w", 13, 2}, {"r14w", 14, 2}, {"r15w", 15, 2},
+    {"al", 0, 1}, {"cl", 1, 1}, {"dl", 2, 1}, {"bl", 3, 1},
+    {"spl", 4, 1}, {"bpl", 5, 1}, {"sil", 6, 1}, {"dil", 7, 1},
+    {"r8b", 8, 1}, {"r9b", 9, 1}, {"r10b", 10, 1}, {"r11b", 11, 1},
+    {"r12b", 12, 1}, {"r13b", 13, 1}, {"r14b", 14, 1}, {"r15b", 15, 1},
+    {"ah", 4, 1}, {"ch", 5, 1}, {"dh", 6, 1}, {"bh", 7, 1},
+};
+
+// what kind of encoding an instruction uses, 'ext' is the opcode extension,
+// condition code or opcode depending on the kind
+enum {
+    INS_ALU,
+    INS_SHIFT,
+    INS_MOV,
+    INS_MOVX,
+    INS_MOVSXD,
+    INS_LEA,
+    INS_TEST,
+    INS_IMUL,
+    INS_INCDEC,
+    INS_UNARY,
+    INS_PUSH,
+    INS_POP,
+    INS_JMP,
+    INS_JCC,
+    INS_CMOV,
+    INS_SET,
+    INS_BARE
+};
+
+typedef struct {
+    int kind;
+    int ext;
+} asm_ins_t;
+
+struct { char *name; asm_ins_t ins; } asm_ins[] = {
+    {"add", {INS_ALU, 0}}, {"or", {INS_ALU, 1}}, {"adc", {INS_ALU, 2}}, {"sbb", {INS_ALU, 3}},
+    {"and", {INS_ALU, 4}}, {"sub", {INS_ALU, 5}}, {"xor", {INS_ALU, 6}}, {"cmp", {INS_ALU, 7}},
+    {"rol", {INS_SHIFT, 0}}, {"ror", {INS_SHIFT, 1}}, {"rcl", {INS_SHIFT, 2}}, {"rcr", {INS_SHIFT, 3}},
+    {"shl", {INS_SHIFT, 4}}, {"sal", {INS_SHIFT, 4}}, {"shr", {INS_SHIFT, 5}}, {"sar", {INS_SHIFT, 7}},
+    {"mov", {INS_MOV, 0}}, {"movzx", {INS_MOVX, 0x0fb6}}, {"movsx", {INS_MOVX, 0x0fbe}}, {"movsxd", {INS_MOVSXD, 0}},
+    {"lea", {INS_LEA, 0}}, {"test", {INS_TEST, 0}}, {"imul", {INS_IMUL, 5}},
+    {"inc", {INS_INCDEC, 0}}, {"dec", {INS_INCDEC, 1}}, {"not", {INS_UNARY, 2}}, {"neg", {INS_UNARY, 3}},
+    {"mul", {INS_UNARY, 4}}, {"div", {INS_UNARY, 6}}, {"idiv", {INS_UNARY, 7}},
+    {"push", {INS_PUSH, 0}}, {"pop", {INS_POP, 0}}, {"jmp", {INS_JMP, 4}}, {"call", {INS_JMP, 2}},
+    {"ret", {INS_BARE, 0xc3}}, {"syscall", {INS_BARE, 0x0f05}}, {"cqo", {INS_BARE, 0x4899}}, {"nop", {INS_BARE, 0x90}},
+};
+
+struct { char *name; int cc; } asm_conds[] = {
+    {"o", 0}, {"no", 1}, {"b", 2}, {"c", 2}, {"nae", 2}, {"ae", 3}, {"nb", 3}, {"nc", 3},
+    {"e", 4}, {"z", 4}, {"ne", 5}, {"nz", 5}, {"be", 6}, {"na", 6}, {"a", 7}, {"nbe", 7},
+    {"s", 8}, {"ns", 9}, {"p", 10}, {"pe", 10}, {"np", 11}, {"po", 11}, {"l", 12}, {"nge", 12},
+    {"ge", 13}, {"nl", 13}, {"le", 14}, {"ng", 14}, {"g", 15}, {"nle", 15},
+};
+
+struct { char *key; asm_reg_t value; } *asm_reg_map = NULL;
+struct { char *key; asm_ins_t value; } *asm_ins_map = NULL;
+
+void asm_init() {
+    sh_new_strdup(asm_reg_map);
+    sh_new_strdup(asm_ins_map);
+    for (size_t i = 0; i < sizeof(asm_regs) / sizeof(*asm_regs); i++) {
+        shput(asm_reg_map, asm_regs[i].name, asm_regs[i]);
+    }
+    for (size_t i = 0; i < sizeof(asm_ins) / sizeof(*asm_ins); i++) {
+        shput(asm_ins_map, asm_ins[i].name, asm_ins[i].ins);
+    }
+    char name[16];
+    for (size_t i = 0; i < sizeof(asm_conds) / sizeof(*asm_conds); i++) {
+        sprintf(name, "j%s", asm_conds[i].name);
+        shput(asm_ins_map, name, ((asm_ins_t){INS_JCC, asm_conds[i].cc}));
+        sprintf(name, "cmov%s", asm_conds[i].name);
+        shput(asm_ins_map, name, ((asm_ins_t){INS_CMOV, asm_conds[i].cc}));
+        sprintf(name, "set%s", asm_conds[i].name);
+        shput(asm_ins_map, name, ((asm_ins_t){INS_SET, asm_conds[i].cc}));
+    }
+}
+
+void asm_error(asm_t *a, char *msg, char *what) {
+    fprintf(stderr, "%s:%lu ERROR: %s '%s'\n", a->file, a->line, msg, what);
+    exit(1);
+}
+
+asm_reg_t *asm_reg_find(char *word) {
+    if (*word < 'a' || *word > 's') return NULL;
+    ptrdiff_t idx = shgeti(asm_reg_map, word);
+    return idx == -1 ? NULL : &asm_reg_map[idx].value;
+}
+
+// symbols keep nasm's meaning of a leading '$', which only marks the word as
+// an identifier and isn't part of the name
+size_t asm_sym(asm_t *a, char *name) {
+    if (name[0] == '$') name++;
+    if (shgeti(a->sym_idx, name) != -1) return shget(a->sym_idx, name);
+    asm_sym_t sym = {0};
+    sym.section = ASM_UNDEF;
+    shput(a->sym_idx, name, arrlenu(a->syms));
+    sym.name = a->sym_idx[shgeti(a->sym_idx, name)].key;
+    arrput(a->syms, sym);
+    return arrlenu(a->syms) - 1;
+}
+
+void asm_define(asm_t *a, char *name, int section, unsigned long value) {
+    size_t idx = asm_sym(a, name);
+    asm_sym_t *sym = &a->syms[idx];
+    if (sym->section != ASM_UNDEF) asm_error(a, "symbol redefined", name);
+    sym->section = section;
+    sym->value = value;
+}
+
+size_t asm_offset(asm_t *a) {
+    switch (a->section) {
+    case ASM_TEXT: return arrlenu(a->text);
+    case ASM_DATA: return arrlenu(a->data);
+    default: return a->bss_size;
+    }
+}
+
+void asm_byte(asm_t *a, int b) {
+    if (a->section == ASM_DATA) {
+        arrput(a->data, b);
+    } else if (a->section == ASM_TEXT) {
+        arrput(a->text, b);
+    } else {
+        a->bss_size++;
+    }
+}
+
+void asm_imm(asm_t *a, unsigned long v, int size) {
+    for (int i = 0; i < size; i++) {
+        asm_byte(a, (v >> (i * 8)) & 0xff);
+    }
+}
+
+void asm_fixup(asm_t *a, int kind, long sym, long addend, int size) {
+    asm_fixup_t fix = {asm_offset(a), kind, sym, addend, a->line};
+    a->syms[sym].used = 1;
+    arrput(a->fixups, fix);
+    asm_imm(a, 0, size);
+}
+
+int fits_i8(long v) {
+    return v >= -128 && v <= 127;
+}
+
+int fits_i32(long v) {
+    return v >= -2147483648L && v <= 2147483647L;
+}
+
+int asm_parse_num(char *word, long *out) {
+    int neg = 0;
+    if (*word == '-') {
+        neg = 1;
+        word++;
+    }
+    if (word[0] == '\'' && word[1] != '\0' && word[2] == '\'' && word[3] == '\0') {
+        *out = (unsigned char)word[1];
+    } else if (word[0] >= '0' && word[0] <= '9') {
+        char *end;
+        *out = strtoull(word, &end, 0);
+        if (*end != '\0') return 0;
+    } else {
+        return 0;
+    }
+    if (neg) *out = -*out;
+    return 1;
+}
+
+char *asm_trim(char *s) {
+    while (*s == ' ' || *s == '\t') s++;
+    char *end = s + strlen(s);
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+    *end = '\0';
+    return s;
+}
+
+int asm_size_word(char *word) {
+    if (strcmp(word, "byte") == 0) return 1;
+    if (strcmp(word, "word") == 0) return 2;
+    if (strcmp(word, "dword") == 0) return 4;
+    if (strcmp(word, "qword") == 0) return 8;
+    return 0;
+}
+
+void asm_parse_mem(asm_t *a, char *s, asm_opnd_t *op) {
+    op->kind = OPND_MEM;
+    char *end = strchr(s, ']');
+    if (end == NULL) asm_error(a, "expected ']' in", s);
+    *end = '\0';
+    int sign = 1;
+    while (*s != '\0') {
+        while (*s == ' ') s++;
+        if (*s == '+' || *s == '-') {
+            sign = *s == '-' ? -1 : 1;
+            s++;
+            continue;
+        }
+        char *term = s;
+        while (*s != '\0' && *s != '+' && *s != '-' && *s != ' ') s++;
+        char c = *s;
+        *s = '\0';
+        char *star = strchr(term, '*');
+        int scale = 1;
+        if (star != NULL) {
+            *star = '\0';
+            scale = atoi(star + 1);
+        }
+        asm_reg_t *reg = asm_reg_find(term);
+        long num;
+        if (reg != NULL) {
+            if (reg->size != 8) asm_error(a, "invalid address register", term);
+            if (op->reg == -1 && scale == 1) {
+                op->reg = reg->num;
+            } else if (op->index == -1) {
+                op->index = reg->num;
+                op->scale = scale;
+            } else {
+                asm_error(a, "invalid address", term);
+            }
+        } else if (asm_parse_num(term, &num)) {
+            op->disp += sign * num;
+        } else {
+            op->sym = asm_sym(a, term);
+        }
+        *s = c;
+    }
+}
+
+void asm_parse_opnd(asm_t *a, char *s, asm_opnd_t *op) {
+    memset(op, 0, sizeof(*op));
+    op->reg = -1;
+    op->index = -1;
+    op->sym = -1;
+    s = asm_trim(s);
+    char *space = strchr(s, ' ');
+    char *bracket = strchr(s, '[');
+    if (space != NULL && (bracket == NULL || space < bracket)) {
+        *space = '\0';
+        int size = asm_size_word(s);
+        if (size != 0) {
+            op->size = size;
+            s = asm_trim(space + 1);
+        } else {
+            *space = ' ';
+        }
+    }
+    if (*s == '[') {
+        asm_parse_mem(a, s + 1, op);
+        return;
+    }
+    asm_reg_t *reg = asm_reg_find(s);
+    if (reg != NULL) {
+        op->kind = OPND_REG;
+        op->reg = reg->num;
+        op->size = reg->size;
+        op->rex8 = reg->size == 1 && reg->num >= 4 && reg->num < 8 && reg->name[1] != 'h';
+        op->high8 = reg->size == 1 && reg->name[1] == 'h';
+        return;
+    }
+    op->kind = OPND_IMM;
+    char *wrt = strstr(s, " WRT ..plt");
+    if (wrt != NULL) {
+        *wrt = '\0';
+        op->plt = 1;
+    }
+    if (!asm_parse_num(s, &op->disp)) {
+        op->sym = asm_sym(a, s);
+    }
+}
+
+// emits the optional operand size prefix, rex and the opcode
+void asm_prefix(asm_t *a, int size, int opcode, int reg, asm_opnd_t *rm, int force_rex) {
+    if (size == 2) asm_byte(a, 0x66);
+    int rex = 0;
+    if (size == 8) rex |= 8;
+    if (reg >= 8) rex |= 4;
+    if (rm->kind == OPND_MEM && rm->index >= 8) rex |= 1 << 1;
+    if (rm->reg >= 8) rex |= 1;
+    if (rex != 0 || force_rex || rm->rex8) {
+        asm_byte(a, 0x40 | rex);
+    }
+    if (opcode > 0xffff) asm_byte(a, opcode >> 16);
+    if (opcode > 0xff) asm_byte(a, (opcode >> 8) & 0xff);
+    asm_byte(a, opcode & 0xff);
+}
+
+// emits the modrm (and sib/displacement) for 'reg' and the register or
+// memory operand 'rm'
+void asm_modrm(asm_t *a, int reg, asm_opnd_t *rm) {
+    reg &= 7;
+    if (rm->kind == OPND_REG) {
+        asm_byte(a, 0xc0 | reg << 3 | (rm->reg & 7));
+        return;
+    }
+    int scale = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0;
+    if (rm->reg == -1) {
+        // absolute address, or index with no base
+        asm_byte(a, 0x04 | reg << 3);
+        if (rm->index == -1) {
+            asm_byte(a, 0x25);
+        } else {
+            asm_byte(a, scale << 6 | (rm->index & 7) << 3 | 5);
+        }
+        if (rm->sym != -1) {
+            asm_fixup(a, FIX_ABS32S, rm->sym, rm->disp, 4);
+        } else {
+            asm_imm(a, rm->disp, 4);
+        }
+        return;
+    }
+    int mod;
+    if (rm->sym != -1 || !fits_i8(rm->disp)) {
+        mod = 2;
+    } else if (rm->disp != 0 || (rm->reg & 7) == 5) {
+        mod = 1;
+    } else {
+        mod = 0;
+    }
+    if (rm->index != -1 || (rm->reg & 7) == 4) {
+        asm_byte(a, mod << 6 | reg << 3 | 4);
+        int index = rm->index == -1 ? 4 : rm->index & 7;
+        asm_byte(a, scale << 6 | index << 3 | (rm->reg & 7));
+    } else {
+        asm_byte(a, mod << 6 | reg << 3 | (rm->reg & 7));
+    }
+    if (mod == 1) {
+        asm_byte(a, rm->disp & 0xff);
+    } else if (mod == 2) {
+        if (rm->sym != -1) {
+            asm_fixup(a, FIX_ABS32S, rm->sym, rm->disp, 4);
+        } else {
+            asm_imm(a, rm->disp, 4);
+        }
+    }
+}
+
+// reg/mem form of an instruction: opcode is for the 16/32/64 bit version
+// and opcode8 for the byte one
+void asm_op_rm(asm_t *a, int size, int opcode8, int opcode, int reg, asm_opnd_t *rm, int reg_rex8) {
+    if (size == 0) asm_error(a, "operation size not specified for", "operand");
+    asm_prefix(a, size, size == 1 ? opcode8 : opcode, reg, rm, reg_rex8);
+    asm_modrm(a, reg, rm);
+}
+
+void asm_imm_opnd(asm_t *a, asm_opnd_t *imm, int size, int kind) {
+    if (imm->sym != -1) {
+        asm_fixup(a, kind, imm->sym, imm->disp, size);
+    } else {
+        asm_imm(a, imm->disp, size);
+    }
+}
+
+void asm_branch(asm_t *a, asm_opnd_t *target) {
+    if (target->kind != OPND_IMM || target->sym == -1) asm_error(a, "invalid branch target", "");
+    asm_fixup(a, target->plt ? FIX_PLT32 : FIX_REL32, target->sym, -4, 4);
+}
+
+void asm_instruction(asm_t *a, char *op, char **args, size_t argc) {
+    ptrdiff_t found = shgeti(asm_ins_map, op);
+    if (found == -1) asm_error(a, "unsupported instruction", op);
+    asm_ins_t ins = asm_ins_map[found].value;
+    asm_opnd_t o[3];
+    if (argc > 3) asm_error(a, "too many operands for", op);
+    for (size_t i = 0; i < argc; i++) {
+        asm_parse_opnd(a, args[i], &o[i]);
+    }
+    int size = 0;
+    for (size_t i = 0; i < argc; i++) {
+        if (o[i].kind == OPND_REG) {
+            size = o[i].size;
+            break;
+        }
+        if (o[i].size != 0 && size == 0) size = o[i].size;
+    }
+    int rex8 = (argc > 0 && o[0].rex8) || (argc > 1 && o[1].rex8);
+    int n = ins.ext;
+    switch (ins.kind) {
+    case INS_ALU: {
+        if (argc != 2) break;
+        if (o[1].kind == OPND_REG) {
+            asm_op_rm(a, size, n * 8, n * 8 + 1, o[1].reg, &o[0], rex8);
+        } else if (o[0].kind == OPND_REG && o[1].kind == OPND_MEM) {
+            asm_op_rm(a, size, n * 8 + 2, n * 8 + 3, o[0].reg, &o[1], rex8);
+        } else if (size == 1) {
+            asm_op_rm(a, size, 0x80, 0x80, n, &o[0], rex8);
+            asm_imm_opnd(a, &o[1], 1, FIX_ABS32S);
+        } else if (o[1].sym == -1 && fits_i8(o[1].disp)) {
+            asm_op_rm(a, size, 0x83, 0x83, n, &o[0], rex8);
+            asm_imm(a, o[1].disp, 1);
+        } else {
+            asm_op_rm(a, size, 0x81, 0x81, n, &o[0], rex8);
+            asm_imm_opnd(a, &o[1], size == 2 ? 2 : 4, FIX_ABS32S);
+        }
+        return;
+    }
+    case INS_SHIFT: {
+        if (argc != 2) break;
+        if (o[1].kind == OPND_REG && o[1].reg == 1 && o[1].size == 1) {
+            asm_op_rm(a, o[0].size, 0xd2, 0xd3, n, &o[0], o[0].rex8);
+        } else if (o[1].kind == OPND_IMM && o[1].sym == -1) {
+            asm_op_rm(a, size, 0xc0, 0xc1, n, &o[0], rex8);
+            asm_imm(a, o[1].disp, 1);
+        } else {
+            break;
+        }
+        return;
+    }
+    case INS_MOV: {
+        if (argc != 2) break;
+        if (o[0].kind == OPND_REG && o[1].kind == OPND_IMM) {
+            int r = o[0].reg;
+            unsigned long v = o[1].disp;
+            if (size == 8 && o[1].sym != -1) {
+                asm_prefix(a, 8, 0xb8 + (r & 7), 0, &o[0], 0);
+                asm_fixup(a, FIX_ABS64, o[1].sym, o[1].disp, 8);
+            } else if (size == 8 && v > 0xffffffffUL && fits_i32(o[1].disp)) {
+                asm_op_rm(a, 8, 0xc7, 0xc7, 0, &o[0], 0);
+                asm_imm(a, v, 4);
+            } else if (size == 8 && v > 0xffffffffUL) {
+                asm_prefix(a, 8, 0xb8 + (r & 7), 0, &o[0], 0);
+                asm_imm(a, v, 8);
+            } else {
+                // a 32 bit mov zero extends, so it covers 64 bit values that fit
+                int s = size == 8 ? 4 : size;
+                asm_prefix(a, s, (s == 1 ? 0xb0 : 0xb8) + (r & 7), 0, &o[0], 0);
+                asm_imm_opnd(a, &o[1], s, FIX_ABS32S);
+            }
+        } else if (o[1].kind == OPND_REG) {
+            asm_op_rm(a, size, 0x88, 0x89, o[1].reg, &o[0], rex8);
+        } else if (o[0].kind == OPND_REG && o[1].kind == OPND_MEM) {
+            asm_op_rm(a, size, 0x8a, 0x8b, o[0].reg, &o[1], rex8);
+        } else if (o[0].kind == OPND_MEM && o[1].kind == OPND_IMM) {
+            asm_op_rm(a, size, 0xc6, 0xc7, 0, &o[0], 0);
+            asm_imm_opnd(a, &o[1], size == 8 ? 4 : size, FIX_ABS32S);
+        } else {
+            break;
+        }
+        return;
+    }
+    case INS_MOVX: {
+        if (argc != 2 || o[0].kind != OPND_REG || (o[1].size != 1 && o[1].size != 2)) break;
+        asm_prefix(a, o[0].size, n + (o[1].size == 2), o[0].reg, &o[1], 0);
+        asm_modrm(a, o[0].reg, &o[1]);
+        return;
+    }
+    case INS_MOVSXD: {
+        if (argc != 2 || o[0].kind != OPND_REG) break;
+        asm_op_rm(a, 8, 0x63, 0x63, o[0].reg, &o[1], 0);
+        return;
+    }
+    case INS_LEA: {
+        if (argc != 2 || o[0].kind != OPND_REG || o[1].kind != OPND_MEM) break;
+        asm_op_rm(a, size, 0x8d, 0x8d, o[0].reg, &o[1], 0);
+        return;
+    }
+    case INS_TEST: {
+        if (argc != 2) break;
+        if (o[1].kind == OPND_REG) {
+            asm_op_rm(a, size, 0x84, 0x85, o[1].reg, &o[0], rex8);
+        } else {
+            asm_op_rm(a, size, 0xf6, 0xf7, 0, &o[0], rex8);
+            asm_imm_opnd(a, &o[1], size == 8 ? 4 : size, FIX_ABS32S);
+        }
+        return;
+    }
+    case INS_IMUL: {
+        if (argc == 1) {
+            asm_op_rm(a, size, 0xf6, 0xf7, n, &o[0], rex8);
+        } else if (o[0].kind != OPND_REG) {
+            break;
+        } else if (argc == 3 || o[1].kind == OPND_IMM) {
+            asm_opnd_t *src = argc == 3 ? &o[1] : &o[0];
+            asm_opnd_t *imm = argc == 3 ? &o[2] : &o[1];
+            if (imm->sym == -1 && fits_i8(imm->disp)) {
+                asm_op_rm(a, size, 0x6b, 0x6b, o[0].reg, src, 0);
+                asm_imm(a, imm->disp, 1);
+            } else {
+                asm_op_rm(a, size, 0x69, 0x69, o[0].reg, src, 0);
+                asm_imm_opnd(a, imm, size == 2 ? 2 : 4, FIX_ABS32S);
+            }
+        } else {
+            asm_op_rm(a, size, 0x0faf, 0x0faf, o[0].reg, &o[1], 0);
+        }
+        return;
+    }
+    case INS_INCDEC:
+    case INS_UNARY: {
+        if (argc != 1) break;
+        if (ins.kind == INS_INCDEC) {
+            asm_op_rm(a, size, 0xfe, 0xff, n, &o[0], rex8);
+        } else {
+            asm_op_rm(a, size, 0xf6, 0xf7, n, &o[0], rex8);
+        }
+        return;
+    }
+    case INS_PUSH: {
+        if (argc != 1) break;
+        if (o[0].kind == OPND_REG) {
+            if (o[0].reg >= 8) asm_byte(a, 0x41);
+            asm_byte(a, 0x50 + (o[0].reg & 7));
+        } else if (o[0].kind == OPND_MEM) {
+            // push and pop are 64 bit without a rex.w
+            asm_op_rm(a, 4, 0xff, 0xff, 6, &o[0], 0);
+        } else if (o[0].sym == -1 && fits_i8(o[0].disp)) {
+            asm_byte(a, 0x6a);
+            asm_imm(a, o[0].disp, 1);
+        } else {
+            asm_byte(a, 0x68);
+            asm_imm_opnd(a, &o[0], 4, FIX_ABS32S);
+        }
+        return;
+    }
+    case INS_POP: {
+        if (argc != 1) break;
+        if (o[0].kind == OPND_REG) {
+            if (o[0].reg >= 8) asm_byte(a, 0x41);
+            asm_byte(a, 0x58 + (o[0].reg & 7));
+        } else {
+            asm_op_rm(a, 4, 0x8f, 0x8f, 0, &o[0], 0);
+        }
+        return;
+    }
+    case INS_JMP: {
+        if (argc != 1) break;
+        if (o[0].kind != OPND_IMM) {
+            asm_op_rm(a, 4, 0xff, 0xff, n, &o[0], 0);
+        } else {
+            asm_byte(a, n == 2 ? 0xe8 : 0xe9);
+            asm_branch(a, &o[0]);
+        }
+        return;
+    }
+    case INS_JCC: {
+        if (argc != 1) break;
+        asm_byte(a, 0x0f);
+        asm_byte(a, 0x80 + n);
+        asm_branch(a, &o[0]);
+        return;
+    }
+    case INS_CMOV: {
+        if (argc != 2 || o[0].kind != OPND_REG) break;
+        asm_op_rm(a, size, 0x0f40 + n, 0x0f40 + n, o[0].reg, &o[1], 0);
+        return;
+    }
+    case INS_SET: {
+        if (argc != 1) break;
+        asm_prefix(a, 1, 0x0f90 + n, 0, &o[0], 0);
+        asm_modrm(a, 0, &o[0]);
+        return;
+    }
+    case INS_BARE: {
+        if (argc != 0) break;
+        if (n > 0xff) asm_byte(a, n >> 8);
+        asm_byte(a, n & 0xff);
+        return;
+    }
+    }
+    asm_error(a, "invalid operands for", op);
+}
+
+// splits 'line' on commas that aren't inside brackets or quotes into a->args
+size_t asm_split(asm_t *a, char *line) {
+    arrsetlen(a->args, 0);
+    int depth = 0, quote = 0;
+    char *start = line;
+    for (char *c = line; ; c++) {
+        if (*c == '\'') quote = !quote;
+        if (!quote && *c == '[') depth++;
+        if (!quote && *c == ']') depth--;
+        if (*c == '\0' || (!quote && depth == 0 && *c == ',')) {
+            int last = *c == '\0';
+            *c = '\0';
+            arrput(a->args, asm_trim(start));
+            if (last) break;
+            start = c + 1;
+        }
+    }
+    if (arrlenu(a->args) == 1 && a->args[0][0] == '\0') arrsetlen(a->args, 0);
+    return arrlenu(a->args);
+}
+
+void asm_line(asm_t *a, char *line) {
+    int quote = 0;
+    for (char *c = line; *c != '\0'; c++) {
+        if (*c == '\'' || *c == '"') quote = !quote;
+        if (*c == ';' && !quote) {
+            *c = '\0';
+            break;
+        }
+    }
+    line = asm_trim(line);
+    if (*line == '\0') return;
+    char *word = line;
+    while (*line != '\0' && *line != ' ' && *line != '\t') line++;
+    if (*line != '\0') *line++ = '\0';
+    line = asm_trim(line);
+    size_t len = strlen(word);
+    if (word[len - 1] == ':') {
+        word[len - 1] = '\0';
+        char *label = word;
+        word = line;
+        while (*line != '\0' && *line != ' ' && *line != '\t') line++;
+        if (*line != '\0') *line++ = '\0';
+        line = asm_trim(line);
+        if (strcmp(word, "equ") == 0) {
+            long v;
+            if (!asm_parse_num(line, &v)) asm_error(a, "invalid equ value", line);
+            asm_define(a, label, ASM_ABS, v);
+            return;
+        }
+        asm_define(a, label, a->section, asm_offset(a));
+        if (*word == '\0') return;
+    }
+    size_t argc = asm_split(a, line);
+    char **args = a->args;
+    if (strcmp(word, "BITS") == 0) {
+        return;
+    } else if (strcmp(word, "segment") == 0 || strcmp(word, "section") == 0) {
+        if (argc != 1) asm_error(a, "invalid section", line);
+        if (strcmp(args[0], ".text") == 0) {
+            a->section = ASM_TEXT;
+        } else if (strcmp(args[0], ".data") == 0) {
+            a->section = ASM_DATA;
+        } else if (strcmp(args[0], ".bss") == 0) {
+            a->section = ASM_BSS;
+        } else {
+            asm_error(a, "unknown section", args[0]);
+        }
+    } else if (strcmp(word, "global") == 0 || strcmp(word, "extern") == 0) {
+        for (size_t i = 0; i < argc; i++) {
+            size_t idx = asm_sym(a, args[i]);
+            a->syms[idx].global = 1;
+        }
+    } else if (strncmp(word, "res", 3) == 0 && strlen(word) == 4 && strchr("bwdq", word[3]) != NULL) {
+        long count;
+        if (argc != 1 || !asm_parse_num(args[0], &count)) asm_error(a, "invalid reserve count", line);
+        int size = word[3] == 'b' ? 1 : word[3] == 'w' ? 2 : word[3] == 'd' ? 4 : 8;
+        if (a->section == ASM_BSS) {
+            a->bss_size += count * size;
+        } else {
+            asm_imm(a, 0, count * size);
+        }
+    } else if (word[0] == 'd' && strlen(word) == 2 && strchr("bwdq", word[1]) != NULL) {
+        int size = word[1] == 'b' ? 1 : word[1] == 'w' ? 2 : word[1] == 'd' ? 4 : 8;
+        for (size_t i = 0; i < argc; i++) {
+            long v;
+            if (asm_parse_num(args[i], &v)) {
+                asm_imm(a, v, size);
+            } else if (args[i][0] == '"' || args[i][0] == '\'') {
+                for (char *c = args[i] + 1; *c != '\0' && *c != args[i][0]; c++) {
+                    asm_imm(a, (unsigned char)*c, size);
+                }
+            } else {
+                asm_error(a, "invalid data", args[i]);
+            }
+        }
+    } else {
+        if (a->section != ASM_TEXT) asm_error(a, "instruction outside of .text", word);
+        asm_instruction(a, word, args, argc);
+    }
+}
+
+// patches what can be solved inside the object, the rest becomes relocations
+Elf64_Rela *asm_resolve(asm_t *a) {
+    Elf64_Rela *relas = NULL;
+    for (size_t i = 0; i < arrlenu(a->fixups); i++) {
+        asm_fixup_t fix = a->fixups[i];
+        asm_sym_t *sym = &a->syms[fix.sym];
+        unsigned char *at = a->text + fix.offset;
+        if (sym->section == ASM_UNDEF && !sym->global) {
+            a->line = fix.line;
+            asm_error(a, "symbol not defined", sym->name);
+        }
+        long v;
+        int size = fix.kind == FIX_ABS64 ? 8 : 4;
+        if ((fix.kind == FIX_REL32 || fix.kind == FIX_PLT32) && sym->section == ASM_TEXT) {
+            v = sym->value + fix.addend - fix.offset;
+        } else if ((fix.kind == FIX_ABS32S || fix.kind == FIX_ABS64) && sym->section == ASM_ABS) {
+            v = sym->value + fix.addend;
+        } else {
+            int type = fix.kind == FIX_REL32 ? (sym->section == ASM_UNDEF ? R_X86_64_PLT32 : R_X86_64_PC32)
+                     : fix.kind == FIX_PLT32 ? R_X86_64_PLT32
+                     : fix.kind == FIX_ABS64 ? R_X86_64_64 : R_X86_64_32S;
+            Elf64_Rela rela = {fix.offset, ELF64_R_INFO(fix.sym, type), fix.addend};
+            arrput(relas, rela);
+            continue;
+        }
+        for (int b = 0; b < size; b++) {
+            at[b] = (v >> (b * 8)) & 0xff;
+        }
+    }
+    return relas;
+}
+
+enum {
+    SEC_NULL,
+    SEC_TEXT,
+    SEC_DATA,
+    SEC_BSS,
+    SEC_RELA_TEXT,
+    SEC_SYMTAB,
+    SEC_STRTAB,
+    SEC_SHSTRTAB,
+    SEC_NOTE,
+    SEC_COUNT
+};
+
+void asm_write_elf(asm_t *a, char *path) {
+    Elf64_Rela *relas = asm_resolve(a);
+
+    // locals go before globals in the symbol table
+    Elf64_Sym *syms = NULL;
+    char *strtab = NULL;
+    arrput(strtab, '\0');
+    Elf64_Sym null_sym = {0};
+    arrput(syms, null_sym);
+    size_t first_global = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) first_global = arrlenu(syms);
+        for (size_t i = 0; i < arrlenu(a->syms); i++) {
+            asm_sym_t *s = &a->syms[i];
+            int global = s->global || s->section == ASM_UNDEF;
+            if (global != pass) continue;
+            if (s->section == ASM_UNDEF && !s->used) continue;
+            Elf64_Sym sym = {0};
+            sym.st_name = arrlenu(strtab);
+            for (char *c = s->name; *c != '\0'; c++) arrput(strtab, *c);
+            arrput(strtab, '\0');
+            sym.st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, STT_NOTYPE);
+            sym.st_shndx = s->section == ASM_TEXT ? SEC_TEXT : s->section == ASM_DATA ? SEC_DATA
+                         : s->section == ASM_BSS ? SEC_BSS : s->section == ASM_ABS ? SHN_ABS : SHN_UNDEF;
+            sym.st_value = s->section == ASM_UNDEF ? 0 : s->value;
+            s->elf_idx = arrlenu(syms);
+            arrput(syms, sym);
+        }
+    }
+    for (size_t i = 0; i < arrlenu(relas); i++) {
+        size_t sym = ELF64_R_SYM(relas[i].r_info);
+        relas[i].r_info = ELF64_R_INFO(a->syms[sym].elf_idx, ELF64_R_TYPE(relas[i].r_info));
+    }
+
+    char shstrtab[] = "\0.text\0.data\0.bss\0.rela.text\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack";
+    size_t names[SEC_COUNT] = {0, 1, 7, 13, 18, 29, 37, 45, 55};
+    Elf64_Shdr sh[SEC_COUNT] = {0};
+    struct { void *data; size_t size; } body[SEC_COUNT] = {
+        [SEC_TEXT] = {a->text, arrlenu(a->text)},
+        [SEC_DATA] = {a->data, arrlenu(a->data)},
+        [SEC_RELA_TEXT] = {relas, arrlenu(relas) * sizeof(*relas)},
+        [SEC_SYMTAB] = {syms, arrlenu(syms) * sizeof(*syms)},
+        [SEC_STRTAB] = {strtab, arrlenu(strtab)},
+        [SEC_SHSTRTAB] = {shstrtab, sizeof(shstrtab)},
+    };
+    sh[SEC_TEXT] = (Elf64_Shdr){.sh_type = SHT_PROGBITS, .sh_flags = SHF_ALLOC | SHF_EXECINSTR, .sh_addralign = 16};
+    sh[SEC_DATA] = (Elf64_Shdr){.sh_type = SHT_PROGBITS, .sh_flags = SHF_ALLOC | SHF_WRITE, .sh_addralign = 4};
+    sh[SEC_BSS] = (Elf64_Shdr){.sh_type = SHT_NOBITS, .sh_flags = SHF_ALLOC | SHF_WRITE, .sh_addralign = 4, .sh_size = a->bss_size};
+    sh[SEC_RELA_TEXT] = (Elf64_Shdr){.sh_type = SHT_RELA, .sh_flags = SHF_INFO_LINK, .sh_link = SEC_SYMTAB, .sh_info = SEC_TEXT,
+                                     .sh_addralign = 8, .sh_entsize = sizeof(Elf64_Rela)};
+    sh[SEC_SYMTAB] = (Elf64_Shdr){.sh_type = SHT_SYMTAB, .sh_link = SEC_STRTAB, .sh_info = first_global,
+                                  .sh_addralign = 8, .sh_entsize = sizeof(Elf64_Sym)};
+    sh[SEC_STRTAB] = (Elf64_Shdr){.sh_type = SHT_STRTAB, .sh_addralign = 1};
+    sh[SEC_SHSTRTAB] = (Elf64_Shdr){.sh_type = SHT_STRTAB, .sh_addralign = 1};
+    sh[SEC_NOTE] = (Elf64_Shdr){.sh_type = SHT_PROGBITS, .sh_addralign = 1};
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "[ERROR] Failed to create %s\n", path);
+        exit(1);
+    }
+    size_t offset = sizeof(Elf64_Ehdr);
+    fseek(f, offset, SEEK_SET);
+    for (int i = 1; i < SEC_COUNT; i++) {
+        sh[i].sh_name = names[i];
+        size_t align = sh[i].sh_addralign;
+        while (offset % align != 0) {
+            fputc(0, f);
+            offset++;
+        }
+        sh[i].sh_offset = offset;
+        if (sh[i].sh_type != SHT_NOBITS) {
+            sh[i].sh_size = body[i].size;
+            if (body[i].size) fwrite(body[i].data, 1, body[i].size, f);
+            offset += body[i].size;
+        }
+    }
+    while (offset % 8 != 0) {
+        fputc(0, f);
+        offset++;
+    }
+    Elf64_Ehdr eh = {0};
+    memcpy(eh.e_ident, ELFMAG, SELFMAG);
+    eh.e_ident[EI_CLASS] = ELFCLASS64;
+    eh.e_ident[EI_DATA] = ELFDATA2LSB;
+    eh.e_ident[EI_VERSION] = EV_CURRENT;
+    eh.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    eh.e_type = ET_REL;
+    eh.e_machine = EM_X86_64;
+    eh.e_version = EV_CURRENT;
+    eh.e_shoff = offset;
+    eh.e_ehsize = sizeof(Elf64_Ehdr);
+    eh.e_shentsize = sizeof(Elf64_Shdr);
+    eh.e_shnum = SEC_COUNT;
+    eh.e_shstrndx = SEC_SHSTRTAB;
+    fwrite(sh, sizeof(Elf64_Shdr), SEC_COUNT, f);
+    fseek(f, 0, SEEK_SET);
+    fwrite(&eh, sizeof(eh), 1, f);
+    fclose(f);
+
+    arrfree(relas);
+    arrfree(syms);
+    arrfree(strtab);
+}
+
+// assembles the nasm text in 'src' into the object 'path'
+void asm_assemble(char *src, size_t len, char *file, char *path) {
+    if (asm_ins_map == NULL) {
+        asm_init();
+    }
+    asm_t a = {0};
+    a.file = file;
+    a.section = ASM_TEXT;
+    sh_new_arena(a.sym_idx);
+    char *line = src;
+    char *end = src + len;
+    while (line < end) {
+        char *nl = memchr(line, '\n', end - line);
+        if (nl == NULL) nl = end;
+        *nl = '\0';
+        a.line++;
+        asm_line(&a, line);
+        line = nl + 1;
+    }
+    asm_write_elf(&a, path);
+    arrfree(a.text);
+    arrfree(a.data);
+    arrfree(a.syms);
+    arrfree(a.fixups);
+    arrfree(a.args);
+    shfree(a.sym_idx);
+}
+
+// runs the built-in assembler on 'src', like assemble() does with nasm it
+// goes to a child process when -j allows more than one job at once, so the
+// next file is generated meanwhile
+void asm_assemble_job(size_t file_num, char *src, size_t len, char *file, char *path) {
+    if (program.jobs <= 1) {
+        asm_assemble(src, len, file, path);
+        return;
+    }
+    while (program.running >= program.jobs) {
+        assemble_wait();
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1) {
+        asm_assemble(src, len, file, path);
+        return;
+    }
+    if (pid == 0) {
+        asm_assemble(src, len, file, path);
+        _exit(0);
+    }
+    program.running++;
+    arrput(program.children, ((child_t){pid, file_num, now()}));
+}
+
+// growable buffer codegen writes the module's assembly into, it's handed to
+// the assembler (or written out) once the module is done
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} out_t;
+
+void out_write(out_t *out, const char *str, size_t len) {
+    if (out->len + len > out->cap) {
+        while (out->len + len > out->cap) {
+            out->cap = out->cap == 0 ? 65536 : out->cap * 2;
+        }
+        out->data = realloc(out->data, out->cap);
+    }
+    memcpy(out->data + out->len, str, len);
+    out->len += len;
+}
+
+void out_uint(out_t *out, unsigned long v, int base) {
+    char digits[24];
+    size_t i = sizeof(digits);
+    do {
+        digits[--i] = "0123456789abcdef"[v % base];
+        v /= base;
+    } while (v != 0);
+    out_write(out, digits + i, sizeof(digits) - i);
+}
+
+// printf for the few conversions codegen uses: %lu %ld %u %d %x %s
+void out_vprintf(out_t *out, const char *fmt, va_list args) {
+    while (*fmt != '\0') {
+        const char *lit = fmt;
+        while (*fmt != '\0' && *fmt != '%') fmt++;
+        out_write(out, lit, fmt - lit);
+        if (*fmt == '\0') break;
+        fmt++;
+        int wide = *fmt == 'l';
+        if (wide) fmt++;
+        switch (*fmt) {
+        case 'u':
+            out_uint(out, wide ? va_arg(args, unsigned long) : va_arg(args, unsigned), 10);
+            break;
+        case 'd': {
+            long v = wide ? va_arg(args, long) : va_arg(args, int);
+            if (v < 0) out_write(out, "-", 1);
+            out_uint(out, v < 0 ? -(unsigned long)v : (unsigned long)v, 10);
+        } break;
+        case 'x':
+            out_uint(out, wide ? va_arg(args, unsigned long) : va_arg(args, unsigned), 16);
+            break;
+        case 's': {
+            char *str = va_arg(args, char *);
+            out_write(out, str, strlen(str));
+        } break;
+        case '%':
+            out_write(out, "%", 1);
+            break;
+        default:
+            assert(0 && "unsupported conversion in out_printf");
+        }
+        fmt++;
+    }
+}
+
+void out_printf(out_t *out, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    out_vprintf(out, fmt, args);
+    va_end(args);
+}
+
+// the comments that say which operation a group of instructions comes from
+// are only worth writing when somebody is going to read them
+void out_comment(out_t *out, const char *fmt, ...) {
+    if (program.emit_asm) {
+        va_list args;
+        va_start(args, fmt);
+        out_vprintf(out, fmt, args);
+        va_end(args);
+    }
+}
+
+// parse_current_token, timed for --time-report
+int parse_next_token() {
+    if (!program.time_report) return parse_current_token();
+    double start = now();
+    int more = parse_current_token();
+    report_phase(PHASE_PARSE, start);
+    return more;
+}
+
+// codegen lowers every proc to this IR before it becomes x86: a list of
+// stack machine instructions in which the flags parse_current_token leaves
+// behind (setting, address, index, size_of...) are already resolved, so the
+// passes only have to look at what each instruction does
+enum {
+    IR_PUSH,       // push 'arg'
+    IR_PUSH_STR,   // push the address of $STR<arg>
+    IR_ADR,        // push the address of the var at 'arg'
+    IR_GET,        // push the value of the var at 'arg'
+    IR_SET,        // pop into the var at 'arg'
+    IR_FILL,       // pop 'cap' values into the array at 'arg', the last one first
+    IR_LOAD,       // address -- value
+    IR_STORE,      // address value --
+    IR_INDEX_GET,  // base index -- value
+    IR_INDEX_ADR,  // base index -- address
+    IR_INDEX_SET,  // value base index --
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_MOD,
+    IR_SHR,
+    IR_SHL,
+    IR_AND,
+    IR_OR,
+    IR_XOR,
+    IR_BNOT,
+    IR_EQ,
+    IR_NE,
+    IR_GT,
+    IR_LT,
+    IR_GE,
+    IR_LE,
+    IR_DUP,
+    IR_SWAP,
+    IR_ROT,
+    IR_OVER,
+    IR_DROP,
+    IR_PRINT,
+    IR_SYSCALL,    // 'arg' arguments under the syscall number
+    IR_MALLOC,
+    IR_FREE,
+    IR_CALL,       // call $PROC<arg>
+    IR_CALL_MAIN,
+    IR_LABEL,      // $ADR<arg>
+    IR_JMP,
+    IR_JZ,         // pops the condition
+    IR_JNZ,        // pops the condition, closes a rotated loop
+    IR_ENTER,
+    IR_LEAVE,      // drop the 'arg' bytes of locals and return
+    IR_COUNT
+};
+
+// what an instruction takes from and leaves on the data stack, -1 is for the
+// ones where it depends on the instruction (see ir_pops)
+struct { char *name; int pops; int pushes; } ir_info[IR_COUNT] = {
+    [IR_PUSH]      = {"push",      0,  1},
+    [IR_PUSH_STR]  = {"push str",  0,  1},
+    [IR_ADR]       = {"var adr",   0,  1},
+    [IR_GET]       = {"get var",   0,  1},
+    [IR_SET]       = {"set var",   1,  0},
+    [IR_FILL]      = {"fill",     -1,  0},
+    [IR_LOAD]      = {"fetch",     1,  1},
+    [IR_STORE]     = {"store",     2,  0},
+    [IR_INDEX_GET] = {"get index", 2,  1},
+    [IR_INDEX_ADR] = {"index adr", 2,  1},
+    [IR_INDEX_SET] = {"set index", 3,  0},
+    [IR_ADD]       = {"add",       2,  1},
+    [IR_SUB]       = {"sub",       2,  1},
+    [IR_MUL]       = {"mul",       2,  1},
+    [IR_DIV]       = {"div",       2,  1},
+    [IR_MOD]       = {"mod",       2,  1},
+    [IR_SHR]       = {"shr",       2,  1},
+    [IR_SHL]       = {"shl",       2,  1},
+    [IR_AND]       = {"and",       2,  1},
+    [IR_OR]        = {"or",        2,  1},
+    [IR_XOR]       = {"xor",       2,  1},
+    [IR_BNOT]      = {"not",       1,  1},
+    [IR_EQ]        = {"equals",    2,  1},
+    [IR_NE]        = {"not equals",2,  1},
+    [IR_GT]        = {"greater",   2,  1},
+    [IR_LT]        = {"minor",     2,  1},
+    // '>=' has always compared two pairs, (a b c d -- a>=b|c>=d), and is
+    // kept that way so existing programs compute the same
+    [IR_GE]        = {"eqgreater", 4,  1},
+    [IR_LE]        = {"eqminor",   2,  1},
+    [IR_DUP]       = {"dup",       1,  2},
+    [IR_SWAP]      = {"swap",      2,  2},
+    [IR_ROT]       = {"rot",       3,  3},
+    [IR_OVER]      = {"over",      3,  4},
+    [IR_DROP]      = {"drop",      1,  0},
+    [IR_PRINT]     = {"print",     1,  0},
+    [IR_SYSCALL]   = {"syscall",  -1,  1},
+    [IR_MALLOC]    = {"memory",    1,  1},
+    [IR_FREE]      = {"delete",    1,  0},
+    [IR_CALL]      = {"call",     -1, -1},
+    [IR_CALL_MAIN] = {"call main",-1, -1},
+    [IR_LABEL]     = {"label",     0,  0},
+    [IR_JMP]       = {"jmp",       0,  0},
+    [IR_JZ]        = {"do",        1,  0},
+    [IR_JNZ]       = {"loop",      1,  0},
+    [IR_ENTER]     = {"enter",     0,  0},
+    [IR_LEAVE]     = {"leave",     0,  0},
+};
+
+typedef struct {
+    int op;
+    int size;          // bytes a memory access moves
+    int local;         // the var lives in the proc's frame on $RET
+    unsigned long arg; // immediate, label, count or var/str/proc address
+    size_t cap;        // IR_FILL: how many values it pops
+    size_t label;      // IR_FILL: the label of its loop
+    int carry;         // IR_LABEL: the value on top arrives in a register, see vs_carry
+    int reg;           // IR_GET/IR_SET: 1 + the register the local is kept in, see ir_alloc_locals
+} ir_t;
+
+#define IR_NO_DEPTH INT_MIN
+
+typedef struct {
+    size_t start;
+    size_t end;
+    size_t succ[2];
+    int succs;
+    int depth;         // data stack depth at the start, relative to the proc's entry
+} ir_block_t;
+
+// the registers locals can live in. a proc that uses them loads the locals
+// from the frame on entry, saves the caller's registers after its locals
+// and restores them before it returns. procs without locals never touch
+// them, so they survive every call
+#define IR_LOCAL_REGS 2
+
+char *ir_local_reg[IR_LOCAL_REGS] = {"r13", "r14"};
+
+// the proc codegen is working on
+typedef struct {
+    size_t adr;
+    char *name;
+    int main;
+    int leaf;          // keeps its return address in r15, see ir_is_leaf
+    int reg_locals;    // how many of its locals live in registers
+    ir_t reg_local[IR_LOCAL_REGS]; // a get of each of them
+    ir_t *code;
+    ir_block_t *blocks;
+    struct { size_t key; size_t value; } *labels; // label -> block
+} ir_proc_t;
+
+typedef struct {
+    char *name;
+    int level;                 // the lowest -O that runs it
+    int (*run)(ir_proc_t *p);  // returns if it changed the code
+} ir_pass_t;
+
+ir_t *ir_add(ir_proc_t *p, int op, unsigned long arg) {
+    ir_t ins = {.op = op, .arg = arg};
+    arrput(p->code, ins);
+    return &arrlast(p->code);
+}
+
+ir_t *ir_add_var(ir_proc_t *p, int op, var_t *var) {
+    ir_t *ins = ir_add(p, op, var->adr);
+    ins->size = var->type->size_bytes;
+    ins->local = var->local;
+    return ins;
+}
+
+// -1 when the stack effect of the callee isn't known, procs from other
+// modules count as unknown so a module's code never depends on its imports
+int ir_pops(ir_t *ins) {
+    switch (ins->op) {
+    case IR_FILL:
+        return ins->cap;
+    case IR_SYSCALL:
+        return ins->arg + 1;
+    case IR_CALL: {
+        proc_t *callee = &program.procs[ins->arg].value;
+        return callee->file_num == program.file_num ? callee->in : -1;
+    }
+    default:
+        return ir_info[ins->op].pops;
+    }
+}
+
+int ir_pushes(ir_t *ins) {
+    if (ins->op == IR_CALL) {
+        return program.procs[ins->arg].value.out;
+    }
+    return ir_info[ins->op].pushes;
+}
+
+int ir_ends_block(int op) {
+    return op == IR_JMP || op == IR_JZ || op == IR_JNZ || op == IR_LEAVE;
+}
+
+// splits the proc into basic blocks, one starts at every label and after
+// every jump so control only ever enters a block through its first instruction
+void ir_build_blocks(ir_proc_t *p) {
+    arrsetlen(p->blocks, 0);
+    hmfree(p->labels);
+    for (size_t i = 0; i < arrlenu(p->code); i++) {
+        if (i == 0 || p->code[i].op == IR_LABEL || ir_ends_block(p->code[i - 1].op)) {
+            ir_block_t block = {.start = i, .depth = IR_NO_DEPTH};
+            arrput(p->blocks, block);
+        }
+        if (p->code[i].op == IR_LABEL) {
+            hmput(p->labels, p->code[i].arg, arrlenu(p->blocks) - 1);
+        }
+        arrlast(p->blocks).end = i + 1;
+    }
+    for (size_t b = 0; b < arrlenu(p->blocks); b++) {
+        ir_block_t *block = &p->blocks[b];
+        ir_t *last = &p->code[block->end - 1];
+        if (last->op == IR_JMP || last->op == IR_JZ || last->op == IR_JNZ) {
+            block->succ[block->succs++] = hmget(p->labels, last->arg);
+        }
+        if (last->op != IR_JMP && last->op != IR_LEAVE && b + 1 < arrlenu(p->blocks)) {
+            block->succ[block->succs++] = b + 1;
+        }
+    }
+}
+
+// the IR_LABEL that defines 'label'
+ir_t *ir_label(ir_proc_t *p, unsigned long label) {
+    return &p->code[p->blocks[hmget(p->labels, label)].start];
+}
+
+// walks the blocks to find the depth of the data stack at the start of each
+// one and from there the stack effect of the whole proc, it gives up (the
+// effect stays -1) at calls with an unknown effect and at blocks reached with
+// two different depths
+void ir_stack_effect(ir_proc_t *p) {
+    proc_t *proc = &program.procs[p->adr].value;
+    proc->in = -1;
+    proc->out = -1;
+    if (arrlenu(p->blocks) == 0) return;
+    size_t *work = NULL;
+    int low = 0;
+    int leave = IR_NO_DEPTH;
+    int known = 1;
+    p->blocks[0].depth = 0;
+    arrput(work, 0);
+    while (known && arrlenu(work) > 0) {
+        ir_block_t *block = &p->blocks[arrpop(work)];
+        int depth = block->depth;
+        for (size_t i = block->start; known && i < block->end; i++) {
+            int pops = ir_pops(&p->code[i]);
+            int pushes = ir_pushes(&p->code[i]);
+            if (pops < 0 || pushes < 0) {
+                known = 0;
+                break;
+            }
+            depth -= pops;
+            if (depth < low) low = depth;
+            depth += pushes;
+            if (p->code[i].op == IR_LEAVE) {
+                if (leave != IR_NO_DEPTH && leave != depth) known = 0;
+                leave = depth;
+            }
+        }
+        for (int s = 0; known && s < block->succs; s++) {
+            ir_block_t *succ = &p->blocks[block->succ[s]];
+            if (succ->depth == IR_NO_DEPTH) {
+                succ->depth = depth;
+                arrput(work, block->succ[s]);
+            } else if (succ->depth != depth) {
+                known = 0;
+            }
+        }
+    }
+    arrfree(work);
+    if (known && leave != IR_NO_DEPTH) {
+        proc->in = -low;
+        proc->out = leave - low;
+    }
+}
+
+// drops the blocks that no path from the proc's entry reaches
+int ir_remove_unreachable(ir_proc_t *p) {
+    size_t count = arrlenu(p->blocks);
+    if (count == 0) return 0;
+    char *reached = calloc(count, 1);
+    size_t *work = NULL;
+    reached[0] = 1;
+    arrput(work, 0);
+    while (arrlenu(work) > 0) {
+        ir_block_t *block = &p->blocks[arrpop(work)];
+        for (int s = 0; s < block->succs; s++) {
+            if (!reached[block->succ[s]]) {
+                reached[block->succ[s]] = 1;
+                arrput(work, block->succ[s]);
+            }
+        }
+    }
+    arrfree(work);
+    size_t len = 0;
+    for (size_t b = 0; b < count; b++) {
+        if (!reached[b]) continue;
+        for (size_t i = p->blocks[b].start; i < p->blocks[b].end; i++) {
+            p->code[len++] = p->code[i];
+        }
+    }
+    free(reached);
+    // a jump to the label right after it, usually left by a folded branch
+    size_t kept = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (p->code[i].op == IR_JMP && i + 1 < len && p->code[i + 1].op == IR_LABEL && p->code[i + 1].arg == p->code[i].arg) continue;
+        p->code[kept++] = p->code[i];
+    }
+    len = kept;
+    int changed = len != arrlenu(p->code);
+    arrsetlen(p->code, len);
+    return changed;
+}
+
+// turns 'label L; cond; jz X; body; jmp L; label X' into 'cond; jz X;
+// label L; body; cond; jnz L; label X', so an iteration takes one branch
+// instead of two. only short conditions are copied, and none that emit
+// labels of their own. when the condition starts with a dup, like in
+// '0 loop dup N < do ... 1 + end drop', the value it tests is the loop's
+// counter and L and X carry it in a register
+#define IR_ROTATE_MAX 16
+
+int ir_rotate_loops(ir_proc_t *p) {
+    int changed = 0;
+    for (size_t j = 0; j < arrlenu(p->code); j++) {
+        ir_t *jmp = &p->code[j];
+        if (jmp->op != IR_JMP || j + 1 >= arrlenu(p->code)) continue;
+        ir_t *exit = &p->code[j + 1];
+        size_t l = j;
+        while (l-- > 0 && !(p->code[l].op == IR_LABEL && p->code[l].arg == jmp->arg));
+        if (l == (size_t)-1) continue;
+        size_t k = l + 1;
+        while (k < j && k - l <= IR_ROTATE_MAX && !ir_ends_block(p->code[k].op) &&
+               p->code[k].op != IR_LABEL && p->code[k].op != IR_FILL) {
+            k++;
+        }
+        if (k >= j || p->code[k].op != IR_JZ || exit->op != IR_LABEL || p->code[k].arg != exit->arg) continue;
+        ir_t label = p->code[l];
+        size_t cond = k - l - 1;
+        if (p->code[l + 1].op == IR_DUP) {
+            label.carry = 1;
+            exit->carry = 1;
+        }
+        ir_t *code = NULL;
+        arrsetcap(code, arrlenu(p->code) + cond + 1);
+        for (size_t i = 0; i < l; i++) arrput(code, p->code[i]);
+        for (size_t i = l + 1; i <= k; i++) arrput(code, p->code[i]);
+        arrput(code, label);
+        for (size_t i = k + 1; i < j; i++) arrput(code, p->code[i]);
+        for (size_t i = l + 1; i < k; i++) arrput(code, p->code[i]);
+        arrput(code, ((ir_t){.op = IR_JNZ, .arg = label.arg}));
+        size_t next = arrlenu(code);
+        for (size_t i = j + 1; i < arrlenu(p->code); i++) arrput(code, p->code[i]);
+        arrfree(p->code);
+        p->code = code;
+        j = next - 1;
+        changed = 1;
+    }
+    return changed;
+}
+
+// what the fold pass knows about a value on the data stack, 'def' is the
+// IR_PUSH that put it there when it's still alone in doing so
+typedef struct {
+    int known;
+    unsigned long val;
+    ptrdiff_t def;
+} ir_value_t;
+
+ir_value_t ir_fold_pop(ir_value_t **stack) {
+    if (arrlenu(*stack) == 0) return (ir_value_t){.def = -1};
+    return arrpop(*stack);
+}
+
+// 'op' on constants, returns 0 for the ones that can't be done at compile time
+int ir_fold_op(int op, unsigned long a, unsigned long b, unsigned long *res) {
+    switch (op) {
+    case IR_ADD: *res = a + b; break;
+    case IR_SUB: *res = a - b; break;
+    case IR_MUL: *res = a * b; break;
+    case IR_DIV: if (b == 0) return 0; *res = a / b; break;
+    case IR_MOD: if (b == 0) return 0; *res = a % b; break;
+    case IR_SHR: *res = (long)a >> (b & 63); break;
+    case IR_SHL: *res = a << (b & 63); break;
+    case IR_AND: *res = a & b; break;
+    case IR_OR:  *res = a | b; break;
+    case IR_XOR: *res = a ^ b; break;
+    case IR_EQ:  *res = a == b; break;
+    case IR_NE:  *res = a != b; break;
+    case IR_GT:  *res = (long)a > (long)b; break;
+    case IR_LT:  *res = (long)a < (long)b; break;
+    case IR_LE:  *res = (long)a <= (long)b; break;
+    default: return 0;
+    }
+    return 1;
+}
+
+// if 'b' on the right of 'op' gives back the left value
+int ir_fold_identity(int op, unsigned long b) {
+    switch (op) {
+    case IR_ADD: case IR_SUB: case IR_OR: case IR_XOR: case IR_SHR: case IR_SHL:
+        return b == 0;
+    case IR_MUL: case IR_DIV:
+        return b == 1;
+    default:
+        return 0;
+    }
+}
+
+// evaluates what it can of every block at compile time: arithmetic on
+// constants becomes one push, shuffles of constants are done by changing
+// the pushes, and a 'do' on a constant becomes a jmp or goes away
+int ir_fold_constants(ir_proc_t *p) {
+    size_t len = arrlenu(p->code);
+    char *dead = calloc(len, 1);
+    ir_value_t *stack = NULL;
+    int changed = 0;
+    for (size_t b = 0; b < arrlenu(p->blocks); b++) {
+        arrsetlen(stack, 0);
+        for (size_t i = p->blocks[b].start; i < p->blocks[b].end; i++) {
+            ir_t *ins = &p->code[i];
+            size_t n = arrlenu(stack);
+            ir_value_t *top = n > 0 ? &stack[n - 1] : NULL;
+            ir_value_t *next = n > 1 ? &stack[n - 2] : NULL;
+            switch (ins->op) {
+            case IR_PUSH:
+                arrput(stack, ((ir_value_t){1, ins->arg, i}));
+                continue;
+            case IR_DUP:
+                if (top != NULL && top->known) {
+                    ins->op = IR_PUSH;
+                    ins->arg = top->val;
+                    arrput(stack, ((ir_value_t){1, ins->arg, i}));
+                    changed = 1;
+                    continue;
+                }
+                break;
+            case IR_OVER:
+                if (n > 2 && stack[n - 3].known) {
+                    ins->op = IR_PUSH;
+                    ins->arg = stack[n - 3].val;
+                    arrput(stack, ((ir_value_t){1, ins->arg, i}));
+                    changed = 1;
+                    continue;
+                }
+                break;
+            case IR_SWAP:
+                if (next != NULL && top->def >= 0 && next->def >= 0) {
+                    unsigned long val = top->val;
+                    top->val = p->code[top->def].arg = next->val;
+                    next->val = p->code[next->def].arg = val;
+                    dead[i] = 1;
+                    changed = 1;
+                    continue;
+                }
+                break;
+            case IR_ROT:
+                if (n > 2 && top->def >= 0 && stack[n - 3].def >= 0) {
+                    ir_value_t *bottom = &stack[n - 3];
+                    unsigned long val = top->val;
+                    top->val = p->code[top->def].arg = bottom->val;
+                    bottom->val = p->code[bottom->def].arg = val;
+                    dead[i] = 1;
+                    changed = 1;
+                    continue;
+                }
+                break;
+            case IR_DROP:
+                if (top != NULL && top->def >= 0) {
+                    dead[top->def] = 1;
+                    dead[i] = 1;
+                    arrsetlen(stack, n - 1);
+                    changed = 1;
+                    continue;
+                }
+                break;
+            case IR_BNOT:
+                if (top != NULL && top->def >= 0) {
+                    dead[top->def] = 1;
+                    ins->op = IR_PUSH;
+                    ins->arg = ~top->val;
+                    *top = (ir_value_t){1, ins->arg, i};
+                    changed = 1;
+                    continue;
+                }
+                break;
+            case IR_JZ:
+            case IR_JNZ:
+                if (top != NULL && top->def >= 0) {
+                    dead[top->def] = 1;
+                    if ((top->val == 0) == (ins->op == IR_JZ)) {
+                        ins->op = IR_JMP;
+                    } else {
+                        dead[i] = 1;
+                    }
+                    arrsetlen(stack, n - 1);
+                    changed = 1;
+                    continue;
+                }
+                break;
+            default: {
+                unsigned long res;
+                if (next == NULL || top->def < 0 || ir_info[ins->op].pops != 2) break;
+                if (next->def >= 0 && ir_fold_op(ins->op, next->val, top->val, &res)) {
+                    dead[next->def] = 1;
+                    dead[top->def] = 1;
+                    ins->op = IR_PUSH;
+                    ins->arg = res;
+                    arrsetlen(stack, n - 2);
+                    arrput(stack, ((ir_value_t){1, res, i}));
+                    changed = 1;
+                    continue;
+                }
+                if (ir_fold_identity(ins->op, top->val)) {
+                    dead[top->def] = 1;
+                    dead[i] = 1;
+                    arrsetlen(stack, n - 1);
+                    changed = 1;
+                    continue;
+                }
+            } break;
+            }
+            int pops = ir_pops(ins);
+            int pushes = ir_pushes(ins);
+            if (pops < 0 || pushes < 0) {
+                arrsetlen(stack, 0);
+                continue;
+            }
+            // anything else reads its values at runtime, so their pushes stay
+            for (int k = 0; k < pops; k++) {
+                ir_fold_pop(&stack);
+            }
+            for (int k = 0; k < pushes; k++) {
+                arrput(stack, ((ir_value_t){.def = -1}));
+            }
+        }
+    }
+    arrfree(stack);
+    size_t out = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!dead[i]) p->code[out++] = p->code[i];
+    }
+    arrsetlen(p->code, out);
+    free(dead);
+    return changed;
+}
+
+// keeps the most used locals of a proc in registers instead of its frame,
+// out of the ones that are never addressed, fit a register and are used more
+// than twice. every loop around a use makes it count 4 times as much
+int ir_alloc_locals(ir_proc_t *p) {
+    size_t len = arrlenu(p->code);
+    int *loops = calloc(len + 1, sizeof(int));
+    for (size_t i = 0; i < len; i++) {
+        ir_t *ins = &p->code[i];
+        if (ins->op != IR_JMP && ins->op != IR_JNZ) continue;
+        size_t start = p->blocks[hmget(p->labels, ins->arg)].start;
+        if (start < i) {
+            loops[start]++;
+            loops[i + 1]--;
+        }
+    }
+    // the weight of every local, -1 for the ones that have to stay in memory
+    struct { unsigned long key; long value; } *uses = NULL;
+    int depth = 0;
+    for (size_t i = 0; i < len; i++) {
+        ir_t *ins = &p->code[i];
+        depth += loops[i];
+        if (!ins->local) continue;
+        long weight = hmget(uses, ins->arg);
+        if (weight < 0) continue;
+        if (ins->op == IR_ADR || ins->op == IR_FILL || (ins->size != 1 && ins->size != 2 && ins->size != 4 && ins->size != 8)) {
+            weight = -1;
+        } else {
+            weight += 1L << (2 * (depth < 8 ? depth : 8));
+        }
+        hmput(uses, ins->arg, weight);
+    }
+    free(loops);
+    unsigned long chosen[IR_LOCAL_REGS];
+    int count = 0;
+    while (count < IR_LOCAL_REGS) {
+        long best = 2;
+        for (size_t u = 0; u < hmlenu(uses); u++) {
+            if (uses[u].value > best) {
+                best = uses[u].value;
+                chosen[count] = uses[u].key;
+            }
+        }
+        if (best == 2) break;
+        hmput(uses, chosen[count], -1);
+        count++;
+    }
+    hmfree(uses);
+    for (size_t i = 0; i < len; i++) {
+        ir_t *ins = &p->code[i];
+        for (int r = 0; r < count; r++) {
+            if (ins->local && ins->arg == chosen[r]) {
+                ins->reg = r + 1;
+                p->reg_local[r] = *ins;
+            }
+        }
+    }
+    p->reg_locals = count;
+    return 0;
+}
+
+// run in this order on every proc, -O0 runs none of them and -O2 adds
+// keeping locals in registers to what -O1 does
+ir_pass_t ir_passes[] = {
+    {"rotate", 1, ir_rotate_loops},
+    {"fold", 1, ir_fold_constants},
+    {"unreachable", 1, ir_remove_unreachable},
+    {"locals", 2, ir_alloc_locals},
+};
+
+// the highest level any pass runs at, asking for more builds the same code
+int ir_max_level() {
+    int level = 0;
+    for (size_t i = 0; i < sizeof(ir_passes) / sizeof(*ir_passes); i++) {
+        if (ir_passes[i].level > level) level = ir_passes[i].level;
+    }
+    return level;
+}
+
+void ir_optimize(ir_proc_t *p) {
+    double start = now();
+    ir_build_blocks(p);
+    for (size_t i = 0; i < sizeof(ir_passes) / sizeof(*ir_passes); i++) {
+        if (program.opt < ir_passes[i].level) continue;
+        if (ir_passes[i].run(p)) {
+            ir_build_blocks(p);
+        }
+    }
+    ir_stack_effect(p);
+    report_phase(PHASE_OPT, start);
+}
+
+
+enum { REG_A, REG_B };
+
+char *size_word[4] = {"byte", "word", "dword", "qword"};
+char *size_reg[2][4] = {
+    {"al", "ax", "eax", "rax"},
+    {"bl", "bx", "ebx", "rbx"},
+};
+
+// 0 to 3 for the sizes memory is moved in, -1 for the others
+int size_index(int size) {
+    switch (size) {
+    case sizeof(char):  return 0;
+    case sizeof(short): return 1;
+    case sizeof(int):   return 2;
+    case sizeof(long):  return 3;
+    default:            return -1;
+    }
+}
+
+// the memory operand of the var 'ins' is about, locals are relative to the
+// frame base in rbp
+void ir_var_operand(ir_t *ins, char *buf) {
+    if (ins->local) {
+        sprintf(buf, "rbp + %lu", ins->arg);
+    } else {
+        sprintf(buf, "$VAR%lu", ins->arg);
+    }
+}
+
+// the upper bytes of 'reg' have to be cleared before for the smaller sizes
+void emit_load(out_t *output, int reg, int size, char *adr) {
+    int s = size_index(size);
+    if (s < 0) return;
+    out_printf(output, "    mov %s,%s [%s]\n", size_reg[reg][s], size_word[s], adr);
+}
+
+void emit_store(out_t *output, int reg, int size, char *adr) {
+    int s = size_index(size);
+    if (s < 0) return;
+    out_printf(output, "    mov %s [%s],%s\n", size_word[s], adr, size_reg[reg][s]);
+}
+
+char *syscall_regs[6] = {"rdi", "rsi", "rdx", "r10", "r8", "r9"};
+
+// emits one instruction working on the real stack
+void ir_emit_ins(out_t *output, ir_proc_t *p, ir_t *ins) {
+    char adr[64];
+    switch (ins->op) {
+    case IR_PUSH:
+        out_printf(output, "    mov rax,%lu\n", ins->arg);
+        out_printf(output, "    push rax\n");
+        break;
+    case IR_PUSH_STR:
+        out_printf(output, "    push $STR%lu\n", ins->arg);
+        break;
+    case IR_ADR:
+        if (ins->local) {
+            out_printf(output, "    lea rax,[rbp + %lu]\n", ins->arg);
+        } else {
+            out_printf(output, "    mov rax,$VAR%lu\n", ins->arg);
+        }
+        out_printf(output, "    push rax\n");
+        break;
+    case IR_GET:
+        ir_var_operand(ins, adr);
+        out_printf(output, "    xor rax,rax\n");
+        emit_load(output, REG_A, ins->size, adr);
+        out_printf(output, "    push rax\n");
+        break;
+    case IR_SET:
+        ir_var_operand(ins, adr);
+        out_printf(output, "    pop rax\n");
+        emit_store(output, REG_A, ins->size, adr);
+        break;
+    case IR_FILL:
+        out_printf(output, "    mov rcx,%lu\n", ins->cap - 1);
+        out_printf(output, "$ADR%lu:\n", ins->label);
+        out_printf(output, "    mov rax,rcx\n");
+        out_printf(output, "    mov rdx,%d\n", ins->size);
+        out_printf(output, "    mul rdx\n");
+        if (ins->local) {
+            out_printf(output, "    lea rax,[rbp + %lu + rax]\n", ins->arg);
+        } else {
+            out_printf(output, "    lea rax,[$VAR%lu + rax]\n", ins->arg);
+        }
+        out_printf(output, "    pop rbx\n");
+        emit_store(output, REG_B, ins->size, "rax");
+        out_printf(output, "    dec rcx\n");
+        out_printf(output, "    cmp rcx,0\n");
+        out_printf(output, "    jge $ADR%lu\n", ins->label);
+        break;
+    case IR_LOAD:
+        out_printf(output, "    pop rbx\n");
+        out_printf(output, "    xor rax,rax\n");
+        emit_load(output, REG_A, ins->size, "rbx");
+        out_printf(output, "    push rax\n");
+        break;
+    case IR_STORE:
+        out_printf(output, "    pop rax\n");
+        out_printf(output, "    pop rbx\n");
+        emit_store(output, REG_A, ins->size, "rbx");
+        break;
+    case IR_INDEX_GET:
+    case IR_INDEX_ADR:
+    case IR_INDEX_SET:
+        out_printf(output, "    pop rax\n");
+        out_printf(output, "    pop rbx\n");
+        out_printf(output, "    mov rdx,%d\n", ins->size);
+        out_printf(output, "    mul rdx\n");
+        out_printf(output, "    lea rax,[rbx + rax]\n");
+        if (ins->op == IR_INDEX_GET) {
+            out_printf(output, "    xor rbx,rbx\n");
+            emit_load(output, REG_B, ins->size, "rax");
+            out_printf(output, "    push rbx\n");
+        } else if (ins->op == IR_INDEX_ADR) {
+            out_printf(output, "    push rax\n");
+        } else {
+            out_printf(output, "    pop rbx\n");
+            emit_store(output, REG_B, ins->size, "rax");
+        }
+        break;
+    case IR_ADD:
+    case IR_SUB:
+    case IR_AND:
+    case IR_OR:
+    case IR_XOR:
+        out_printf(output, "    pop rax\n");
+        out_printf(output, "    pop rbx\n");
+        out_printf(output, "    %s rbx,rax\n", ir_info[ins->op].name);
+        out_printf(output, "    push rbx\n");
+        break;
+    case IR_MUL:
+        out_printf(output, "    pop rbx\n");
+        out_printf(output, "    pop rax\n");
+        out_printf(output, "    mul rbx\n");
+        out_printf(output, "    push rax\n");
+        break;
+    case IR_DIV:
+    case IR_MOD:
+        out_printf(output, "    xor rdx,rdx\n");
+        out_printf(output, "    pop rbx\n");
+        out_printf(output, "    pop rax\n");
+        out_printf(output, "    div rbx\n");
+        out_printf(output, "    push %s\n", ins->op == IR_DIV ? "rax" : "rdx");
+        break;
+    case IR_SHR:
+    case IR_SHL:
+        out_printf(output, "    pop rcx\n");
+        out_printf(output, "    pop rbx\n");
+        out_printf(output, "    %s rbx,cl\n", ins->op == IR_SHR ? "sar" : "sal");
+        out_printf(output, "    push rbx\n");
+        break;
+    case IR_BNOT:
+        out_printf(output, "    mov rax,0xffffffffffffffff\n");
+        out_printf(output, "    pop rbx\n");
+        out_printf(output, "    xor rbx,rax\n");
+        out_printf(output, "    push rbx\n");
+        break;
+    case IR_EQ:
+    case IR_NE:
+    case IR_GT:
+    case IR_LT:
+    case IR_GE:
+    case IR_LE: {
+        char *cc = ins->op == IR_EQ ? "e" : ins->op == IR_NE ? "ne" : ins->op == IR_GT ? "g" : ins->op == IR_LT ? "l" : ins->op == IR_GE ? "ge" : "le";
+        out_printf(output, "    mov rcx,0\n");
+        out_printf(output, "    mov rdx,1\n");
+        out_printf(output, "    pop rbx\n");
+        out_printf(output, "    pop rax\n");
+        out_printf(output, "    cmp rax,rbx\n");
+        out_printf(output, "    cmov%s rcx,rdx\n", cc);
+        if (ins->op == IR_GE) {
+            out_printf(output, "    mov rdx,1\n");
+            out_printf(output, "    pop rbx\n");
+            out_printf(output, "    pop rax\n");
+            out_printf(output, "    cmp rax,rbx\n");
+            out_printf(output, "    cmov%s rcx,rdx\n", cc);
+        }
+        out_printf(output, "    push rcx\n");
+    } break;
+    case IR_DUP:
+        out_printf(output, "    pop rax\n");
+        out_printf(output, "    push rax\n");
+        out_printf(output, "    push rax\n");
+        break;
+    case IR_SWAP:
+        out_printf(output, "    pop rax\n");
+        out_printf(output, "    pop rbx\n");
+        out_printf(output, "    push rax\n");
+        out_printf(output, "    push rbx\n");
+        break;
+    case IR_ROT:
+        out_printf(output, "    pop rax\n");
+        out_printf(output, "    pop rbx\n");
+        out_printf(output, "    pop rcx\n");
+        out_printf(output, "    push rax\n");
+        out_printf(output, "    push rbx\n");
+        out_printf(output, "    push rcx\n");
+        break;
+    case IR_OVER:
+        out_printf(output, "    pop rax\n");
+        out_printf(output, "    pop rbx\n");
+        out_printf(output, "    pop rcx\n");
+        out_printf(output, "    push rcx\n");
+        out_printf(output, "    push rbx\n");
+        out_printf(output, "    push rax\n");
+        out_printf(output, "    push rcx\n");
+        break;
+    case IR_DROP:
+        out_printf(output, "    pop rax\n");
+        break;
+    case IR_PRINT:
+        out_printf(output, "    pop rax\n");
+        out_printf(output, "    call _print\n");
+        break;
+    case IR_SYSCALL:
+        out_printf(output, "    pop rax\n");
+        for (size_t r = 0; r < ins->arg; r++) {
+            out_printf(output, "    pop %s\n", syscall_regs[r]);
+        }
+        out_printf(output, "    syscall\n");
+        out_printf(output, "    push rax\n");
+        break;
+    case IR_MALLOC:
+        out_printf(output, "    pop rdi\n");
+        out_printf(output, "    call malloc WRT ..plt\n");
+        out_printf(output, "    push rax\n");
+        break;
+    case IR_FREE:
+        out_printf(output, "    pop rdi\n");
+        out_printf(output, "    call free WRT ..plt\n");
+        break;
+    case IR_CALL:
+        out_printf(output, "    call $PROC%lu\n", ins->arg);
+        break;
+    case IR_CALL_MAIN:
+        out_printf(output, "    call main\n");
+        break;
+    case IR_LABEL:
+        out_printf(output, "$ADR%lu:\n", ins->arg);
+        break;
+    case IR_JMP:
+        out_printf(output, "    jmp $ADR%lu\n", ins->arg);
+        break;
+    case IR_JZ:
+        out_printf(output, "    pop rax\n");
+        out_printf(output, "    test rax,rax\n");
+        out_printf(output, "    jz $ADR%lu\n", ins->arg);
+        break;
+    case IR_JNZ:
+        out_printf(output, "    pop rax\n");
+        out_printf(output, "    test rax,rax\n");
+        out_printf(output, "    jnz $ADR%lu\n", ins->arg);
+        break;
+    case IR_ENTER: {
+        proc_t *proc = &program.procs[p->adr].value;
+        if (proc->in < 0) {
+            out_comment(output, ";   proc %s ( ? )\n", p->name);
+        } else {
+            out_comment(output, ";   proc %s ( %d -- %d )\n", p->name, proc->in, proc->out);
+        }
+        if (p->main) {
+            out_printf(output, "global main\n");
+            out_printf(output, "main:\n");
+            out_printf(output, "    mov qword [$RETP], $RET\n");
+        } else {
+            out_printf(output, "global $PROC%lu\n", p->adr);
+            out_printf(output, "$PROC%lu:\n", p->adr);
+        }
+        if (p->leaf) {
+            out_printf(output, "    pop r15\n");
+            break;
+        }
+        out_printf(output, "    mov rax,qword [$RETP]\n");
+        out_printf(output, "    pop qword [rax]\n");
+        if (proc->local_var_capacity == 0) {
+            out_printf(output, "    add qword [$RETP],8\n");
+            break;
+        }
+        // a frame with locals is the return address, the caller's rbp and
+        // room for every local of the proc, which rbp points to until it
+        // returns. procs without locals leave rbp alone, so it survives
+        // every call
+        out_printf(output, "    mov qword [rax + 8],rbp\n");
+        out_printf(output, "    lea rbp,[rax + 16]\n");
+        out_printf(output, "    add qword [$RETP],%lu\n", proc->local_var_capacity + 16 + p->reg_locals * 8);
+        for (int r = 0; r < p->reg_locals; r++) {
+            ir_t *var = &p->reg_local[r];
+            int s = size_index(var->size);
+            out_printf(output, "    mov qword [rbp + %lu],%s\n", proc->local_var_capacity + r * 8, ir_local_reg[r]);
+            out_printf(output, "    %s %s%s,%s [rbp + %lu]\n", s < 2 ? "movzx" : "mov", ir_local_reg[r], s == 3 ? "" : "d", size_word[s], var->arg);
+        }
+    } break;
+    case IR_LEAVE:
+        if (p->leaf) {
+            out_printf(output, "    push r15\n");
+            out_printf(output, "    ret\n");
+            break;
+        } else if (ins->arg == 0) {
+            out_printf(output, "    sub qword [$RETP],8\n");
+            out_printf(output, "    mov rax,qword [$RETP]\n");
+        } else {
+            for (int r = 0; r < p->reg_locals; r++) {
+                out_printf(output, "    mov %s,qword [rbp + %lu]\n", ir_local_reg[r], ins->arg + r * 8);
+            }
+            out_printf(output, "    lea rax,[rbp - 16]\n");
+            out_printf(output, "    mov qword [$RETP],rax\n");
+            out_printf(output, "    mov rbp,qword [rax + 8]\n");
+        }
+        out_printf(output, "    push qword [rax]\n");
+        if (p->main) {
+            out_printf(output, "    xor rax,rax\n");
+        }
+        out_printf(output, "    ret\n");
+        break;
+    }
+}
+
+void ir_emit_x86_64(out_t *output, ir_proc_t *p) {
+    for (size_t i = 0; i < arrlenu(p->code); i++) {
+        ir_t *ins = &p->code[i];
+        if (ins->op != IR_LABEL && ins->op != IR_ENTER) {
+            out_comment(output, ";   %s\n", ir_info[ins->op].name);
+        }
+        ir_emit_ins(output, p, ins);
+    }
+}
+
+// at -O1 and up codegen keeps the values on top of the data stack in a
+// virtual stack, each one a constant, the address of a symbol or a register.
+// they are only pushed for real at the end of a block, before calls and
+// syscalls, and when it runs out of registers. rax, rbx, rcx and rdx stay
+// free for the instructions themselves. r12 is never allocated, it only
+// holds the value carried into a counted loop's labels, rbp is only ever
+// the base of a local's address and r13 and r14 hold the locals
+// ir_alloc_locals picked, slots can read them but never write them
+#define VS_REGS 6
+#define VS_CARRY VS_REGS
+#define VS_FRAME (VS_REGS + 1)
+#define VS_LOCAL (VS_REGS + 2)
+#define VS_ALL (VS_LOCAL + IR_LOCAL_REGS)
+#define VS_MAX 32
+
+char *vs_reg_name[4][VS_ALL] = {
+    {"sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "bpl", "r13b", "r14b"},
+    {"si",  "di",  "r8w", "r9w", "r10w", "r11w", "r12w", "bp",  "r13w", "r14w"},
+    {"esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "ebp", "r13d", "r14d"},
+    {"rsi", "rdi", "r8",  "r9",  "r10",  "r11",  "r12",  "rbp", "r13",  "r14"},
+};
+
+enum {
+    VS_CONST,
+    VS_STR,  // $STR<val>
+    VS_VAR,  // $VAR<val>
+    VS_REG,
+    VS_ADDR, // reg + index * scale + disp, with $VAR<val> as the base when reg is -1
+};
+
+typedef struct {
+    int kind;
+    unsigned long val; // the constant, or the symbol's number
+    int reg;
+    int index;
+    int scale;
+    long disp;
+} vs_slot_t;
+
+typedef struct {
+    out_t *out;
+    vs_slot_t slot[VS_MAX];
+    size_t len;
+    int refs[VS_ALL]; // slots holding each register, dup shares them
+} vstack_t;
+
+int vs_imm32(vs_slot_t *v) {
+    return v->kind == VS_CONST && v->val <= 0x7fffffff;
+}
+
+// the memory operand of a VS_ADDR, without the brackets
+char *vs_addr_text(vs_slot_t *v, char *buf) {
+    int n = v->reg >= 0 ? sprintf(buf, "%s", vs_reg_name[3][v->reg]) : sprintf(buf, "$VAR%lu", v->val);
+    if (v->index >= 0) n += sprintf(buf + n, "+%s*%d", vs_reg_name[3][v->index], v->scale);
+    if (v->disp != 0) sprintf(buf + n, "%+ld", v->disp);
+    return buf;
+}
+
+// copies 'v' into the register 'reg'
+void vs_move(vstack_t *vs, vs_slot_t *v, char *reg) {
+    char adr[64];
+    switch (v->kind) {
+    case VS_CONST:
+        out_printf(vs->out, "    mov %s,%lu\n", reg, v->val);
+        break;
+    case VS_STR:
+    case VS_VAR:
+        out_printf(vs->out, "    mov %s,$%s%lu\n", reg, v->kind == VS_STR ? "STR" : "VAR", v->val);
+        break;
+    case VS_ADDR:
+        if (v->reg >= 0 && v->index < 0 && v->disp == 0) {
+            if (strcmp(reg, vs_reg_name[3][v->reg]) != 0) {
+                out_printf(vs->out, "    mov %s,%s\n", reg, vs_reg_name[3][v->reg]);
+            }
+        } else {
+            out_printf(vs->out, "    lea %s,[%s]\n", reg, vs_addr_text(v, adr));
+        }
+        break;
+    default:
+        if (strcmp(reg, vs_reg_name[3][v->reg]) != 0) {
+            out_printf(vs->out, "    mov %s,%s\n", reg, vs_reg_name[3][v->reg]);
+        }
+    }
+}
+
+// the operand 'v' can be used as when it's the source of an instruction,
+// constants that don't fit 32 bits and symbols go through 'scratch'
+char *vs_src(vstack_t *vs, vs_slot_t *v, char *buf, char *scratch) {
+    if (vs_imm32(v)) {
+        sprintf(buf, "%lu", v->val);
+        return buf;
+    } else if (v->kind == VS_REG) {
+        return vs_reg_name[3][v->reg];
+    }
+    vs_move(vs, v, scratch);
+    return scratch;
+}
+
+void vs_free(vstack_t *vs, vs_slot_t *v) {
+    if (v->kind == VS_REG) vs->refs[v->reg]--;
+    if (v->kind == VS_ADDR && v->reg >= 0) vs->refs[v->reg]--;
+    if (v->kind == VS_ADDR && v->index >= 0) vs->refs[v->index]--;
+}
+
+// another slot holds the same value
+void vs_share(vstack_t *vs, vs_slot_t *v) {
+    if (v->kind == VS_REG) vs->refs[v->reg]++;
+    if (v->kind == VS_ADDR && v->reg >= 0) vs->refs[v->reg]++;
+    if (v->kind == VS_ADDR && v->index >= 0) vs->refs[v->index]++;
+}
+
+// pushes the deepest value of the virtual stack on the real one
+void vs_spill(vstack_t *vs) {
+    vs_slot_t *v = &vs->slot[0];
+    if (v->kind == VS_STR || v->kind == VS_VAR) {
+        out_printf(vs->out, "    push $%s%lu\n", v->kind == VS_STR ? "STR" : "VAR", v->val);
+    } else {
+        char buf[32];
+        out_printf(vs->out, "    push %s\n", vs_src(vs, v, buf, "rax"));
+    }
+    vs_free(vs, v);
+    vs->len--;
+    memmove(vs->slot, vs->slot + 1, vs->len * sizeof(*vs->slot));
+}
+
+void vs_flush(vstack_t *vs) {
+    while (vs->len > 0) vs_spill(vs);
+}
+
+// after a jump nothing is known about the stack
+void vs_reset(vstack_t *vs) {
+    vs->len = 0;
+    memset(vs->refs, 0, sizeof(vs->refs));
+}
+
+int vs_alloc(vstack_t *vs) {
+    for (;;) {
+        for (int r = 0; r < VS_REGS; r++) {
+            if (vs->refs[r] == 0) {
+                vs->refs[r] = 1;
+                return r;
+            }
+        }
+        vs_spill(vs);
+    }
+}
+
+void vs_push(vstack_t *vs, vs_slot_t v) {
+    if (vs->len == VS_MAX) vs_spill(vs);
+    vs->slot[vs->len++] = v;
+}
+
+void vs_push_reg(vstack_t *vs, int reg) {
+    vs_push(vs, (vs_slot_t){.kind = VS_REG, .reg = reg});
+}
+
+// the slots that hold 'reg' get a copy of it in another register, so
+// 'reg' can be written
+void vs_evict(vstack_t *vs, int reg) {
+    if (vs->refs[reg] == 0) return;
+    int r = vs_alloc(vs);
+    int moved = 0;
+    for (size_t i = 0; i < vs->len; i++) {
+        vs_slot_t *u = &vs->slot[i];
+        if ((u->kind == VS_REG || u->kind == VS_ADDR) && u->reg == reg) {
+            u->reg = r;
+            moved++;
+        }
+        if (u->kind == VS_ADDR && u->index == reg) {
+            u->index = r;
+            moved++;
+        }
+    }
+    if (moved > 0) out_printf(vs->out, "    mov %s,%s\n", vs_reg_name[3][r], vs_reg_name[3][reg]);
+    vs->refs[r] = moved;
+    vs->refs[reg] -= moved;
+}
+
+// how control enters a label that carries: the value under the top 'above'
+// slots in r12 and everything under it on the real stack
+void vs_carry(vstack_t *vs, size_t above) {
+    while (vs->len < above + 1) {
+        int r = vs_alloc(vs);
+        out_printf(vs->out, "    pop %s\n", vs_reg_name[3][r]);
+        memmove(vs->slot + 1, vs->slot, vs->len * sizeof(*vs->slot));
+        vs->slot[0] = (vs_slot_t){.kind = VS_REG, .reg = r};
+        vs->len++;
+    }
+    while (vs->len > above + 1) vs_spill(vs);
+    vs_slot_t *v = &vs->slot[0];
+    if (v->kind == VS_REG && v->reg == VS_CARRY) return;
+    vs_evict(vs, VS_CARRY);
+    vs_move(vs, v, "r12");
+    vs_free(vs, v);
+    *v = (vs_slot_t){.kind = VS_REG, .reg = VS_CARRY};
+    vs->refs[VS_CARRY] = 1;
+}
+
+// the value on top, from the real stack when the virtual one is empty
+vs_slot_t vs_pop(vstack_t *vs) {
+    if (vs->len > 0) return vs->slot[--vs->len];
+    int r = vs_alloc(vs);
+    out_printf(vs->out, "    pop %s\n", vs_reg_name[3][r]);
+    return (vs_slot_t){.kind = VS_REG, .reg = r};
+}
+
+// a register only 'v' holds, so the instruction can write to it
+int vs_own(vstack_t *vs, vs_slot_t *v) {
+    if (v->kind == VS_REG && v->reg < VS_LOCAL && vs->refs[v->reg] == 1) return v->reg;
+    int r = vs_alloc(vs);
+    vs_move(vs, v, vs_reg_name[3][r]);
+    vs_free(vs, v);
+    return r;
+}
+
+// any register holding 'v', 'scratch' when it isn't in one
+char *vs_in_reg(vstack_t *vs, vs_slot_t *v, char *scratch) {
+    if (v->kind == VS_REG) return vs_reg_name[3][v->reg];
+    vs_move(vs, v, scratch);
+    return scratch;
+}
+
+// loads 'size' bytes from 'adr' into 'reg', zero extended
+void vs_load(vstack_t *vs, int reg, int size, char *adr) {
+    int s = size_index(size);
+    if (s < 0) return;
+    if (s < 2) {
+        out_printf(vs->out, "    movzx %s,%s [%s]\n", vs_reg_name[2][reg], size_word[s], adr);
+    } else {
+        out_printf(vs->out, "    mov %s,%s [%s]\n", vs_reg_name[s][reg], size_word[s], adr);
+    }
+}
+
+void vs_store(vstack_t *vs, vs_slot_t *v, int size, char *adr) {
+    int s = size_index(size);
+    if (s < 0) return;
+    if (v->kind == VS_CONST && (s < 3 || vs_imm32(v))) {
+        unsigned long mask = s == 3 ? ~0ul : (1ul << (size * 8)) - 1;
+        out_printf(vs->out, "    mov %s [%s],%lu\n", size_word[s], adr, v->val & mask);
+    } else if (v->kind == VS_REG) {
+        out_printf(vs->out, "    mov %s [%s],%s\n", size_word[s], adr, vs_reg_name[s][v->reg]);
+    } else {
+        vs_in_reg(vs, v, "rax");
+        emit_store(vs->out, REG_A, size, adr);
+    }
+}
+
+// writes 'v' to the local kept in 'reg', cut to the local's size like a
+// store to its frame would
+void vs_set_local(vstack_t *vs, vs_slot_t *v, int reg, int size) {
+    int s = size_index(size);
+    if (v->kind == VS_CONST) {
+        unsigned long mask = s == 3 ? ~0ul : (1ul << (size * 8)) - 1;
+        out_printf(vs->out, "    mov %s,%lu\n", vs_reg_name[3][reg], v->val & mask);
+        return;
+    }
+    vs_in_reg(vs, v, "rax");
+    char *src = v->kind == VS_REG ? vs_reg_name[s][v->reg] : size_reg[REG_A][s];
+    if (s == 3) {
+        if (strcmp(src, vs_reg_name[3][reg]) != 0) out_printf(vs->out, "    mov %s,%s\n", vs_reg_name[3][reg], src);
+    } else {
+        out_printf(vs->out, "    %s %s,%s\n", s == 2 ? "mov" : "movzx", vs_reg_name[2][reg], src);
+    }
+}
+
+// 'v' as an address, a register or a symbol to build on
+vs_slot_t vs_addr(vstack_t *vs, vs_slot_t v) {
+    if (v.kind == VS_ADDR) return v;
+    vs_slot_t a = {.kind = VS_ADDR, .reg = -1, .index = -1};
+    if (v.kind == VS_VAR) {
+        a.val = v.val;
+    } else if (v.kind == VS_REG) {
+        a.reg = v.reg;
+    } else {
+        a.reg = vs_own(vs, &v);
+    }
+    return a;
+}
+
+// adds 'off' to the displacement, if it still fits one
+int vs_addr_add(vs_slot_t *a, unsigned long off) {
+    if (off > 0x7fffffff || a->disp + (long)off > 0x7fffffff) return 0;
+    a->disp += off;
+    return 1;
+}
+
+// adds 'i' * 'size' to the address, as its index when the size is a scale
+void vs_addr_index(vstack_t *vs, vs_slot_t *a, vs_slot_t i, int size) {
+    if (a->index >= 0) {
+        int r = vs_own(vs, a);
+        *a = (vs_slot_t){.kind = VS_ADDR, .reg = r, .index = -1};
+    }
+    int r = i.kind == VS_REG ? i.reg : vs_own(vs, &i);
+    if (size != 1 && size != 2 && size != 4 && size != 8) {
+        if (vs->refs[r] > 1 || r >= VS_LOCAL) {
+            vs_slot_t shared = {.kind = VS_REG, .reg = r};
+            r = vs_own(vs, &shared);
+        }
+        out_printf(vs->out, "    imul %s,%d\n", vs_reg_name[3][r], size);
+        size = 1;
+    }
+    a->index = r;
+    a->scale = size;
+}
+
+// the address of a[i], as base + i * size
+vs_slot_t vs_index(vstack_t *vs, int size) {
+    vs_slot_t i = vs_pop(vs);
+    vs_slot_t a = vs_addr(vs, vs_pop(vs));
+    if (i.kind != VS_CONST || i.val > 0x7fffffff / size || !vs_addr_add(&a, i.val * size)) {
+        vs_addr_index(vs, &a, i, size);
+    }
+    return a;
+}
+
+// if the value code[i] pushes is next used as the address of a load or a
+// store in the same block, so an add that makes it can go in the operand
+int ir_feeds_address(ir_proc_t *p, size_t i) {
+    int above = 0;
+    for (size_t j = i + 1; j < arrlenu(p->code) && j <= i + 8; j++) {
+        ir_t *ins = &p->code[j];
+        int pops = ir_pops(ins);
+        if (ins->op == IR_LOAD && above == 0) return 1;
+        if (ins->op == IR_STORE && above == 1) return 1;
+        if (pops < 0 || pops > above || ins->op == IR_LABEL || ir_ends_block(ins->op)) return 0;
+        above += ir_pushes(ins) - pops;
+    }
+    return 0;
+}
+
+// the k of d = 2^k, -1 when 'd' isn't a power of two
+int vs_log2(unsigned long d) {
+    if (d == 0 || (d & (d - 1)) != 0) return -1;
+    return __builtin_ctzl(d);
+}
+
+// unsigned division by a constant as a multiply-high: q = hi(n * mul) >> shift,
+// or with 'add' q = (t + ((n - t) >> 1)) >> shift where t = hi(n * mul), for
+// the divisors whose magic number needs 65 bits
+typedef struct {
+    unsigned long mul;
+    int shift;
+    int add;
+} vs_magic_t;
+
+vs_magic_t vs_magic(unsigned long d) {
+    int l = 64 - __builtin_clzl(d - 1); // ceil(log2(d))
+    for (int s = 0; s < l; s++) {
+        unsigned __int128 p = (unsigned __int128)1 << (64 + s);
+        unsigned __int128 m = (p + d - 1) / d;
+        if (m >> 64) break;
+        if (m * d - p <= (unsigned __int128)1 << s) {
+            return (vs_magic_t){.mul = m, .shift = s};
+        }
+    }
+    unsigned __int128 m = ((((unsigned __int128)1 << l) - d) << 64) / d + 1;
+    return (vs_magic_t){.mul = m, .shift = l - 1, .add = 1};
+}
+
+// 'r' = 'r' / 'd' or 'r' % 'd' for a constant 'd' that isn't 0
+void vs_div_const(vstack_t *vs, int op, int r, unsigned long d) {
+    char *n = vs_reg_name[3][r];
+    int k = vs_log2(d);
+    if (k >= 0) {
+        if (op == IR_DIV) {
+            if (k > 0) out_printf(vs->out, "    shr %s,%d\n", n, k);
+        } else if (d - 1 <= 0x7fffffff) {
+            out_printf(vs->out, "    and %s,%lu\n", n, d - 1);
+        } else {
+            out_printf(vs->out, "    mov rax,%lu\n", d - 1);
+            out_printf(vs->out, "    and %s,rax\n", n);
+        }
+        return;
+    }
+    vs_magic_t m = vs_magic(d);
+    out_printf(vs->out, "    mov rax,%lu\n", m.mul);
+    out_printf(vs->out, "    mul %s\n", n);
+    if (m.add) {
+        out_printf(vs->out, "    mov rax,%s\n", n);
+        out_printf(vs->out, "    sub rax,rdx\n");
+        out_printf(vs->out, "    shr rax,1\n");
+        out_printf(vs->out, "    add rdx,rax\n");
+    }
+    if (m.shift > 0) out_printf(vs->out, "    shr rdx,%d\n", m.shift);
+    if (op == IR_DIV) {
+        out_printf(vs->out, "    mov %s,rdx\n", n);
+    } else {
+        if (d <= 0x7fffffff) {
+            out_printf(vs->out, "    imul rdx,%lu\n", d);
+        } else {
+            out_printf(vs->out, "    mov rax,%lu\n", d);
+            out_printf(vs->out, "    imul rdx,rax\n");
+        }
+        out_printf(vs->out, "    sub %s,rdx\n", n);
+    }
+}
+
+// 'r' = 'r' * 'm' for a constant 'm'
+void vs_mul_const(vstack_t *vs, int r, unsigned long m) {
+    char *n = vs_reg_name[3][r];
+    int k = vs_log2(m);
+    if (k == 0) return;
+    if (k > 0) {
+        out_printf(vs->out, "    shl %s,%d\n", n, k);
+    } else if (m == 3 || m == 5 || m == 9) {
+        out_printf(vs->out, "    lea %s,[%s+%s*%lu]\n", n, n, n, m - 1);
+    } else if (m <= 0x7fffffff) {
+        out_printf(vs->out, "    imul %s,%lu\n", n, m);
+    } else {
+        out_printf(vs->out, "    mov rax,%lu\n", m);
+        out_printf(vs->out, "    imul %s,rax\n", n);
+    }
+}
+
+char *vs_cond[] = {
+    [IR_EQ] = "e", [IR_NE] = "ne", [IR_GT] = "g", [IR_LT] = "l", [IR_LE] = "le", [IR_GE] = "ge",
+};
+
+// the comparison that's true when 'op' is false, and the one that holds
+// with its operands swapped
+int vs_cond_inverse[] = {
+    [IR_EQ] = IR_NE, [IR_NE] = IR_EQ, [IR_GT] = IR_LE, [IR_LT] = IR_GE, [IR_LE] = IR_GT, [IR_GE] = IR_LT,
+};
+int vs_cond_swapped[] = {
+    [IR_EQ] = IR_EQ, [IR_NE] = IR_NE, [IR_GT] = IR_LT, [IR_LT] = IR_GT, [IR_LE] = IR_GE, [IR_GE] = IR_LE,
+};
+
+// compares 'a' with 'b', returns the comparison that has to be checked,
+// which is 'op' unless the operands were swapped to keep a constant on the
+// right
+int vs_cmp(vstack_t *vs, vs_slot_t a, vs_slot_t b, int op) {
+    char buf[32];
+    if (a.kind != VS_REG && b.kind == VS_REG) {
+        vs_slot_t t = a;
+        a = b;
+        b = t;
+        op = vs_cond_swapped[op];
+    }
+    char *left = vs_in_reg(vs, &a, "rax");
+    out_printf(vs->out, "    cmp %s,%s\n", left, vs_src(vs, &b, buf, "rbx"));
+    vs_free(vs, &a);
+    vs_free(vs, &b);
+    return op;
+}
+
+void ir_emit_vstack_x86_64(out_t *output, ir_proc_t *p) {
+    vstack_t vs = {.out = output};
+    char adr[64], buf[32];
+    for (size_t i = 0; i < arrlenu(p->code); i++) {
+        ir_t *ins = &p->code[i];
+        if (ins->op != IR_LABEL && ins->op != IR_ENTER) {
+            out_comment(output, ";   %s\n", ir_info[ins->op].name);
+        }
+        switch (ins->op) {
+        case IR_PUSH:
+            vs_push(&vs, (vs_slot_t){.kind = VS_CONST, .val = ins->arg});
+            break;
+        case IR_PUSH_STR:
+            vs_push(&vs, (vs_slot_t){.kind = VS_STR, .val = ins->arg});
+            break;
+        case IR_ADR:
+            if (ins->local) {
+                vs_push(&vs, (vs_slot_t){.kind = VS_ADDR, .reg = VS_FRAME, .index = -1, .disp = ins->arg});
+            } else {
+                vs_push(&vs, (vs_slot_t){.kind = VS_VAR, .val = ins->arg});
+            }
+            break;
+        case IR_GET: {
+            if (ins->reg) {
+                vs.refs[VS_LOCAL + ins->reg - 1]++;
+                vs_push_reg(&vs, VS_LOCAL + ins->reg - 1);
+                break;
             }
-            fprintf(output, ";   cap\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    push %lu\n", var.cap);
-            program.cur_var = program.prv_var;
-        } break;
-        case OP_SYSCALL0: {
-            fprintf(output, ";   syscall\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    syscall\n");
-            fprintf(output, "    push rax\n");
+            int r = vs_alloc(&vs);
+            ir_var_operand(ins, adr);
+            vs_load(&vs, r, ins->size, adr);
+            vs_push_reg(&vs, r);
         } break;
-        case OP_SYSCALL1: {
-            fprintf(output, ";   syscall\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    pop rdi\n");
-            fprintf(output, "    syscall\n");
-            fprintf(output, "    push rax\n");
-        } break;
-        case OP_SYSCALL2: {
-            fprintf(output, ";   syscall\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    pop rdi\n");
-            fprintf(output, "    pop rsi\n");
-            fprintf(output, "    syscall\n");
-            fprintf(output, "    push rax\n");
+        case IR_SET: {
+            vs_slot_t v = vs_pop(&vs);
+            if (ins->reg) {
+                vs_evict(&vs, VS_LOCAL + ins->reg - 1);
+                vs_set_local(&vs, &v, VS_LOCAL + ins->reg - 1, ins->size);
+                vs_free(&vs, &v);
+                break;
+            }
+            ir_var_operand(ins, adr);
+            vs_store(&vs, &v, ins->size, adr);
+            vs_free(&vs, &v);
         } break;
-        case OP_SYSCALL3: {
-            fprintf(output, ";   syscall\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    pop rdi\n");
-            fprintf(output, "    pop rsi\n");
-            fprintf(output, "    pop rdx\n");
-            fprintf(output, "    syscall\n");
-            fprintf(output, "    push rax\n");
+        case IR_LOAD:
+        case IR_INDEX_GET: {
+            vs_slot_t a = ins->op == IR_LOAD ? vs_addr(&vs, vs_pop(&vs)) : vs_index(&vs, ins->size);
+            vs_free(&vs, &a);
+            int r = vs_alloc(&vs);
+            vs_load(&vs, r, ins->size, vs_addr_text(&a, adr));
+            vs_push_reg(&vs, r);
         } break;
-        case OP_SYSCALL4: {
-            fprintf(output, ";   syscall\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    pop rdi\n");
-            fprintf(output, "    pop rsi\n");
-            fprintf(output, "    pop rdx\n");
-            fprintf(output, "    pop r10\n");
-            fprintf(output, "    syscall\n");
-            fprintf(output, "    push rax\n");
+        case IR_STORE: {
+            vs_slot_t v = vs_pop(&vs);
+            vs_slot_t a = vs_addr(&vs, vs_pop(&vs));
+            vs_store(&vs, &v, ins->size, vs_addr_text(&a, adr));
+            vs_free(&vs, &v);
+            vs_free(&vs, &a);
         } break;
-        case OP_SYSCALL5: {
-            fprintf(output, ";   syscall\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    pop rdi\n");
-            fprintf(output, "    pop rsi\n");
-            fprintf(output, "    pop rdx\n");
-            fprintf(output, "    pop r10\n");
-            fprintf(output, "    pop r8\n");
-            fprintf(output, "    syscall\n");
-            fprintf(output, "    push rax\n");
+        case IR_INDEX_ADR:
+            vs_push(&vs, vs_index(&vs, ins->size));
+            break;
+        case IR_INDEX_SET: {
+            vs_slot_t a = vs_index(&vs, ins->size);
+            vs_slot_t v = vs_pop(&vs);
+            vs_store(&vs, &v, ins->size, vs_addr_text(&a, adr));
+            vs_free(&vs, &v);
+            vs_free(&vs, &a);
         } break;
-        case OP_SYSCALL6: {
-            fprintf(output, ";   syscall\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    pop rdi\n");
-            fprintf(output, "    pop rsi\n");
-            fprintf(output, "    pop rdx\n");
-            fprintf(output, "    pop r10\n");
-            fprintf(output, "    pop r8\n");
-            fprintf(output, "    pop r9\n");
-            fprintf(output, "    syscall\n");
-            fprintf(output, "    push rax\n");
+        case IR_ADD:
+        case IR_SUB:
+        case IR_AND:
+        case IR_OR:
+        case IR_XOR:
+        case IR_MUL: {
+            vs_slot_t b = vs_pop(&vs);
+            vs_slot_t a = vs_pop(&vs);
+            if (a.kind == VS_CONST && b.kind != VS_CONST && ins->op != IR_SUB) {
+                vs_slot_t t = a;
+                a = b;
+                b = t;
+            }
+            if (ins->op == IR_ADD && ir_feeds_address(p, i)) {
+                // 'ptr off + @long' and friends address [ptr+off] directly
+                vs_slot_t sum = vs_addr(&vs, a);
+                if (b.kind == VS_CONST && vs_addr_add(&sum, b.val)) {
+                    vs_push(&vs, sum);
+                    break;
+                } else if (b.kind != VS_CONST) {
+                    vs_addr_index(&vs, &sum, b, 1);
+                    vs_push(&vs, sum);
+                    break;
+                }
+                a = sum;
+            }
+            int r = vs_own(&vs, &a);
+            if (ins->op == IR_MUL && b.kind == VS_CONST) {
+                vs_mul_const(&vs, r, b.val);
+            } else {
+                char *name = ins->op == IR_MUL ? "imul" : ir_info[ins->op].name;
+                out_printf(output, "    %s %s,%s\n", name, vs_reg_name[3][r], vs_src(&vs, &b, buf, "rax"));
+            }
+            vs_free(&vs, &b);
+            vs_push_reg(&vs, r);
         } break;
-        case OP_EQUALS: {
-            fprintf(output, ";   equals\n");
-            fprintf(output, "    mov rcx,0\n");
-            fprintf(output, "    mov rdx,1\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    cmp rax,rbx\n");
-            fprintf(output, "    cmove rcx,rdx\n");
-            fprintf(output, "    push rcx\n");
+        case IR_DIV:
+        case IR_MOD: {
+            vs_slot_t b = vs_pop(&vs);
+            vs_slot_t a = vs_pop(&vs);
+            if (b.kind == VS_CONST && b.val != 0) {
+                int r = vs_own(&vs, &a);
+                vs_div_const(&vs, ins->op, r, b.val);
+                vs_push_reg(&vs, r);
+                break;
+            }
+            vs_move(&vs, &a, "rax");
+            char *divisor = vs_in_reg(&vs, &b, "rbx");
+            out_printf(output, "    xor rdx,rdx\n");
+            out_printf(output, "    div %s\n", divisor);
+            vs_free(&vs, &a);
+            vs_free(&vs, &b);
+            int r = vs_alloc(&vs);
+            out_printf(output, "    mov %s,%s\n", vs_reg_name[3][r], ins->op == IR_DIV ? "rax" : "rdx");
+            vs_push_reg(&vs, r);
         } break;
-        case OP_GREATER: {
-            fprintf(output, ";   greater\n");
-            fprintf(output, "    mov rcx,0\n");
-            fprintf(output, "    mov rdx,1\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    cmp rax,rbx\n");
-            fprintf(output, "    cmovg rcx,rdx\n");
-            fprintf(output, "    push rcx\n");
+        case IR_SHR:
+        case IR_SHL: {
+            vs_slot_t b = vs_pop(&vs);
+            vs_slot_t a = vs_pop(&vs);
+            int r = vs_own(&vs, &a);
+            char *name = ins->op == IR_SHR ? "sar" : "sal";
+            if (b.kind == VS_CONST) {
+                out_printf(output, "    %s %s,%lu\n", name, vs_reg_name[3][r], b.val & 63);
+            } else {
+                vs_move(&vs, &b, "rcx");
+                out_printf(output, "    %s %s,cl\n", name, vs_reg_name[3][r]);
+            }
+            vs_free(&vs, &b);
+            vs_push_reg(&vs, r);
         } break;
-        case OP_MINOR: {
-            fprintf(output, ";   minor\n");
-            fprintf(output, "    mov rcx,0\n");
-            fprintf(output, "    mov rdx,1\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    cmp rax,rbx\n");
-            fprintf(output, "    cmovl rcx,rdx\n");
-            fprintf(output, "    push rcx\n");
+        case IR_BNOT: {
+            vs_slot_t a = vs_pop(&vs);
+            int r = vs_own(&vs, &a);
+            out_printf(output, "    not %s\n", vs_reg_name[3][r]);
+            vs_push_reg(&vs, r);
         } break;
-        case OP_EQGREATER: {
-            fprintf(output, ";   eqgreater\n");
-            fprintf(output, "    mov rcx,0\n");
-            fprintf(output, "    mov rdx,1\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    cmp rax,rbx\n");
-            fprintf(output, "    cmovge rcx,rdx\n");
-            fprintf(output, "    mov rdx,1\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    cmp rax,rbx\n");
-            fprintf(output, "    cmovge rcx,rdx\n");
-            fprintf(output, "    push rcx\n");
+        case IR_EQ:
+        case IR_NE:
+        case IR_GT:
+        case IR_LT:
+        case IR_LE: {
+            if (i + 1 < arrlenu(p->code) && (p->code[i + 1].op == IR_JZ || p->code[i + 1].op == IR_JNZ)) {
+                // the result only feeds the branch, so jump on the flags,
+                // flushing the rest of the stack before they're set
+                int carry = ir_label(p, p->code[i + 1].arg)->carry;
+                if (carry) vs_carry(&vs, 2);
+                vs_slot_t b = vs_pop(&vs);
+                vs_slot_t a = vs_pop(&vs);
+                if (!carry) vs_flush(&vs);
+                int op = vs_cmp(&vs, a, b, ins->op);
+                i++;
+                if (p->code[i].op == IR_JZ) op = vs_cond_inverse[op];
+                out_comment(output, ";   %s\n", ir_info[p->code[i].op].name);
+                out_printf(output, "    j%s $ADR%lu\n", vs_cond[op], p->code[i].arg);
+                break;
+            }
+            vs_slot_t b = vs_pop(&vs);
+            vs_slot_t a = vs_pop(&vs);
+            int r = vs_alloc(&vs);
+            int op = vs_cmp(&vs, a, b, ins->op);
+            out_printf(output, "    set%s %s\n", vs_cond[op], vs_reg_name[0][r]);
+            out_printf(output, "    movzx %s,%s\n", vs_reg_name[2][r], vs_reg_name[0][r]);
+            vs_push_reg(&vs, r);
         } break;
-        case OP_EQMINOR: {
-            fprintf(output, ";   eqminor\n");
-            fprintf(output, "    mov rcx,0\n");
-            fprintf(output, "    mov rdx,1\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    cmp rax,rbx\n");
-            fprintf(output, "    cmovle rcx,rdx\n");
-            fprintf(output, "    push rcx\n");
+        case IR_DUP: {
+            vs_slot_t a = vs_pop(&vs);
+            vs_share(&vs, &a);
+            vs_push(&vs, a);
+            vs_push(&vs, a);
         } break;
-        case OP_NOTEQUALS: {
-            fprintf(output, ";   not\n");
-            fprintf(output, "    mov rcx,0\n");
-            fprintf(output, "    mov rdx,1\n");
-            fprintf(output, "    pop rbx\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    cmp rax,rbx\n");
-            fprintf(output, "    cmovne rcx,rdx\n");
-            fprintf(output, "    push rcx\n");
+        case IR_SWAP: {
+            vs_slot_t b = vs_pop(&vs);
+            vs_slot_t a = vs_pop(&vs);
+            vs_push(&vs, b);
+            vs_push(&vs, a);
         } break;
-        case OP_DELETE: {
-            fprintf(output, ";   delete memory\n");
-            fprintf(output, "    pop rdi\n");
-            fprintf(output, "    call free WRT ..plt\n");
+        case IR_ROT: {
+            vs_slot_t c = vs_pop(&vs);
+            vs_slot_t b = vs_pop(&vs);
+            vs_slot_t a = vs_pop(&vs);
+            vs_push(&vs, c);
+            vs_push(&vs, b);
+            vs_push(&vs, a);
         } break;
-        case OP_MEMORY: {
-            fprintf(output, ";   memory allocation\n");
-            fprintf(output, "    pop rdi\n");
-            fprintf(output, "    call malloc WRT ..plt\n");
-            fprintf(output, "    push rax\n");
+        case IR_OVER: {
+            vs_slot_t c = vs_pop(&vs);
+            vs_slot_t b = vs_pop(&vs);
+            vs_slot_t a = vs_pop(&vs);
+            vs_share(&vs, &a);
+            vs_push(&vs, a);
+            vs_push(&vs, b);
+            vs_push(&vs, c);
+            vs_push(&vs, a);
         } break;
-        case OP_CALL_VAR: { 
-            int local = 0;
-            vartype_t l; // TODO: change the name to 'vt' to be consistant
-            var_t var;
-            proc_t p = shget(program.procs, program.cur_proc[arrlenu(program.cur_proc) - 1]);
-            if (shgetp_null(p.vars, program.tokens[idx].val) != NULL) {
-                local = 1;
-                var = shget(p.vars, program.tokens[idx].val);
-                l = shget(program.types, var.type);
-            }
-            if (!local) {
-                if (shgetp_null(program.vars, program.tokens[idx].val) != NULL) {
-                    var = shget(program.vars, program.tokens[idx].val);
-                    l = shget(program.types, var.type);
-                }
+        case IR_DROP:
+            if (vs.len > 0) {
+                vs_free(&vs, &vs.slot[--vs.len]);
+            } else {
+                out_printf(output, "    pop rax\n");
             }
-
-            // TODO: for now 'set var' and 'get var' just supports primitive types
-            if (program.setting && !var.arr && !program.index) { // set var value
-                program.setting=0;
-                fprintf(output, ";   set var value\n");
-                fprintf(output, "    pop rax\n");
-                if (l.primitive) {
-                    if (!local) {
-                        switch (l.size_bytes) {
-                        case sizeof(char):
-                            fprintf(output, "    mov byte [$VAR%lu],al\n", var.adr);
-                            break;
-                        case sizeof(short):
-                            fprintf(output, "    mov word [$VAR%lu],ax\n", var.adr);
-                            break;
-                        case sizeof(int):
-                            fprintf(output, "    mov dword [$VAR%lu],eax\n", var.adr);
-                            break;
-                        case sizeof(long):
-                            fprintf(output, "    mov qword [$VAR%lu],rax\n", var.adr);
-                            break;
-                        }
-                    } else {
-                        fprintf(output, "    mov rbx,qword [$RETP]\n");
-                        switch (l.size_bytes) {
-                        case sizeof(char):
-                            fprintf(output, "    mov byte [rbx - %lu],al\n", var.adr);
-                            break;
-                        case sizeof(short):
-                            fprintf(output, "    mov word [rbx - %lu],ax\n", var.adr);
-                            break;
-                        case sizeof(int):
-                            fprintf(output, "    mov dword [rbx - %lu],eax\n", var.adr);
-                            break;
-                        case sizeof(long):
-                            fprintf(output, "    mov qword [rbx - %lu],rax\n", var.adr);
-                            break;
-                        }
-                    }
-                }
-            } else if (program.address && !program.index && program.tokens[idx + 1].operation != OP_START_INDEX) { // get address
-                program.address = 0;
-                fprintf(output, ";   get var address\n");
-                if (!local) {
-                    fprintf(output, "    mov rax,$VAR%lu\n", var.adr);
-                } else {
-                    fprintf(output, "    mov rbx,qword [$RETP]\n");
-                    fprintf(output, "    sub rbx,%lu\n", var.adr);
-                    fprintf(output, "    mov rax,rbx\n");
-                }
-                fprintf(output, "    push rax\n");
-            } else if (program.size_of && !program.index ) { // sizeof var
-                program.size_of = 0;
-                fprintf(output, ";   sizeof\n");
-                if (!var.arr || program.tokens[idx + 1].operation == OP_START_INDEX) {
-                    fprintf(output, "    push %lu\n", l.size_bytes);
-                    if (program.tokens[idx + 1].operation == OP_START_INDEX) {
-                        program.size_of = 1;
-                    }
-                } else {
-                    fprintf(output, "    push %lu\n", l.size_bytes * var.cap);
-                }
-            } else {  // get var value
-                fprintf(output, ";   get var value\n");
-                if (l.primitive) {
-                    if (!var.constant) {
-                        fprintf(output, "    xor rax,rax\n");
-                        if (!var.arr) {
-                            if (!local) {
-                                switch (l.size_bytes) {
-                                case sizeof(char):
-                                    fprintf(output, "    mov al,byte [$VAR%lu]\n", var.adr);
-                                    break;
-                                case sizeof(short):
-                                    fprintf(output, "    mov ax,word [$VAR%lu]\n", var.adr);
-                                    break;
-                                case sizeof(int):
-                                    fprintf(output, "    mov eax,dword [$VAR%lu]\n", var.adr);
-                                    break;
-                                case sizeof(long):
-                                    fprintf(output, "    mov rax,qword [$VAR%lu]\n", var.adr);
-                                    break;
-                                }
-                            } else {
-                                fprintf(output, "    mov rbx,qword [$RETP]\n");
-                                switch (l.size_bytes) {
-                                case sizeof(char):
-                                    fprintf(output, "    mov al,byte [rbx - %lu]\n", var.adr);
-                                    break;
-                                case sizeof(short):
-                                    fprintf(output, "    mov ax,word [rbx - %lu]\n", var.adr);
-                                    break;
-                                case sizeof(int):
-                                    fprintf(output, "    mov eax,dword [rbx - %lu]\n", var.adr);
-                                    break;
-                                case sizeof(long):
-                                    fprintf(output, "    mov rax,qword [rbx - %lu]\n", var.adr);
-                                    break;
-                                }
-                            }
-                        } else {
-                            if (!local) {
-                                fprintf(output, "    mov rax, $VAR%lu\n", var.adr);
-                            } else {
-                                fprintf(output, "    mov rbx,qword [$RETP]\n");
-                                fprintf(output, "    sub rbx,%lu\n", var.adr);
-                                fprintf(output, "    mov rax,rbx\n");
-                            }
-                        }
-                        fprintf(output, "    push rax\n");
-                    } else {
-                        fprintf(output, "    push $VAR%lu\n", var.adr);
-                    }
-                }
+            break;
+        case IR_JZ:
+        case IR_JNZ: {
+            int carry = ir_label(p, ins->arg)->carry;
+            if (carry) vs_carry(&vs, 1);
+            vs_slot_t c = vs_pop(&vs);
+            if (!carry) vs_flush(&vs);
+            char *jcc = ins->op == IR_JZ ? "jz" : "jnz";
+            if (c.kind == VS_REG || c.kind == VS_ADDR) {
+                char *t = vs_in_reg(&vs, &c, "rax");
+                out_printf(output, "    test %s,%s\n", t, t);
+                out_printf(output, "    %s $ADR%lu\n", jcc, ins->arg);
+            } else if ((c.kind == VS_CONST && c.val == 0) == (ins->op == IR_JZ)) {
+                // symbols are never 0
+                out_printf(output, "    jmp $ADR%lu\n", ins->arg);
             }
+            vs_free(&vs, &c);
         } break;
-        case OP_END_INDEX: {
-            program.index = 0;
-            proc_t p = shget(program.procs, program.cur_proc[arrlenu(program.cur_proc) - 1]);
-            var_t var = program.local_def ? shget(p.vars, program.cur_var) : shget(program.vars, program.cur_var);
-            program.local_def = 0;
-            vartype_t l = shget(program.types, var.type);
-            if (program.setting) {
-                program.setting = 0;
-                fprintf(output, ";   set array value\n");
-                fprintf(output, "    pop rax\n");
-                fprintf(output, "    pop rbx\n");
-                fprintf(output, "    mov rdx,%lu\n", l.size_bytes);
-                fprintf(output, "    mul rdx\n");
-                fprintf(output, "    lea rax,[rbx + rax]\n");
-                fprintf(output, "    pop rbx\n");
-                if (l.primitive) {
-                   switch (l.size_bytes) {
-                   case sizeof(char):
-                       fprintf(output, "    mov byte [rax],bl\n");
-                       break;
-                   case sizeof(short):
-                       fprintf(output, "    mov word [rax],bx\n");
-                       break;
-                   case sizeof(int):
-                       fprintf(output, "    mov dword [rax],ebx\n");
-                       break;
-                   case sizeof(long):
-                       fprintf(output, "    mov qword [rax],rbx\n");
-                       break;
-                   }
-                }
-            } else if (program.address) {
-                program.address = 0;
-                fprintf(output, ";   get array address\n");
-                fprintf(output, "    pop rax\n");
-                fprintf(output, "    pop rbx\n");
-                fprintf(output, "    mov rdx,%lu\n", l.size_bytes);
-                fprintf(output, "    mul rdx\n");
-                fprintf(output, "    lea rax,[rbx + rax]\n");
-                fprintf(output, "    push rax\n");
+        case IR_JMP:
+            if (ir_label(p, ins->arg)->carry) {
+                vs_carry(&vs, 0);
             } else {
-                fprintf(output, ";   get array value\n");
-                fprintf(output, "    pop rax\n");
-                fprintf(output, "    pop rbx\n");
-                fprintf(output, "    mov rdx,%lu\n", l.size_bytes);
-                fprintf(output, "    mul rdx\n");
-                fprintf(output, "    lea rax,[rbx + rax]\n");
-                if (l.primitive) {
-                   fprintf(output, "    xor rbx,rbx\n");
-                   switch (l.size_bytes) {
-                   case sizeof(char):
-                       fprintf(output, "    mov bl, byte [rax]\n");
-                       break;
-                   case sizeof(short):
-                       fprintf(output, "    mov bx, word [rax]\n");
-                       break;
-                   case sizeof(int):
-                       fprintf(output, "    mov ebx, dword [rax]\n");
-                       break;
-                   case sizeof(long):
-                       fprintf(output, "    mov rbx, qword [rax]\n");
-                       break;
-                   }
-                }
-                fprintf(output, "    push rbx\n");
+                vs_flush(&vs);
             }
-        } break;
-        case OP_CALL_PROC: {
-            fprintf(output, ";   call proc\n");
-            if (strcmp(program.tokens[idx].val, "main") == 0) {
-                fprintf(output, "    call main\n");
+            ir_emit_ins(output, p, ins);
+            vs_reset(&vs);
+            break;
+        case IR_LABEL:
+            if (!ins->carry) {
+                vs_flush(&vs);
+            } else if (i > 0 && p->code[i - 1].op != IR_JMP && p->code[i - 1].op != IR_LEAVE) {
+                vs_carry(&vs, 0);
             } else {
-                fprintf(output, "    call $PROC%lu\n", shget(program.procs, arrpop(program.cur_proc)).adr);
+                vs_reset(&vs);
+                vs_push_reg(&vs, VS_CARRY);
+                vs.refs[VS_CARRY] = 1;
             }
-        } break;
-        case OP_CREATE_PROC: {
-            program.idx++;
-            int is_main = has_main_in_files && strcmp(program.tokens[idx + 1].val, "main") == 0;
-            fprintf(output, ";   create proc\n");
-            if (is_main) {
-                fprintf(output, "global main\n");
-                fprintf(output, "main:\n");
-                fprintf(output, "    mov qword [$RETP], $RET\n");
+            ir_emit_ins(output, p, ins);
+            break;
+        default:
+            // the rest works on the real stack or ends the block
+            vs_flush(&vs);
+            ir_emit_ins(output, p, ins);
+            break;
+        }
+    }
+    vs_flush(&vs);
+}
+
+// the peephole pass rewrites a proc's assembly line by line after it's
+// emitted, it sees every line as one of these
+enum {
+    PP_INS,
+    PP_LINE,    // labels and directives, nothing is moved across them
+    PP_COMMENT,
+    PP_DEAD,
+};
+
+typedef struct {
+    int kind;
+    char op[16];
+    char a[48];
+    char b[48];
+    char *text; // the line as emitted
+    size_t len;
+    int edited; // the instruction was changed and has to be written from its parts
+    // set by pp_analyze: the register each operand is (-1 if it isn't just
+    // a register) and its size, the registers each operand mentions, and the
+    // registers the instruction reads and writes if it's 'known'
+    int ra, sa, rb, sb;
+    unsigned ma, mb;
+    int known;
+    unsigned reads;
+    unsigned writes;
+} pp_line_t;
+
+out_t pp_text;
+pp_line_t *pp_lines;
+
+char *pp_reg32[16] = {
+    "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+    "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d",
+};
+
+// the number of a register named by two letters, like the 'ax' in eax, -1
+// if there's none
+int pp_reg_pair(char *name) {
+    static char *pairs[8] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
+    for (int i = 0; i < 8; i++) {
+        if (name[0] == pairs[i][0] && name[1] == pairs[i][1]) return i;
+    }
+    return -1;
+}
+
+// the register 'word' is part of, -1 if it isn't one. this runs for every
+// word of every line so it decodes the name instead of asking asm_reg_find
+int pp_reg(char *word, int *size) {
+    size_t len = strnlen(word, 5);
+    int r = -1;
+    *size = 0;
+    if (word[0] == 'r' && word[1] >= '0' && word[1] <= '9') {
+        char *end;
+        long num = strtol(word + 1, &end, 10);
+        if (num < 8 || num > 15) return -1;
+        *size = end[0] == '\0' ? 8 : end[0] == 'd' ? 4 : end[0] == 'w' ? 2 : end[0] == 'b' ? 1 : 0;
+        if (*size == 0 || (end[0] != '\0' && end[1] != '\0')) return -1;
+        return num;
+    } else if (len == 3 && (word[0] == 'r' || word[0] == 'e')) {
+        r = pp_reg_pair(word + 1);
+        *size = word[0] == 'r' ? 8 : 4;
+    } else if (len == 3 && word[2] == 'l') {
+        r = pp_reg_pair(word);
+        *size = 1;
+        if (r < 4) r = -1;
+    } else if (len == 2 && (word[1] == 'l' || word[1] == 'h')) {
+        char name[2] = {word[0], 'x'};
+        r = pp_reg_pair(name);
+        *size = 1;
+        if (r > 3) r = -1;
+    } else if (len == 2) {
+        r = pp_reg_pair(word);
+        *size = 2;
+    }
+    if (r < 0) *size = 0;
+    return r;
+}
+
+// the registers 'opnd' mentions, as a mask of their numbers
+unsigned pp_regs(char *opnd) {
+    unsigned mask = 0;
+    char word[8];
+    for (char *c = opnd; *c != '\0';) {
+        if (*c < 'a' || *c > 'z') {
+            c++;
+            continue;
+        }
+        size_t len = 0;
+        while ((*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9')) {
+            if (len < sizeof(word) - 1) word[len++] = *c;
+            c++;
+        }
+        word[len] = '\0';
+        int size;
+        int r = pp_reg(word, &size);
+        if (r >= 0) mask |= 1u << r;
+    }
+    return mask;
+}
+
+int pp_is(pp_line_t *l, char *op) {
+    return l->kind == PP_INS && strcmp(l->op, op) == 0;
+}
+
+// what registers an instruction reads and writes (a write of a part of a
+// register also counts as a read), returns 0 for the ones it can't reason
+// about: jumps, calls, syscalls and anything that touches rsp
+int pp_effect_of(pp_line_t *l, unsigned *reads, unsigned *writes) {
+    unsigned a = l->ma;
+    unsigned b = l->mb;
+    *reads = 0;
+    *writes = 0;
+    if (l->kind != PP_INS || ((a | b) & (1u << 4))) return 0;
+    int size = l->sa;
+    int dst = l->ra;
+    char *op = l->op;
+    if (strcmp(op, "push") == 0 || strcmp(op, "cmp") == 0 || strcmp(op, "test") == 0) {
+        *reads = a | b;
+    } else if (strcmp(op, "pop") == 0 || strcmp(op, "mov") == 0 || strcmp(op, "movzx") == 0 || strcmp(op, "lea") == 0 ||
+               strncmp(op, "set", 3) == 0) {
+        if (dst < 0) {
+            *reads = a | b;
+        } else {
+            *reads = b | (size < 4 ? a : 0);
+            *writes = a;
+        }
+    } else if ((strcmp(op, "xor") == 0 || strcmp(op, "sub") == 0) && dst >= 0 && strcmp(l->a, l->b) == 0) {
+        *writes = a;
+    } else if (strcmp(op, "add") == 0 || strcmp(op, "sub") == 0 || strcmp(op, "and") == 0 ||
+               strcmp(op, "or") == 0 || strcmp(op, "xor") == 0 || strcmp(op, "sal") == 0 ||
+               strcmp(op, "sar") == 0 || strcmp(op, "shl") == 0 || strcmp(op, "shr") == 0 ||
+               strcmp(op, "imul") == 0 || strncmp(op, "cmov", 4) == 0 || strcmp(op, "inc") == 0 ||
+               strcmp(op, "dec") == 0 || strcmp(op, "neg") == 0 || strcmp(op, "not") == 0) {
+        *reads = a | b;
+        *writes = dst >= 0 ? a : 0;
+    } else if (strcmp(op, "mul") == 0 || strcmp(op, "div") == 0) {
+        *reads = a | 1u << 0 | 1u << 2;
+        *writes = 1u << 0 | 1u << 2;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// this is done once per line, the rules only look at the results
+void pp_analyze(pp_line_t *l) {
+    l->ra = pp_reg(l->a, &l->sa);
+    l->rb = pp_reg(l->b, &l->sb);
+    l->ma = pp_regs(l->a);
+    l->mb = pp_regs(l->b);
+    l->known = pp_effect_of(l, &l->reads, &l->writes);
+}
+
+void pp_edit(pp_line_t *l) {
+    l->edited = 1;
+    pp_analyze(l);
+}
+
+int pp_effect(pp_line_t *l, unsigned *reads, unsigned *writes) {
+    *reads = l->reads;
+    *writes = l->writes;
+    return l->known;
+}
+
+// the next line after 'i' that is code, 0 if there's none
+size_t pp_next(pp_line_t *lines, size_t i) {
+    for (size_t j = i + 1; j < arrlenu(lines); j++) {
+        if (lines[j].kind != PP_COMMENT && lines[j].kind != PP_DEAD) return j;
+    }
+    return 0;
+}
+
+// jumps and labels end a block, and the emitter keeps everything on the
+// stack between blocks but the value vs_carry leaves in r12, the frame base
+// in rbp, the locals in r13 and r14 and a leaf proc's return address in r15
+#define PP_PINNED (1u << 12 | 1u << 5 | 1u << 13 | 1u << 14 | 1u << 15)
+
+int pp_block_end(pp_line_t *l) {
+    if (l->kind == PP_LINE) return l->len > 1 && l->text[l->len - 2] == ':';
+    return l->kind == PP_INS && l->op[0] == 'j';
+}
+
+// if nothing after line 'i' reads 'reg' before it's written again
+int pp_dead_after(pp_line_t *lines, size_t i, int reg) {
+    unsigned reads, writes;
+    for (size_t j = i + 1; j < arrlenu(lines); j++) {
+        if (lines[j].kind == PP_COMMENT || lines[j].kind == PP_DEAD) continue;
+        if (pp_block_end(&lines[j])) return !(PP_PINNED & (1u << reg));
+        if (!pp_effect(&lines[j], &reads, &writes) || (reads & (1u << reg))) return 0;
+        if (writes & (1u << reg)) return 1;
+    }
+    return 0;
+}
+
+// the first line after 'i' in the block that touches a register of 'mask',
+// 0 if something it can't reason about comes first
+size_t pp_next_use(pp_line_t *lines, size_t i, unsigned mask) {
+    unsigned reads, writes;
+    for (size_t j = pp_next(lines, i); j != 0; j = pp_next(lines, j)) {
+        if (!pp_effect(&lines[j], &reads, &writes)) return 0;
+        if ((reads | writes) & mask) return j;
+    }
+    return 0;
+}
+
+int pp_word_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '$';
+}
+
+// replaces the register 'from' in 'opnd' by 'to', they're both full registers
+void pp_rename(char *opnd, char *from, char *to) {
+    char buf[sizeof(((pp_line_t*)0)->a)];
+    size_t len = 0, from_len = strlen(from), to_len = strlen(to);
+    for (char *c = opnd; *c != '\0';) {
+        int word = (c == opnd || !pp_word_char(c[-1])) && strncmp(c, from, from_len) == 0 && !pp_word_char(c[from_len]);
+        if (word && len + to_len < sizeof(buf)) {
+            memcpy(buf + len, to, to_len);
+            len += to_len;
+            c += from_len;
+        } else if (len + 1 < sizeof(buf)) {
+            buf[len++] = *c++;
+        } else {
+            return;
+        }
+    }
+    buf[len] = '\0';
+    strcpy(opnd, buf);
+}
+
+int pp_imm32(char *opnd) {
+    if (opnd[0] == '$') return strchr(opnd, '[') == NULL;
+    if (opnd[0] < '0' || opnd[0] > '9') return 0;
+    char *end;
+    unsigned long v = strtoul(opnd, &end, 0);
+    return *end == '\0' && v <= 0x7fffffff;
+}
+
+// push x ... pop y -> mov y,x, when the instructions in between don't touch
+// y and the stack
+int pp_push_pop(pp_line_t *lines, size_t i) {
+    unsigned between = 0, reads, writes;
+    for (size_t j = pp_next(lines, i); j != 0; j = pp_next(lines, j)) {
+        if (pp_is(&lines[j], "pop")) {
+            int y = lines[j].ra;
+            if (y < 0 || y == 4 || (between & (1u << y)) || (lines[i].ma & (1u << 4))) return 0;
+            if (strcmp(lines[i].a, lines[j].a) == 0) {
+                lines[i].kind = PP_DEAD;
             } else {
-                fprintf(output, "global $PROC%lu\n", shget(program.procs, program.cur_proc[arrlen(program.cur_proc) - 1]).adr);
-                fprintf(output, "$PROC%lu:\n", shget(program.procs, program.cur_proc[arrlen(program.cur_proc) - 1]).adr);
+                strcpy(lines[i].op, "mov");
+                strcpy(lines[i].b, lines[i].a);
+                strcpy(lines[i].a, lines[j].a);
+                pp_edit(&lines[i]);
             }
-            fprintf(output, "    mov rax,qword [$RETP]\n");
-            fprintf(output, "    pop qword [rax]\n");
-            fprintf(output, "    add qword [$RETP],8\n");
-        } break;
-        case OP_DO: {
-            fprintf(output, ";   do\n");
-            fprintf(output, "    pop rax\n");
-            fprintf(output, "    test rax,rax\n");
-            fprintf(output, "    jz $ADR%lu\n", program.tokens[idx].jmp);
-        } break;
-        case OP_ELSE: {
-            fprintf(output, ";   else\n");
-            fprintf(output, "    jmp $ADR%lu\n", program.tokens[idx].jmp);
-            fprintf(output, "$ADR%lu:\n", program.idx);
-        } break;
-        case OP_LOOP: {
-            fprintf(output, ";   loop\n");
-            fprintf(output, "$ADR%lu:\n", program.idx);
-        } break;
-        case OP_IMPORT: {
-            program.idx++;
-            fprintf(output, ";   import\n");
-            size_t *export = shget(program.exports, program.tokens[program.idx].val);
-            for (size_t i = 1; i < arrlenu(export); i++) {
-                fprintf(output, "extern $PROC%lu\n", export[i]);
+            lines[j].kind = PP_DEAD;
+            return 1;
+        }
+        if (pp_is(&lines[j], "push") || !pp_effect(&lines[j], &reads, &writes)) return 0;
+        between |= reads | writes;
+    }
+    return 0;
+}
+
+// mov r,imm / push r -> push imm, when r isn't read again
+int pp_push_imm(pp_line_t *lines, size_t i) {
+    int r = lines[i].ra;
+    size_t j = pp_next(lines, i);
+    if (r < 0 || lines[i].sa != 8 || j == 0 || !pp_is(&lines[j], "push") || strcmp(lines[j].a, lines[i].a) != 0) return 0;
+    if (!pp_imm32(lines[i].b) || !pp_dead_after(lines, j, r)) return 0;
+    strcpy(lines[j].a, lines[i].b);
+    pp_edit(&lines[j]);
+    lines[i].kind = PP_DEAD;
+    return 1;
+}
+
+// mov r,imm ... op x,r -> op x,imm, when r isn't read again
+int pp_fold_imm(pp_line_t *lines, size_t i) {
+    int r = lines[i].ra;
+    if (r < 0 || lines[i].sa != 8 || lines[i].b[0] == '$' || !pp_imm32(lines[i].b)) return 0;
+    size_t j = pp_next_use(lines, i, 1u << r);
+    if (j == 0 || strcmp(lines[j].b, lines[i].a) != 0 || (lines[j].ma & (1u << r))) return 0;
+    char *op = lines[j].op;
+    if (strcmp(op, "mov") != 0 && strcmp(op, "add") != 0 && strcmp(op, "sub") != 0 && strcmp(op, "and") != 0 &&
+        strcmp(op, "or") != 0 && strcmp(op, "xor") != 0 && strcmp(op, "cmp") != 0) return 0;
+    // the immediate needs the size the register gave the instruction
+    if ((lines[j].ra < 0 && strncmp(lines[j].a, "qword", 5) != 0) || (lines[j].ra >= 0 && lines[j].sa != 8)) return 0;
+    if (!pp_dead_after(lines, j, r)) return 0;
+    strcpy(lines[j].b, lines[i].b);
+    pp_edit(&lines[j]);
+    lines[i].kind = PP_DEAD;
+    return 1;
+}
+
+// mov r,s ... op x,r -> op x,s, when r isn't read again and s isn't
+// written in between
+int pp_copy(pp_line_t *lines, size_t i) {
+    int r = lines[i].ra;
+    int s = lines[i].rb;
+    if (r < 0 || s < 0 || lines[i].sa != 8 || lines[i].sb != 8 || r == s) return 0;
+    size_t j = pp_next_use(lines, i, 1u << r | 1u << s);
+    unsigned reads, writes;
+    if (j == 0 || !pp_effect(&lines[j], &reads, &writes) || (writes & (1u << r | 1u << s))) return 0;
+    if (!(reads & (1u << r)) || strcmp(lines[j].op, "mul") == 0 || strcmp(lines[j].op, "div") == 0) return 0;
+    if (!pp_dead_after(lines, j, r)) return 0;
+    char a[sizeof(lines[j].a)], b[sizeof(lines[j].b)];
+    strcpy(a, lines[j].a);
+    strcpy(b, lines[j].b);
+    pp_rename(a, lines[i].a, lines[i].b);
+    pp_rename(b, lines[i].a, lines[i].b);
+    // a part of r is used, like al
+    if ((pp_regs(a) | pp_regs(b)) & (1u << r)) return 0;
+    strcpy(lines[j].a, a);
+    strcpy(lines[j].b, b);
+    pp_edit(&lines[j]);
+    lines[i].kind = PP_DEAD;
+    return 1;
+}
+
+// xor r,r ... mov rl,byte [m] -> movzx r32,byte [m]
+int pp_movzx(pp_line_t *lines, size_t i) {
+    int r = lines[i].ra;
+    if (r < 0 || lines[i].sa != 8 || strcmp(lines[i].a, lines[i].b) != 0) return 0;
+    unsigned reads, writes;
+    for (size_t j = pp_next(lines, i); j != 0; j = pp_next(lines, j)) {
+        if (!pp_effect(&lines[j], &reads, &writes)) return 0;
+        if (!((reads | writes) & (1u << r))) {
+            if (!pp_is(&lines[j], "mov") && !pp_is(&lines[j], "lea")) return 0;
+            continue;
+        }
+        if (!pp_is(&lines[j], "mov") || lines[j].ra != r || strchr(lines[j].b, '[') == NULL || (lines[j].mb & (1u << r))) return 0;
+        // xor also cleared the flags
+        size_t next = pp_next(lines, j);
+        if (next != 0 && lines[next].kind == PP_INS && (strncmp(lines[next].op, "set", 3) == 0 || strncmp(lines[next].op, "cmov", 4) == 0 ||
+            (lines[next].op[0] == 'j' && strcmp(lines[next].op, "jmp") != 0))) return 0;
+        if (lines[j].sa < 4) {
+            strcpy(lines[j].op, "movzx");
+            strcpy(lines[j].a, pp_reg32[r]);
+            pp_edit(&lines[j]);
+        }
+        lines[i].kind = PP_DEAD;
+        return 1;
+    }
+    return 0;
+}
+
+void pp_split(char *line, size_t len, pp_line_t *l) {
+    l->text = line;
+    l->len = len;
+    l->edited = 0;
+    l->known = 0;
+    l->kind = PP_LINE;
+    if (line[0] == ';') {
+        l->kind = PP_COMMENT;
+    }
+    if (len < 5 || strncmp(line, "    ", 4) != 0) return;
+    char *c = line + 4;
+    char *end = line + len - 1;
+    size_t op = 0;
+    while (c < end && *c != ' ' && op < sizeof(l->op) - 1) l->op[op++] = *c++;
+    l->op[op] = '\0';
+    while (c < end && *c == ' ') c++;
+    char *comma = memchr(c, ',', end - c);
+    char *a_end = comma != NULL ? comma : end;
+    char *b = comma != NULL ? comma + 1 : end;
+    while (b < end && *b == ' ') b++;
+    if ((size_t)(a_end - c) >= sizeof(l->a) || (size_t)(end - b) >= sizeof(l->b)) return;
+    memcpy(l->a, c, a_end - c);
+    l->a[a_end - c] = '\0';
+    memcpy(l->b, b, end - b);
+    l->b[end - b] = '\0';
+    l->kind = PP_INS;
+    pp_analyze(l);
+}
+
+// rewrites the proc's assembly in 'text' into 'output'
+void peephole(out_t *text, out_t *output) {
+    arrsetlen(pp_lines, 0);
+    for (size_t i = 0; i < text->len;) {
+        char *nl = memchr(text->data + i, '\n', text->len - i);
+        size_t len = nl - (text->data + i) + 1;
+        pp_split(text->data + i, len, arraddnptr(pp_lines, 1));
+        i += len;
+    }
+    // a rewrite can open up another one a few lines up, so after each the
+    // rules are tried again from the line before
+    for (size_t i = 0; i < arrlenu(pp_lines); i++) {
+        int changed = 0;
+        if (pp_is(&pp_lines[i], "push")) {
+            changed = pp_push_pop(pp_lines, i);
+        } else if (pp_is(&pp_lines[i], "mov")) {
+            changed = pp_push_imm(pp_lines, i) || pp_fold_imm(pp_lines, i) || pp_copy(pp_lines, i);
+        } else if (pp_is(&pp_lines[i], "xor")) {
+            changed = pp_movzx(pp_lines, i);
+        }
+        if (changed) {
+            for (int back = 0; back < 2 && i > 0; back++) {
+                do i--; while (i > 0 && pp_lines[i].kind != PP_INS);
             }
-        } break;
-        case OP_END: {
-            if (program.condition) {
-                program.condition = 0;
-                fprintf(output, ";   end\n");
-                if (program.loop) {
-                    program.loop = 0;
-                    fprintf(output, "    jmp $ADR%lu\n", program.tokens[idx].jmp);
-                }
-                fprintf(output, "$ADR%lu:\n", program.idx);
-            } else if (program.setting) {
-                var_t var;
-                int local = 0;
-                if (program.local_def) {
-                    program.local_def = 0;
-                    local = 1;
-                    proc_t p = shget(program.procs, program.cur_proc[arrlenu(program.cur_proc) - 1]);
-                    var = shget(p.vars, program.cur_var);
-                    fprintf(output, ";   create local varible\n");
-                    if (!var.arr) {
-                        fprintf(output, "    add qword [$RETP],%lu\n", shget(program.types, var.type).size_bytes);
-                    } else {
-                        fprintf(output, "    add qword [$RETP],%lu\n", shget(program.types, var.type).size_bytes * var.cap);
-                    }
-                } else if (program.global_def) {
-                    var = shget(program.vars, program.cur_var);
-                }
-                vartype_t l = shget(program.types, var.type);
-                program.setting=0;
-                if (!var.arr) {
-                    fprintf(output, ";   set var value\n");
-                    fprintf(output, "    pop rax\n");
-                    if (l.primitive) {
-                        if (!local) {
-                            switch (l.size_bytes) {
-                            case sizeof(char):
-                                fprintf(output, "    mov byte [$VAR%lu],al\n", var.adr);
-                                break;
-                            case sizeof(short):
-                                fprintf(output, "    mov word [$VAR%lu],ax\n", var.adr);
-                                break;
-                            case sizeof(int):
-                                fprintf(output, "    mov dword [$VAR%lu],eax\n", var.adr);
-                                break;
-                            case sizeof(long):
-                                fprintf(output, "    mov qword [$VAR%lu],rax\n", var.adr);
-                                break;
-                            }
-                        } else {
-                            fprintf(output, "    mov rbx,qword [$RETP]\n");
-                            switch (l.size_bytes) {
-                            case sizeof(char):
-                                fprintf(output, "    mov byte [rbx - %lu],al\n", var.adr);
-                                break;
-                            case sizeof(short):
-                                fprintf(output, "    mov word [rbx - %lu],ax\n", var.adr);
-                                break;
-                            case sizeof(int):
-                                fprintf(output, "    mov dword [rbx - %lu],eax\n", var.adr);
-                                break;
-                            case sizeof(long):
-                                fprintf(output, "    mov qword [rbx - %lu],rax\n", var.adr);
-                                break;
-                            }
-                        }
-                    }
-                } else {
-                    fprintf(output, ";   set array value\n");
-                    fprintf(output, "    mov rcx,%lu\n", var.cap - 1);
-                    fprintf(output, "$ADR%lu:\n", program.idx);
-                    fprintf(output, "    mov rax,rcx\n");
-                    fprintf(output, "    mov rdx,%lu\n", l.size_bytes);
-                    fprintf(output, "    mul rdx\n");
-                    if (!local) {
-                        fprintf(output, "    lea rax,[$VAR%lu + rax]\n", var.adr);
-                    } else {
-                        // TODO: maybe a bug
-                        fprintf(output, "    mov rdx,qword [RETP]\n");
-                        fprintf(output, "    sub rdx,%lu\n", var.adr);
-                        fprintf(output, "    lea rax,[rdx + rax]\n");
-                    }
-                    fprintf(output, "    pop rbx\n");
-                    if (l.primitive) {
-                       switch (l.size_bytes) {
-                       case sizeof(char):
-                           fprintf(output, "    mov byte [rax],bl\n");
-                           break;
-                       case sizeof(short):
-                           fprintf(output, "    mov word [rax],bx\n");
-                           break;
-                       case sizeof(int):
-                           fprintf(output, "    mov dword [rax],ebx\n");
-                           break;
-                       case sizeof(long):
-                           fprintf(output, "    mov qword [rax],rbx\n");
-                           break;
-                       }
-                    }
-                    fprintf(output, "    dec rcx\n");
-                    fprintf(output, "    cmp rcx,0\n");
-                    fprintf(output, "    jge $ADR%lu\n", program.idx);
-                }
-            } else if (program.global_def) {
-                program.global_def = 0;
-            } else if (program.local_def) {
-                program.local_def = 0;
-                proc_t p = shget(program.procs, program.cur_proc[arrlenu(program.cur_proc) - 1]);
-                var_t var = shget(p.vars, program.cur_var);
-                fprintf(output, ";   create local varible\n");
-                if (!var.arr) {
-                    fprintf(output, "    add qword [$RETP],%lu\n", shget(program.types, var.type).size_bytes);
-                } else {
-                    fprintf(output, "    add qword [$RETP],%lu\n", shget(program.types, var.type).size_bytes * var.cap);
-                }
-            } else if (arrlen(program.cur_proc) != 0) {
-                proc_t *proc = &(shgetp_null(program.procs, arrpop(program.cur_proc))->value);
-                for (size_t i = 0; i < arrlenu(proc->vars); i++) {
-                    free(proc->vars[i].value.name);
-                }
-                fprintf(output, ";   end proc\n");
-                fprintf(output, "    sub qword [$RETP],%lu\n", proc->local_var_capacity + 8);
-                fprintf(output, "    mov rax,qword [$RETP]\n");
-                fprintf(output, "    push qword [rax]\n");
-                if (strcmp(proc->name, "main") == 0) {
-                    fprintf(output, "    xor rax,rax\n");
+            i--;
+        }
+    }
+    for (size_t i = 0; i < arrlenu(pp_lines); i++) {
+        pp_line_t *l = &pp_lines[i];
+        if (l->kind == PP_DEAD) continue;
+        if (!l->edited) {
+            out_write(output, l->text, l->len);
+            continue;
+        }
+        out_write(output, "    ", 4);
+        out_write(output, l->op, strlen(l->op));
+        if (l->a[0] != '\0') {
+            out_write(output, " ", 1);
+            out_write(output, l->a, strlen(l->a));
+        }
+        if (l->b[0] != '\0') {
+            out_write(output, ",", 1);
+            out_write(output, l->b, strlen(l->b));
+        }
+        out_write(output, "\n", 1);
+    }
+}
+
+// the value of a const var, zero extended from its type
+unsigned long var_const_value(var_t *var) {
+    switch (var->type->size_bytes) {
+    case sizeof(char):  return var->const_val.b8;
+    case sizeof(short): return var->const_val.b16;
+    case sizeof(int):   return var->const_val.b32;
+    default:            return var->const_val.b64;
+    }
+}
+
+// ends the proc: runs the passes on its IR and writes its assembly
+// a proc without locals that calls nothing can keep its return address in
+// r15 instead of moving it to $RET, nothing runs that could clobber it
+int ir_is_leaf(ir_proc_t *p) {
+    proc_t *proc = &program.procs[p->adr].value;
+    if (p->main || proc->local_var_capacity != 0 || proc->in < 0) return 0;
+    for (size_t i = 0; i < arrlenu(p->code); i++) {
+        if (p->code[i].op == IR_CALL || p->code[i].op == IR_CALL_MAIN) return 0;
+    }
+    return 1;
+}
+
+void ir_finish_proc(ir_proc_t *p, out_t *output) {
+    ir_optimize(p);
+    p->leaf = ir_is_leaf(p);
+    if (program.opt == 0) {
+        ir_emit_x86_64(output, p);
+    } else {
+        pp_text.len = 0;
+        ir_emit_vstack_x86_64(&pp_text, p);
+        double start = now();
+        peephole(&pp_text, output);
+        report_phase(PHASE_OPT, start);
+    }
+    arrsetlen(p->code, 0);
+}
+
+// turns the token parse_current_token just checked into IR, what's outside
+// of procs (imports) goes straight to 'output'
+void ir_lower_token(ir_proc_t *p, out_t *output) {
+    size_t idx = program.idx;
+    token_t *tokens = program.tokens;
+    switch (tokens[idx].operation) {
+    case OP_PUSH_INT:
+        ir_add(p, IR_PUSH, strtoul(tokens[idx].val, NULL, 10));
+        break;
+    case OP_PUSH_STR:
+        ir_add(p, IR_PUSH, tokens[idx].ref.str->len);
+        ir_add(p, IR_PUSH_STR, tokens[idx].jmp);
+        break;
+    case OP_PLUS:      ir_add(p, IR_ADD, 0);    break;
+    case OP_MINUS:     ir_add(p, IR_SUB, 0);    break;
+    case OP_MUL:       ir_add(p, IR_MUL, 0);    break;
+    case OP_DIV:       ir_add(p, IR_DIV, 0);    break;
+    case OP_MOD:       ir_add(p, IR_MOD, 0);    break;
+    case OP_SHR:       ir_add(p, IR_SHR, 0);    break;
+    case OP_SHL:       ir_add(p, IR_SHL, 0);    break;
+    case OP_BAND:      ir_add(p, IR_AND, 0);    break;
+    case OP_BOR:       ir_add(p, IR_OR, 0);     break;
+    case OP_BNOT:      ir_add(p, IR_BNOT, 0);   break;
+    case OP_XOR:       ir_add(p, IR_XOR, 0);    break;
+    case OP_EQUALS:    ir_add(p, IR_EQ, 0);     break;
+    case OP_NOTEQUALS: ir_add(p, IR_NE, 0);     break;
+    case OP_GREATER:   ir_add(p, IR_GT, 0);     break;
+    case OP_MINOR:     ir_add(p, IR_LT, 0);     break;
+    case OP_EQGREATER: ir_add(p, IR_GE, 0);     break;
+    case OP_EQMINOR:   ir_add(p, IR_LE, 0);     break;
+    case OP_DUP:       ir_add(p, IR_DUP, 0);    break;
+    case OP_SWAP:      ir_add(p, IR_SWAP, 0);   break;
+    case OP_ROT:       ir_add(p, IR_ROT, 0);    break;
+    case OP_OVER:      ir_add(p, IR_OVER, 0);   break;
+    case OP_DROP:      ir_add(p, IR_DROP, 0);   break;
+    case OP_PRINT:     ir_add(p, IR_PRINT, 0);  break;
+    case OP_MEMORY:    ir_add(p, IR_MALLOC, 0); break;
+    case OP_DELETE:    ir_add(p, IR_FREE, 0);   break;
+    case OP_SYSCALL0:
+    case OP_SYSCALL1:
+    case OP_SYSCALL2:
+    case OP_SYSCALL3:
+    case OP_SYSCALL4:
+    case OP_SYSCALL5:
+    case OP_SYSCALL6:
+        ir_add(p, IR_SYSCALL, tokens[idx].operation - OP_SYSCALL0);
+        break;
+    case OP_STORE:
+    case OP_FETCH:
+        ir_add(p, tokens[idx].operation == OP_STORE ? IR_STORE : IR_LOAD, 0)->size = tokens[idx].ref.vartype->size_bytes;
+        program.idx++;
+        break;
+    case OP_SIZEOF:
+        ir_add(p, IR_PUSH, tokens[idx].ref.vartype->size_bytes);
+        program.idx++;
+        break;
+    case OP_CAP:
+        // the array's address is already on the stack
+        ir_add(p, IR_DROP, 0);
+        ir_add(p, IR_PUSH, tokens[idx].ref.var->cap);
+        break;
+    case OP_CALL_VAR: {
+        var_t *var = tokens[idx].ref.var;
+        int indexed = tokens[idx + 1].operation == OP_START_INDEX;
+        // TODO: for now 'set var' and 'get var' just supports primitive types
+        if (program.setting && !var->arr && !program.index) {
+            program.setting = 0;
+            ir_add_var(p, IR_SET, var);
+        } else if (program.address && !program.index && !indexed) {
+            program.address = 0;
+            ir_add_var(p, IR_ADR, var);
+        } else if (program.size_of && !program.index) {
+            program.size_of = 0;
+            if (!var->arr || indexed) {
+                ir_add(p, IR_PUSH, var->type->size_bytes);
+                if (indexed) {
+                    program.size_of = 1;
                 }
-                fprintf(output, "    ret\n");
+            } else {
+                ir_add(p, IR_PUSH, var->type->size_bytes * var->cap);
             }
-        } break;
-        default:
-            break;
+        } else if (var->type->primitive) {
+            if (var->constant) {
+                ir_add(p, IR_PUSH, var_const_value(var));
+            } else if (var->arr) {
+                ir_add_var(p, IR_ADR, var);
+            } else {
+                ir_add_var(p, IR_GET, var);
+            }
+        }
+    } break;
+    case OP_END_INDEX: {
+        program.index = 0;
+        program.local_def = 0;
+        int op = IR_INDEX_GET;
+        if (program.setting) {
+            program.setting = 0;
+            op = IR_INDEX_SET;
+        } else if (program.address) {
+            program.address = 0;
+            op = IR_INDEX_ADR;
+        }
+        ir_add(p, op, 0)->size = tokens[idx].ref.var->type->size_bytes;
+    } break;
+    case OP_CALL_PROC:
+        if (strcmp(tokens[idx].val, "main") == 0) {
+            ir_add(p, IR_CALL_MAIN, 0);
+        } else {
+            ir_add(p, IR_CALL, tokens[idx].ref.proc->adr);
+        }
+        break;
+    case OP_CREATE_PROC:
+        program.idx++;
+        // anything left over came from outside of a proc, where no code runs
+        arrsetlen(p->code, 0);
+        p->adr = tokens[idx].ref.proc->adr;
+        p->name = tokens[idx].ref.proc->name;
+        p->main = has_main_in_files && strcmp(p->name, "main") == 0;
+        p->reg_locals = 0;
+        ir_add(p, IR_ENTER, 0);
+        break;
+    case OP_DO:
+        ir_add(p, IR_JZ, tokens[idx].jmp);
+        break;
+    case OP_ELSE:
+        ir_add(p, IR_JMP, tokens[idx].jmp);
+        ir_add(p, IR_LABEL, program.idx);
+        break;
+    case OP_LOOP:
+        ir_add(p, IR_LABEL, program.idx);
+        break;
+    case OP_IMPORT: {
+        program.idx++;
+        out_comment(output, ";   import\n");
+        size_t *export = tokens[idx].ref.export;
+        for (size_t i = 1; i < arrlenu(export); i++) {
+            out_printf(output, "extern $PROC%lu\n", export[i]);
+        }
+    } break;
+    case OP_END:
+        if (program.condition) {
+            program.condition = 0;
+            if (program.loop) {
+                program.loop = 0;
+                ir_add(p, IR_JMP, tokens[idx].jmp);
+            }
+            ir_add(p, IR_LABEL, program.idx);
+        } else if (program.setting) {
+            var_t *var = tokens[idx].ref.var;
+            program.local_def = 0;
+            program.setting = 0;
+            if (!var->arr) {
+                ir_add_var(p, IR_SET, var);
+            } else {
+                ir_t *fill = ir_add_var(p, IR_FILL, var);
+                fill->cap = var->cap;
+                fill->label = program.idx;
+            }
+        } else if (program.global_def) {
+            program.global_def = 0;
+        } else if (program.local_def) {
+            // the frame already has room for it, see IR_ENTER
+            program.local_def = 0;
+        } else if (arrlen(program.cur_proc) != 0) {
+            (void) arrpop(program.cur_proc);
+            ir_add(p, IR_LEAVE, tokens[idx].ref.proc->local_var_capacity);
+            ir_finish_proc(p, output);
         }
+        break;
+    default:
+        break;
+    }
+}
+
+void generate_assembly_x86_64_linux() {
+    double codegen_start = now();
+    char asmfile[32];
+    sprintf(asmfile, "file%lu.asm", program.file_num);
+    out_t text = {0};
+    out_t *output = &text;
+    out_printf(output, "BITS 64\n");
+    out_printf(output, "segment .text\n");
+    if (program.has_malloc) {
+        out_printf(output, "extern malloc, free\n");
+    }
+    out_printf(output, "_print:\n");
+    out_printf(output, "    sub rsp,32\n");
+    out_printf(output, "    mov rsi,rsp\n");
+    out_printf(output, "    mov r9,1\n");
+    out_printf(output, "    add rsi,31\n");
+    out_printf(output, "    mov byte [rsi],0xa\n");
+    out_printf(output, "    cmp rax,0\n");
+    out_printf(output, "    je _IF0printJMP\n");
+    out_printf(output, "_LOOPprintJMP:\n");
+    // n / 10 as a multiply-high, the remainder is n - q * 10
+    out_printf(output, "    mov rcx,rax\n");
+    out_printf(output, "    mov rdx,0xcccccccccccccccd\n");
+    out_printf(output, "    mul rdx\n");
+    out_printf(output, "    shr rdx,3\n");
+    out_printf(output, "    mov rax,rdx\n");
+    out_printf(output, "    lea rdx,[rdx+rdx*4]\n");
+    out_printf(output, "    add rdx,rdx\n");
+    out_printf(output, "    sub rcx,rdx\n");
+    out_printf(output, "    dec rsi\n");
+    out_printf(output, "    inc r9\n");
+    out_printf(output, "    add rcx,'0'\n");
+    out_printf(output, "    mov [rsi],cl\n");
+    out_printf(output, "    cmp rax,0\n");
+    out_printf(output, "    jne _LOOPprintJMP ; loop\n");
+    out_printf(output, "    jmp _printENDjmp\n");
+    out_printf(output, "_IF0printJMP:\n");
+    out_printf(output, "    dec rsi\n");
+    out_printf(output, "    inc r9\n");
+    out_printf(output, "    mov rdx,'0'\n");
+    out_printf(output, "    mov [rsi],dl\n");
+    out_printf(output, "_printENDjmp:\n");
+    out_printf(output, "    mov rax,1\n");
+    out_printf(output, "    mov rdi,1\n");
+    out_printf(output, "    mov rdx,r9\n");
+    out_printf(output, "    syscall\n");
+    out_printf(output, "    add rsp,32\n");
+    out_printf(output, "    ret\n");
+
+    if (program.file_num > 1) {
+        out_printf(output, "extern $RET, $RETP\n");
+    }
+    ir_proc_t proc = {0};
+    while (parse_next_token()) {
+        ir_lower_token(&proc, output);
         program.idx++;
     }
+    arrfree(proc.code);
+    arrfree(proc.blocks);
+    hmfree(proc.labels);
     if (program.error) {
         exit(1);
     }
-    fprintf(output, "segment .bss\n");
-    for (size_t i = 0; i < shlen(program.vars); i++) {
+    out_printf(output, "segment .bss\n");
+    for (size_t i = 0; i < hmlen(program.vars); i++) {
         if (program.vars[i].value.constant) continue;
-        vartype_t l = shget(program.types, program.vars[i].value.type);
+        vartype_t l = *program.vars[i].value.type;
         size_t alloc = program.vars[i].value.cap;
         if (l.primitive) {
             switch (l.size_bytes) {
             case sizeof(char):
-                fprintf(output, "$VAR%lu: resb %lu\n", program.vars[i].value.adr, alloc);
+                out_printf(output, "$VAR%lu: resb %lu\n", program.vars[i].value.adr, alloc);
                 break;
             case sizeof(short):
-                fprintf(output, "$VAR%lu: resw %lu\n", program.vars[i].value.adr, alloc);
+                out_printf(output, "$VAR%lu: resw %lu\n", program.vars[i].value.adr, alloc);
                 break;
             case sizeof(int):
-                fprintf(output, "$VAR%lu: resd %lu\n", program.vars[i].value.adr, alloc);
+                out_printf(output, "$VAR%lu: resd %lu\n", program.vars[i].value.adr, alloc);
                 break;
             case sizeof(long):
-                fprintf(output, "$VAR%lu: resq %lu\n", program.vars[i].value.adr, alloc);
+                out_printf(output, "$VAR%lu: resq %lu\n", program.vars[i].value.adr, alloc);
                 break;
             default:
                 break;
@@ -2510,41 +5403,43 @@ void generate_assembly_x86_64_linux() {
         }
     }
     if (program.file_num == 0) {
-        fprintf(output, "global $RET, $RETP\n");
-        fprintf(output, "$RET: resb %u\n", RET_STACK_CAP);
-        fprintf(output, "$RETP: resq 1\n");
+        out_printf(output, "global $RET, $RETP\n");
+        out_printf(output, "$RET: resb %u\n", RET_STACK_CAP);
+        out_printf(output, "$RETP: resq 1\n");
     } else {
-        fprintf(output, "extern $RET, $RETP\n");
+        out_printf(output, "extern $RET, $RETP\n");
     }
-    fprintf(output, "segment .data\n");
-    for (size_t i = 0; i < shlenu(program.strs); i++) {
+    out_printf(output, "segment .data\n");
+    for (size_t i = 0; i < hmlenu(program.strs); i++) {
         str_t str = program.strs[i].value;
-        fprintf(output, "$STR%lu: db ", str.adr);
+        out_printf(output, "$STR%lu: db ", str.adr);
+        // an empty string still needs a byte for its label, and its line ended
+        if (str.len == 0) out_printf(output, "0\n");
         for (size_t i = 0; i < str.len; i++) {
-            fprintf(output, "0x%x", str.str[i]);
+            out_printf(output, "0x%x", str.str[i]);
             if (i < str.len - 1) {
-                fprintf(output, ",");
+                out_printf(output, ",");
             } else {
-                fprintf(output, "\n");
+                out_printf(output, "\n");
             }
         }
     }
-    for (size_t i = 0; i < shlen(program.vars); i++) {
+    for (size_t i = 0; i < hmlen(program.vars); i++) {
         if (!program.vars[i].value.constant) continue;
-        vartype_t l = shget(program.types, program.vars[i].value.type);
+        vartype_t l = *program.vars[i].value.type;
         if (l.primitive) {
             switch (l.size_bytes) {
             case sizeof(char):
-                fprintf(output, "$VAR%lu: equ %d\n", program.vars[i].value.adr, program.vars[i].value.const_val.b8);
+                out_printf(output, "$VAR%lu: equ %d\n", program.vars[i].value.adr, program.vars[i].value.const_val.b8);
                 break;
             case sizeof(short):
-                fprintf(output, "$VAR%lu: equ %d\n", program.vars[i].value.adr, program.vars[i].value.const_val.b16);
+                out_printf(output, "$VAR%lu: equ %d\n", program.vars[i].value.adr, program.vars[i].value.const_val.b16);
                 break;
             case sizeof(int):
-                fprintf(output, "$VAR%lu: equ %u\n", program.vars[i].value.adr, program.vars[i].value.const_val.b32);
+                out_printf(output, "$VAR%lu: equ %u\n", program.vars[i].value.adr, program.vars[i].value.const_val.b32);
                 break;
             case sizeof(long):
-                fprintf(output, "$VAR%lu: equ %lu\n", program.vars[i].value.adr, program.vars[i].value.const_val.b64);
+                out_printf(output, "$VAR%lu: equ %lu\n", program.vars[i].value.adr, program.vars[i].value.const_val.b64);
                 break;
             default:
                 break;
@@ -2553,79 +5448,180 @@ void generate_assembly_x86_64_linux() {
     }
 
 
-    fclose(output);
-    char *cmd = malloc(sizeof(char) * 104);
-    sprintf(cmd,"nasm -felf64 -g file%lu.asm -o file%lu.o", program.file_num, program.file_num); 
-    system(cmd);
-    free(cmd);
+    if (program.nasm || program.emit_asm) {
+        FILE *f = fopen(asmfile, "w");
+        if (f == NULL) {
+            fprintf(stderr, "[ERROR] Failed to create %s\n", asmfile);
+            exit(1);
+        }
+        fwrite(text.data, 1, text.len, f);
+        fclose(f);
+    }
+    if (program.time_report) {
+        report_t *r = &program.reports[program.file_num];
+        r->time[PHASE_CODEGEN] += now() - codegen_start - r->time[PHASE_PARSE] - r->time[PHASE_OPT];
+    }
+    if (program.nasm) {
+        free(text.data);
+        assemble(program.file_num);
+        return;
+    }
+    char objfile[32];
+    sprintf(objfile, "file%lu.o", program.file_num);
+    double assemble_start = now();
+    asm_assemble_job(program.file_num, text.data, text.len, asmfile, objfile);
+    report_phase(PHASE_ASSEMBLE, assemble_start);
+    free(text.data);
 }
 
 void file_close() {
     arrfree(program.cur_proc);
-    for (size_t i = 0; i < shlenu(program.types); i++) {
-        free(program.types[i].value.name);
-    }
-    for (size_t i = 0; i < shlenu(program.vars); i++) {
-        free(program.vars[i].value.name);
-    }
-    shfree(program.types);
-    shfree(program.vars);
-    shfree(program.strs);
+    hmfree(program.types);
+    hmfree(program.vars);
+    hmfree(program.strs);
     arrfree(program.imports);
 }
 
 void program_init() {
+    keyword_table_init();
     program.procs = NULL;
     program.exports = NULL;
     program.tokens = NULL;
     program.positions = NULL;
     program.file_path = NULL;
+    program.interned = NULL;
+    sh_new_arena(program.interned);
+    program.jobs = 1;
+    program.running = 0;
+    program.cache = 1;
+    program.cache_keys = NULL;
+    program.nasm = 0;
+    program.emit_asm = 0;
+    program.opt = 1;
+    program.time_report = 0;
+    program.reports = NULL;
+    program.children = NULL;
+    program.start_time = now();
 }
 
 void program_generate_obj_files(int argc, char **argv, char *std, char *file, char *link) {
     strcpy(link, "gcc -no-pie -o output");
+    if (program.cache) {
+        cache_open();
+    }
     for (size_t i = 0; i < argc; i++) {
-        file_open(i, i == 0 ? std : argv[i], arrlenu(program.tokens));
-        generate_assembly_x86_64_linux();
-        file_close();
+        char *path = i == 0 ? std : argv[i];
+        arrput(program.reports, ((report_t){.file = path}));
+        program.file_num = i;
+        double cache_start = now();
+        // --emit-asm wants the text of every file, so it never takes a hit
+        unsigned long key = program.cache && !program.emit_asm ? cache_key(i, path) : 0;
         sprintf(file, " file%lu.o", i);
         strcat(link, file);
+        if (key != 0 && cache_load(i, path, key)) {
+            report_phase(PHASE_CACHE, cache_start);
+            program.reports[i].cached = 1;
+            program.reports[i].peak_rss_kb = peak_rss_kb();
+            arrput(program.cache_keys, 0);
+            continue;
+        }
+        report_phase(PHASE_CACHE, cache_start);
+        size_t start = arrlenu(program.tokens);
+        file_open(i, path, start);
+        program.reports[i].tokens = arrlenu(program.tokens) - start;
+        generate_assembly_x86_64_linux();
+        program.reports[i].peak_rss_kb = peak_rss_kb();
+        if (key != 0) {
+            cache_write_interface(key);
+            cache_replace(i, path, key);
+        }
+        file_close();
+        arrput(program.cache_keys, key);
     }
+    while (program.running > 0) {
+        assemble_wait();
+    }
+    for (size_t i = 0; i < arrlenu(program.cache_keys); i++) {
+        if (program.cache_keys[i] != 0) {
+            double cache_start = now();
+            cache_store(i, program.cache_keys[i]);
+            program.file_num = i;
+            report_phase(PHASE_CACHE, cache_start);
+        }
+    }
+    arrfree(program.cache_keys);
+    write_deps(argc, argv, std);
 }
 
 void program_finish(char *file, char *link, char *std) {
-    for (size_t i = 0; i < arrlenu(program.tokens); i++) {
-        free(program.tokens[i].val);
-    }
     for (size_t i = 0; i < arrlenu(program.file_path); i++) {
         free(program.file_path[i]);
     }
-    for (size_t i = 0; i < shlenu(program.procs); i++) {
-        for (size_t j = 0; j < shlenu(program.procs[i].value.vars); j++) {
-            free(program.procs[i].value.vars[j].value.name);
-        }
-        shfree(program.procs[i].value.vars);
+    for (size_t i = 0; i < hmlenu(program.procs); i++) {
+        hmfree(program.procs[i].value.vars);
     }
-    for (size_t i = 0; i < shlenu(program.exports); i++) {
+    for (size_t i = 0; i < hmlenu(program.exports); i++) {
         arrfree(program.exports[i].value);
     }
     arrfree(program.tokens);
     arrfree(program.positions);
     arrfree(program.file_path);
-    shfree(program.procs);
-    shfree(program.exports);
+    hmfree(program.procs);
+    hmfree(program.exports);
+    shfree(program.interned);
 
     if (!has_main_in_files) {
         fprintf(stderr, "ERROR: program without a main entry point\n");
         exit(1);
     }
+    double link_start = now();
     system(link);
+    program.link_time = now() - link_start;
+    report_print();
+    arrfree(program.reports);
+    arrfree(program.children);
     free(link);
     free(file);
     free(std);
 }
 
+// takes the options out of argv so only the files are left
+int parse_options(int argc, char **argv) {
+    int files = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-cache") == 0) {
+            program.cache = 0;
+        } else if (strcmp(argv[i], "--emit-asm") == 0) {
+            program.emit_asm = 1;
+        } else if (strcmp(argv[i], "--time-report") == 0) {
+            program.time_report = 1;
+        } else if (strcmp(argv[i], "--time-report=json") == 0) {
+            program.time_report = 2;
+        } else if (strcmp(argv[i], "--nasm") == 0) {
+            program.nasm = 1;
+        } else if (strcmp(argv[i], "-O0") == 0 || strcmp(argv[i], "-O1") == 0 || strcmp(argv[i], "-O2") == 0) {
+            program.opt = argv[i][2] - '0';
+            // so it's also cached as the same build
+            if (program.opt > ir_max_level()) program.opt = ir_max_level();
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            char *n = argv[i][2] != '\0' ? argv[i] + 2 : (i + 1 < argc ? argv[++i] : "");
+            char *end;
+            long jobs = strtol(n, &end, 10);
+            if (*n == '\0' || *end != '\0' || jobs < 1) {
+                fprintf(stderr, "[ERROR] '-j' expects a positive number of jobs\n");
+                exit(1);
+            }
+            program.jobs = jobs;
+        } else {
+            argv[files++] = argv[i];
+        }
+    }
+    return files;
+}
+
 int main(int argc, char **argv) {
+    program_init();
+    argc = parse_options(argc, argv);
     if (argc < 2) {
         fprintf(stderr, "[ERROR] File not provided\n[INFO] ssol needs at least one file path\n");
         exit(1);
@@ -2640,7 +5636,6 @@ int main(int argc, char **argv) {
     strcat(std_path, "/std/std.ssol");
     free(file_path);
 
-    program_init();
     program_generate_obj_files(argc, argv, std_path, file, link);
     program_finish(file, link, std_path);
     return 0;
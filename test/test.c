@@ -0,0 +1,476 @@
+// Regression tests: compiles the sample programs and bench/kernels with
+// ./ssol, runs them and checks each exits with 0 after printing exactly what
+// test/expected has for it, which was recorded from known-good builds (the C
+// versions for the kernels).
+// Every program is built with each set of flags in 'modes'.
+// Builds use the object cache like a plain ./ssol does, the default build
+// of every program is repeated once the cache is warm and test_cache_imports
+// checks that changing an imported module rebuilds the modules importing it.
+// Then random programs from fuzz_program, seeded with 'first' to 'last' so
+// a failing seed can be run again on its own, are built with every set of
+// flags in 'fuzz_modes' and have to behave the same as at -O0.
+//   make test                     everything, with seeds 1 to 200
+//   make fuzz                     only the fuzzer, with seeds 1 to 2000
+//   ./test/test first last        only the fuzzer, with the given seeds
+//   ./test/test first last keep   also keeps the programs that fail
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+char *test_dir = "/tmp/ssol-test";
+
+// test/expected/<path without .ssol>.out is what each of them prints, or
+// .cksum when that's too big to check in
+char *programs[] = {
+    // examples/func.ssol is left out, it doesn't compile yet
+    "examples/hello.ssol",
+    "examples/person.ssol",
+    "examples/rule110.ssol",
+    "euler/problem-01.ssol",
+    "euler/problem-02.ssol",
+    "data-structures/list.ssol",
+    "bench/kernels/euler1.ssol",
+    "bench/kernels/euler2.ssol",
+    "bench/kernels/rule110.ssol",
+    "bench/kernels/list.ssol",
+    "bench/kernels/strings.ssol",
+    "bench/kernels/calls.ssol",
+};
+
+char *modes[] = {
+    "",
+    "--nasm",
+    "-O0",
+    "-O2",
+    "-O0 --nasm",
+};
+
+// checked against -O0, which doesn't run any of the IR passes
+char *fuzz_modes[] = {"", "-O2", "--nasm", "-O2 --nasm"};
+
+char ssol[PATH_MAX];
+char root[PATH_MAX];
+
+void test_system(char *cmd) {
+    if (system(cmd) != 0) {
+        fprintf(stderr, "[ERROR] '%s' failed\n", cmd);
+        exit(1);
+    }
+}
+
+void test_write(char *name, char *text) {
+    char path[PATH_MAX];
+    sprintf(path, "%s/%s", test_dir, name);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "[ERROR] can't create '%s'\n", path);
+        exit(1);
+    }
+    fputs(text, f);
+    fclose(f);
+}
+
+int test_same_output(char *a, char *b) {
+    FILE *fa = fopen(a, "rb");
+    FILE *fb = fopen(b, "rb");
+    int same = fa != NULL && fb != NULL;
+    while (same) {
+        int ca = fgetc(fa);
+        int cb = fgetc(fb);
+        if (ca != cb) same = 0;
+        if (ca == EOF) break;
+    }
+    if (fa != NULL) fclose(fa);
+    if (fb != NULL) fclose(fb);
+    return same;
+}
+
+// whether the file 'out' is what 'expected' says it should be
+int test_matches(char *expected, char *out) {
+    // outputs too big to check in are kept as the line cksum prints for them
+    size_t len = strlen(expected);
+    if (len > 6 && strcmp(expected + len - 6, ".cksum") == 0) {
+        char cmd[PATH_MAX * 2], want[128] = "", got[128] = "";
+        FILE *f = fopen(expected, "r");
+        if (f == NULL || fgets(want, sizeof(want), f) == NULL) want[0] = '\0';
+        if (f != NULL) fclose(f);
+        sprintf(cmd, "cksum < %s", out);
+        FILE *p = popen(cmd, "r");
+        if (p == NULL || fgets(got, sizeof(got), p) == NULL) got[0] = '\0';
+        if (p != NULL) pclose(p);
+        return want[0] != '\0' && strcmp(want, got) == 0;
+    }
+    return test_same_output(expected, out);
+}
+
+// builds 'files' with 'flags' in test_dir and runs the program with its
+// output going to 'out', returns the exit status of the program, -1 when it
+// doesn't compile and -2 when it's killed or runs for longer than 10 seconds
+int test_run(char *flags, char *files, char *out) {
+    char cmd[PATH_MAX * 4];
+    sprintf(cmd, "cd %s && rm -f output && %s %s %s >/dev/null 2>%s/err", test_dir, ssol, flags, files, test_dir);
+    if (system(cmd) != 0) return -1;
+    sprintf(cmd, "%s/output", test_dir);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || dup2(fd, 1) == -1 || dup2(fd, 2) == -1) _exit(127);
+        alarm(10);
+        execl(cmd, cmd, (char *)NULL);
+        _exit(127);
+    }
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status)) return -2;
+    return WEXITSTATUS(status);
+}
+
+// builds and runs 'files', which has to exit with 0 after printing what the
+// file 'expected' has, prints what went wrong and returns 1 if it didn't
+int test_expect(char *name, char *flags, char *files, char *expected) {
+    char out[PATH_MAX];
+    sprintf(out, "%s/out.txt", test_dir);
+    int status = test_run(flags, files, out);
+    char *how = flags[0] != '\0' ? flags : "the default flags";
+    if (status == -1) {
+        printf("FAIL %s: doesn't compile with %s\n", name, how);
+    } else if (status != 0) {
+        printf("FAIL %s: exits with %d with %s\n", name, status, how);
+    } else if (!test_matches(expected, out)) {
+        printf("FAIL %s: doesn't print what's expected with %s\n", name, how);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// checks every build of the sample 'path', returns the number that failed
+int test_program(char *path) {
+    char src[PATH_MAX * 2], expected[PATH_MAX * 2];
+    sprintf(src, "%s/%s", root, path);
+    sprintf(expected, "%s/test/expected/%.*s.out", root, (int)(strlen(path) - strlen(".ssol")), path);
+    if (access(expected, R_OK) != 0) {
+        strcpy(expected + strlen(expected) - strlen(".out"), ".cksum");
+    }
+    int failed = 0;
+    for (size_t m = 0; m < sizeof(modes) / sizeof(*modes); m++) {
+        failed += test_expect(path, modes[m], src, expected);
+    }
+    // every module of this one is in the cache by now
+    char name[PATH_MAX + 16];
+    sprintf(name, "%s (cached)", path);
+    failed += test_expect(name, "", src, expected);
+    return failed;
+}
+
+// builds main.ssol against the modules it imports, changing them between
+// builds so a stale object taken from the cache would print something else,
+// returns the number of builds that failed
+int test_cache_imports() {
+    char expected[PATH_MAX];
+    sprintf(expected, "%s/expected.txt", test_dir);
+    int failed = 0;
+
+    test_write("lib.ssol", "proc value 1 end\nexport value end\n");
+    test_write("main.ssol", "import \"lib.ssol\"\nproc main value print end\n");
+    test_write("expected.txt", "1\n");
+    failed += test_expect("cache: import", "", "lib.ssol main.ssol", expected);
+    failed += test_expect("cache: import (cached)", "", "lib.ssol main.ssol", expected);
+
+    test_write("lib.ssol", "proc value 2 end\nexport value end\n");
+    test_write("expected.txt", "2\n");
+    failed += test_expect("cache: changed import", "", "lib.ssol main.ssol", expected);
+
+    // 'value' moves, main has to be rebuilt to call it at its new address
+    test_write("lib.ssol", "proc other 5 end\nproc value 2 end\nexport value end\n");
+    failed += test_expect("cache: moved export", "", "lib.ssol main.ssol", expected);
+
+    test_write("a.ssol", "proc a-value 1 end\nexport a-value end\n");
+    test_write("b.ssol", "proc b-value 2 end\nexport b-value end\n");
+    test_write("main.ssol", "import \"a.ssol\"\nimport \"b.ssol\"\nproc main a-value print b-value print end\n");
+    test_write("expected.txt", "1\n2\n");
+    failed += test_expect("cache: two imports", "", "a.ssol b.ssol main.ssol", expected);
+    failed += test_expect("cache: imports reordered", "", "b.ssol a.ssol main.ssol", expected);
+    failed += test_expect("cache: imports reordered back", "", "a.ssol b.ssol main.ssol", expected);
+    return failed;
+}
+
+int test_same_behaviour(char *src, char *name) {
+    char ref[PATH_MAX], out[PATH_MAX];
+    sprintf(ref, "%s/ref.txt", test_dir);
+    sprintf(out, "%s/out.txt", test_dir);
+    int ref_status = test_run("-O0", src, ref);
+    if (ref_status == -1) {
+        printf("FAIL %s: doesn't compile at -O0\n", name);
+        return 1;
+    }
+    int failed = 0;
+    for (size_t m = 0; m < sizeof(fuzz_modes) / sizeof(*fuzz_modes); m++) {
+        char *how = fuzz_modes[m][0] != '\0' ? fuzz_modes[m] : "the default flags";
+        int status = test_run(fuzz_modes[m], src, out);
+        if (status == -1) {
+            printf("FAIL %s: doesn't compile with %s\n", name, how);
+            failed++;
+        } else if (status != ref_status) {
+            printf("FAIL %s: exits with %d with %s, %d at -O0\n", name, status, how, ref_status);
+            failed++;
+        } else if (!test_same_output(ref, out)) {
+            printf("FAIL %s: prints something else with %s than at -O0\n", name, how);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+// a growable string, the fuzzer builds every body in its own one because
+// a body that takes values from the stack gets them pushed in front of it
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} buf_t;
+
+void buf_printf(buf_t *buf, char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (buf->len + n + 1 > buf->cap) {
+        buf->cap = (buf->len + n + 1) * 2;
+        buf->data = realloc(buf->data, buf->cap);
+        if (buf->data == NULL) {
+            fprintf(stderr, "[ERROR] out of memory\n");
+            exit(1);
+        }
+    }
+    va_start(args, fmt);
+    vsnprintf(buf->data + buf->len, n + 1, fmt, args);
+    va_end(args);
+    buf->len += n;
+}
+
+uint64_t fuzz_state;
+
+uint64_t fuzz_next() {
+    fuzz_state ^= fuzz_state << 13;
+    fuzz_state ^= fuzz_state >> 7;
+    fuzz_state ^= fuzz_state << 17;
+    return fuzz_state;
+}
+
+size_t fuzz_below(size_t n) {
+    return fuzz_next() % n;
+}
+
+#define FUZZ_PICK(arr) (arr)[fuzz_below(sizeof(arr) / sizeof(*(arr)))]
+
+char *fuzz_types[] = {"byte", "short", "int", "long"};
+char *fuzz_globals[] = {"g0", "g1", "g2"};
+char *fuzz_locals[] = {"l0", "l1", "l2"};
+char *fuzz_global_types[3];
+
+// a random literal, mostly small but also the edges of every type size
+void fuzz_num(buf_t *buf) {
+    static uint64_t edges[] = {255, 256, 65535, 65536, 2147483647, 2147483648, 4294967295, 4294967296, 9223372036854775807, 18446744073709551615u};
+    size_t r = fuzz_below(10);
+    if (r < 5) {
+        buf_printf(buf, "%lu ", (unsigned long)fuzz_below(21));
+    } else if (r < 8) {
+        buf_printf(buf, "%lu ", (unsigned long)fuzz_below(100001));
+    } else if (r < 9) {
+        buf_printf(buf, "%lu ", (unsigned long)FUZZ_PICK(edges));
+    } else {
+        buf_printf(buf, "%lu ", (unsigned long)fuzz_next());
+    }
+}
+
+// 'n' random operations that leave the stack as deep as they found it, with
+// ifs and loops nested up to two deep
+void fuzz_body(buf_t *out, size_t n, int nest) {
+    enum {
+        F_PUSH, F_DUP, F_DROP, F_SET, F_PRINT, F_ZERO, F_NOT, F_BNOT, F_LOAD,
+        F_STR, F_WRITE, F_MEMORY, F_BIN, F_SWAP, F_CMP, F_DIV, F_SHIFT, F_STORE,
+        F_GE, F_ROT, F_OVER, F_IF, F_LOOP, F_GET, F_ADR,
+        F_ILOAD, F_ISTORE,
+        F_CALL,
+    };
+    buf_t code = {0};
+    buf_printf(&code, "%s", "");
+    long d = 0;
+    for (size_t i = 0; i < n; i++) {
+        int choices[48];
+        size_t count = 0;
+        choices[count++] = F_PUSH;
+        choices[count++] = F_PUSH;
+        choices[count++] = F_PUSH;
+        choices[count++] = F_STR;
+        choices[count++] = F_WRITE;
+        if (d >= 1) {
+            int more[] = {
+                F_DUP, F_DROP, F_SET, F_PRINT, F_ZERO, F_NOT, F_BNOT, F_LOAD, F_MEMORY,
+                F_ILOAD,
+                F_CALL,
+            };
+            for (size_t j = 0; j < sizeof(more) / sizeof(*more); j++) choices[count++] = more[j];
+        }
+        if (d >= 2) {
+            int more[] = {
+                F_BIN, F_BIN, F_BIN, F_SWAP, F_CMP, F_DIV, F_SHIFT, F_STORE,
+                F_ISTORE,
+            };
+            for (size_t j = 0; j < sizeof(more) / sizeof(*more); j++) choices[count++] = more[j];
+        }
+        if (d >= 3) {
+            choices[count++] = F_ROT;
+            choices[count++] = F_OVER;
+        }
+        if (d >= 4) choices[count++] = F_GE;
+        if (nest < 2 && d >= 1) choices[count++] = F_IF;
+        if (nest < 2) choices[count++] = F_LOOP;
+        choices[count++] = F_GET;
+        choices[count++] = F_GET;
+        choices[count++] = F_ADR;
+
+        static char *bins[] = {"+", "-", "*", "&", "|", "^"};
+        static char *cmps[] = {"==", "!=", "<", ">", "<="};
+        static char *divs[] = {"/", "%"};
+        static char *shifts[] = {">>", "<<"};
+        static char *strs[] = {"", "a", "fuzz", "two\\nlines", "tab\\tand \\\"quote\\\""};
+        static char *calls[] = {"f", "h"};
+        size_t var = fuzz_below(6);
+        char *name = var < 3 ? fuzz_globals[var] : fuzz_locals[var - 3];
+        size_t g = fuzz_below(3);
+        switch (choices[fuzz_below(count)]) {
+        case F_PUSH: fuzz_num(&code); d++; break;
+        case F_DUP: buf_printf(&code, "dup "); d++; break;
+        case F_DROP: buf_printf(&code, "drop "); d--; break;
+        case F_SWAP: buf_printf(&code, "swap "); break;
+        case F_ROT: buf_printf(&code, "rot "); break;
+        case F_OVER: buf_printf(&code, "over "); d++; break;
+        case F_PRINT: buf_printf(&code, "print "); d--; break;
+        case F_BIN: buf_printf(&code, "%s ", FUZZ_PICK(bins)); d--; break;
+        case F_ZERO: buf_printf(&code, "0 == "); break;
+        case F_NOT: buf_printf(&code, "not "); break;
+        case F_BNOT: buf_printf(&code, "~ "); break;
+        case F_CMP: buf_printf(&code, "%s ", FUZZ_PICK(cmps)); d--; break;
+        case F_GE: buf_printf(&code, ">= "); d -= 3; break;
+        case F_DIV: buf_printf(&code, "1 | %s ", FUZZ_PICK(divs)); d--; break;
+        case F_SHIFT: buf_printf(&code, "63 & %s ", FUZZ_PICK(shifts)); d--; break;
+        case F_GET: buf_printf(&code, "%s ", name); d++; break;
+        case F_SET: buf_printf(&code, "= %s ", name); d--; break;
+        case F_ADR: buf_printf(&code, "$%s @%s ", fuzz_globals[g], fuzz_global_types[g]); d++; break;
+        case F_LOAD: buf_printf(&code, "drop $arr %lu 8 * + @long ", (unsigned long)fuzz_below(4)); break;
+        case F_STORE: buf_printf(&code, "drop $arr %lu 8 * + swap !long ", (unsigned long)fuzz_below(4)); d -= 2; break;
+        case F_ILOAD: buf_printf(&code, "3 & $arr swap 8 * + @long "); break;
+        case F_ISTORE: buf_printf(&code, "3 & 8 * $arr + swap !long "); d -= 2; break;
+        // the length of a string, or what write(2) returns for it
+        case F_STR: buf_printf(&code, "\"%s\" drop ", FUZZ_PICK(strs)); d++; break;
+        case F_WRITE: buf_printf(&code, "\"%s\" 1 1 syscall3 ", FUZZ_PICK(strs)); d++; break;
+        // a value that went through a malloc'ed long
+        case F_MEMORY: buf_printf(&code, "8 memory dup rot !long dup @long swap delete "); break;
+        case F_CALL: buf_printf(&code, "%s ", FUZZ_PICK(calls)); break;
+        case F_IF:
+            buf_printf(&code, "if dup 3 & 1 > do ");
+            fuzz_body(&code, fuzz_below(7), nest + 1);
+            buf_printf(&code, "else 0 drop ");
+            fuzz_body(&code, fuzz_below(7), nest + 1);
+            buf_printf(&code, "end ");
+            break;
+        case F_LOOP:
+            buf_printf(&code, "0 loop dup 3 < do ");
+            fuzz_body(&code, fuzz_below(7), nest + 1);
+            buf_printf(&code, "1 + end drop ");
+            break;
+        }
+    }
+    for (; d > 0; d--) buf_printf(&code, "drop ");
+    for (; d < 0; d++) fuzz_num(out);
+    buf_printf(out, "%s", code.data);
+    free(code.data);
+}
+
+// writes a random program that prints every variable at the end, it only
+// uses operations whose result doesn't depend on the optimization level
+void fuzz_program(FILE *f, uint64_t seed) {
+    fuzz_state = seed * 0x9e3779b97f4a7c15u + 1;
+    for (size_t i = 0; i < 3; i++) fuzz_global_types[i] = FUZZ_PICK(fuzz_types);
+    fprintf(f, "var arr long 4 end\n");
+    for (size_t i = 0; i < 3; i++) fprintf(f, "var %s %s end\n", fuzz_globals[i], fuzz_global_types[i]);
+    fprintf(f, "proc f = var fa long end fa 3 * fa + end\n");
+    fprintf(f, "proc h if dup 1 & do 7 + else 3 * end end\n");
+    fprintf(f, "proc main\n");
+    fprintf(f, "    0 = g0 0 = g1 0 = g2 0 = arr[0] 0 = arr[1] 0 = arr[2] 0 = arr[3]\n");
+    fprintf(f, "    var l0 long end var l1 int end var l2 %s end 5 = l0 7 = l1 9 = l2\n", fuzz_types[fuzz_below(2)]);
+    buf_t body = {0};
+    buf_printf(&body, "%s", "");
+    fuzz_body(&body, 60, 0);
+    fprintf(f, "    %s\n", body.data);
+    free(body.data);
+    fprintf(f, "    g0 print g1 print g2 print l0 print l1 print l2 print arr[0] print arr[3] print\n");
+    fprintf(f, "end\n");
+}
+
+// runs the fuzzer on the seeds 'first' to 'last', returns how many failed
+int test_fuzz(uint64_t first, uint64_t last, int keep) {
+    int failed = 0;
+    for (uint64_t seed = first; seed <= last; seed++) {
+        char src[PATH_MAX], name[64];
+        sprintf(src, "%s/fuzz.ssol", test_dir);
+        sprintf(name, "seed %lu", (unsigned long)seed);
+        FILE *f = fopen(src, "w");
+        if (f == NULL) {
+            fprintf(stderr, "[ERROR] can't create '%s'\n", src);
+            exit(1);
+        }
+        fuzz_program(f, seed);
+        fclose(f);
+        if (test_same_behaviour(src, name) != 0) {
+            failed++;
+            if (keep) {
+                char cmd[PATH_MAX * 2];
+                sprintf(cmd, "cp %s fuzz-%lu.ssol", src, (unsigned long)seed);
+                test_system(cmd);
+            }
+        }
+    }
+    printf("seeds %lu to %lu, %d failed\n", (unsigned long)first, (unsigned long)last, failed);
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    if (realpath("ssol", ssol) == NULL || getcwd(root, sizeof(root)) == NULL) {
+        fprintf(stderr, "[ERROR] run from the repository root after 'make ssol'\n");
+        return 1;
+    }
+    if (argc != 1 && argc != 3 && !(argc == 4 && strcmp(argv[3], "keep") == 0)) {
+        fprintf(stderr, "usage: %s [first last [keep]]\n", argv[0]);
+        return 1;
+    }
+    char cmd[PATH_MAX * 2];
+    sprintf(cmd, "rm -rf %s && mkdir -p %s", test_dir, test_dir);
+    test_system(cmd);
+
+    int failed = 0;
+    if (argc == 1) {
+        for (size_t i = 0; i < sizeof(programs) / sizeof(*programs); i++) {
+            failed += test_program(programs[i]) != 0;
+        }
+        printf("%lu programs, %d failed\n", (unsigned long)(sizeof(programs) / sizeof(*programs)), failed);
+        int cache_failed = test_cache_imports();
+        printf("cache, %d failed\n", cache_failed);
+        failed += cache_failed;
+    }
+    uint64_t first = argc == 1 ? 1 : strtoull(argv[1], NULL, 10);
+    uint64_t last = argc == 1 ? 200 : strtoull(argv[2], NULL, 10);
+    failed += test_fuzz(first, last, argc == 4);
+
+    sprintf(cmd, "rm -rf %s", test_dir);
+    test_system(cmd);
+    return failed != 0;
+}